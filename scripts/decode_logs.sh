@@ -0,0 +1,20 @@
+#!/bin/sh
+# Decode a dictionary-logging capture from a prod.conf build.
+#
+#   scripts/decode_logs.sh build/zephyr/log_dictionary.json capture.txt
+#
+# The capture is the raw hex the UART backend prints, e.g. from
+#   west espressif monitor > capture.txt
+set -e
+
+if [ $# -ne 2 ]; then
+    echo "usage: $0 <log_dictionary.json> <capture>" >&2
+    exit 1
+fi
+
+if [ -z "$ZEPHYR_BASE" ]; then
+    echo "ZEPHYR_BASE isn't set, source zephyr-env.sh first" >&2
+    exit 1
+fi
+
+exec python3 "$ZEPHYR_BASE/scripts/logging/dictionary/log_parser.py" --hex "$1" "$2"
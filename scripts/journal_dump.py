@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+"""Fetch and decode a box's event journal over MQTT.
+
+Publishes the first wanted sequence number on
+owlcms/diag/<platform>/<ref>/journal/get and decodes the chunks that come
+back on owlcms/diag/<platform>/<ref>/journal until the empty end marker.
+Times are milliseconds since the boot entry before them. A jump in the
+sequence numbers is either entries dropped on the box (buffer full) or a
+chunk lost on the way, run again with --from to fill it in.
+
+    pip install paho-mqtt
+    scripts/journal_dump.py --broker 192.168.1.10 --platform A --ref 1
+"""
+
+import argparse
+import struct
+import threading
+
+import paho.mqtt.client as mqtt
+
+ENTRY = struct.Struct("<IIBBh")
+
+BUTTONS = {0: "usr", 1: "red", 2: "black"}
+BUTTON_EVTS = {0: "pressed", 1: "released", 2: "hold 2s", 3: "hold 5s"}
+DECISIONS = {0: "good", 1: "bad"}
+LINKS = {0: "wifi", 1: "mqtt", 2: "relay"}
+CONFIGS = {0: "applied", 1: "confirmed", 2: "rolled back"}
+FATALS = {0: "cpu exception", 1: "spurious irq", 2: "stack check", 3: "kernel oops",
+          4: "kernel panic"}
+
+
+def describe(etype, arg, val):
+    if etype == 1:
+        return "boot"
+    if etype == 2:
+        return f"button {BUTTONS.get(arg, arg)} {BUTTON_EVTS.get(val, val)}"
+    if etype == 3:
+        via = " via relay" if arg & 0x80 else ""
+        result = "ok" if val == 0 else f"failed {val}"
+        return f"decision {DECISIONS.get(arg & 0x7f, arg)}{via} {result}"
+    if etype == 4:
+        return f"{LINKS.get(arg, arg)} {'up' if val else 'down'}"
+    if etype == 5:
+        return f"config {CONFIGS.get(arg, arg)} (changed 0x{val:x})"
+    if etype == 6:
+        return f"fatal error {FATALS.get(arg, arg)}, rebooted"
+    return f"type {etype} arg {arg} val {val}"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--broker", required=True)
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--platform", required=True)
+    parser.add_argument("--ref", type=int, required=True)
+    parser.add_argument("--from", dest="from_seq", type=int, default=0)
+    parser.add_argument("--timeout", type=float, default=30.0)
+    args = parser.parse_args()
+
+    base = f"owlcms/diag/{args.platform}/{args.ref}/journal"
+    done = threading.Event()
+    last_seq = [None]
+
+    def on_message(client, userdata, msg):
+        if not msg.payload:
+            done.set()
+            return
+        for seq, time_ms, etype, arg, val in ENTRY.iter_unpack(msg.payload):
+            if last_seq[0] is not None and seq != last_seq[0] + 1:
+                print(f"--- {seq - last_seq[0] - 1} entries missing")
+            last_seq[0] = seq
+            print(f"{seq:8d} {time_ms / 1000:10.3f}  {describe(etype, arg, val)}")
+
+    client = mqtt.Client()
+    client.on_message = on_message
+    client.connect(args.broker, args.port)
+    client.subscribe(base)
+    client.loop_start()
+    client.publish(f"{base}/get", str(args.from_seq))
+
+    if not done.wait(args.timeout):
+        print("timed out before the end of the journal")
+    client.loop_stop()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,274 @@
+#!/usr/bin/env python3
+"""Press to broker latency of the native_posix firmware against a local broker.
+
+Starts build/zephyr/zephyr.exe, waits for its first health report with
+both links up, then presses the red and black buttons through the "sim btn"
+shell command on the firmware's stdin and times each decision's arrival on
+owlcms/decision/<platform>. One press is in flight at a time. Each scenario
+runs the same number of presses:
+
+    idle        nothing else on the broker
+    keepalive   steady background traffic, pings on the box's ping topic
+                that it answers on its pong topic
+    summon      a flood of summon messages to the box, each one sounds the
+                buzzer
+
+The results are written as JSON, one object per scenario with p50, p99 and
+max in milliseconds, so the figures can be compared release over release.
+The host clock starts when the press command is written, so the figures
+include the shell parsing the line, a fixed cost that is the same in every
+release. The network setup and broker are described in the README.
+
+    pip install paho-mqtt
+    west build -b native_posix
+    scripts/latency_bench.py --exe build/zephyr/zephyr.exe --presses 2000 -o latency.json
+"""
+
+import argparse
+import json
+import os
+import statistics
+import subprocess
+import sys
+import threading
+import time
+
+import paho.mqtt.client as mqtt
+
+SCENARIOS = ("idle", "keepalive", "summon")
+DECISIONS = {"red": "good", "blk": "bad"}
+
+
+class Box:
+    """The firmware process, with its shell on stdin."""
+
+    def __init__(self, exe, ref, log):
+        self.proc = subprocess.Popen([exe, f"--ref={ref}"], stdin=subprocess.PIPE,
+                                     stdout=log, stderr=subprocess.STDOUT)
+
+    def shell(self, line):
+        self.proc.stdin.write((line + "\n").encode())
+        self.proc.stdin.flush()
+
+    def alive(self):
+        return self.proc.poll() is None
+
+    def stop(self):
+        if self.alive():
+            self.proc.terminate()
+            try:
+                self.proc.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                self.proc.kill()
+
+
+class Background(threading.Thread):
+    """Publishes to the box at a fixed rate until stopped."""
+
+    def __init__(self, client, topic, payload, rate):
+        super().__init__(daemon=True)
+        self.client = client
+        self.topic = topic
+        self.payload = payload
+        self.period = 1.0 / rate
+        self.sent = 0
+        self.done = threading.Event()
+
+    def run(self):
+        next_at = time.monotonic()
+        while not self.done.is_set():
+            payload = self.payload(self.sent) if callable(self.payload) else self.payload
+            self.client.publish(self.topic, payload)
+            self.sent += 1
+            next_at += self.period
+            self.done.wait(max(0.0, next_at - time.monotonic()))
+
+
+def percentile(ordered, pct):
+    return ordered[min(len(ordered) - 1, int(len(ordered) * pct / 100))]
+
+
+def run_scenario(name, args, box, client, arrivals):
+    prefix = f"{args.platform}/{args.ref}"
+    background = None
+    if name == "keepalive":
+        background = Background(client, f"owlcms/ping/{prefix}", lambda seq: f"bg {seq}",
+                                args.keepalive_rate)
+    elif name == "summon":
+        background = Background(client, f"owlcms/summon/{prefix}", "on", args.summon_rate)
+    if background is not None:
+        background.start()
+
+    results = []
+    lost = 0
+    for i in range(args.presses):
+        btn = "red" if i % 2 == 0 else "blk"
+        expected = f"{args.ref} {DECISIONS[btn]}"
+        arrivals.clear()
+
+        sent = time.monotonic()
+        box.shell(f"sim btn {btn} press")
+        got = arrivals.wait_for(expected, args.timeout)
+        box.shell(f"sim btn {btn} release")
+
+        if got is None:
+            lost += 1
+            if not box.alive():
+                break
+        else:
+            results.append((got - sent) * 1000)
+        # let the release debounce and msys settle back in S_IDLE_CONN
+        time.sleep(args.gap)
+
+    if background is not None:
+        background.done.set()
+        background.join()
+
+    out = {"scenario": name, "presses": args.presses, "received": len(results), "lost": lost}
+    if background is not None:
+        out["background_msgs"] = background.sent
+    if results:
+        results.sort()
+        out.update({
+            "p50_ms": round(percentile(results, 50), 2),
+            "p99_ms": round(percentile(results, 99), 2),
+            "max_ms": round(results[-1], 2),
+            "mean_ms": round(statistics.fmean(results), 2),
+        })
+    return out
+
+
+class Arrivals:
+    """Decision messages as they arrive, matched against the press in flight."""
+
+    def __init__(self):
+        self.cond = threading.Condition()
+        self.seen = []
+
+    def on_message(self, client, userdata, msg):
+        now = time.monotonic()
+        with self.cond:
+            self.seen.append((msg.payload.decode(errors="replace"), now))
+            self.cond.notify_all()
+
+    def clear(self):
+        with self.cond:
+            self.seen.clear()
+
+    def wait_for(self, payload, timeout):
+        deadline = time.monotonic() + timeout
+        with self.cond:
+            while True:
+                for seen, at in self.seen:
+                    if seen == payload:
+                        return at
+                left = deadline - time.monotonic()
+                if left <= 0:
+                    return None
+                self.cond.wait(left)
+
+
+def watch_links(client, args):
+    """Set once a health report shows wifi and mqtt up, subscribed before the
+    box starts so the report sent when the links come up isn't missed."""
+    linked = threading.Event()
+
+    def on_health(client, userdata, msg):
+        try:
+            if json.loads(msg.payload).get("lk") == 3:
+                linked.set()
+        except ValueError:
+            pass
+
+    topic = f"owlcms/diag/{args.platform}/{args.ref}/health"
+    client.message_callback_add(topic, on_health)
+    client.subscribe(topic)
+    return linked
+
+
+def wait_linked(linked, args, box):
+    deadline = time.monotonic() + args.boot_timeout
+    while not linked.wait(0.5):
+        if not box.alive() or time.monotonic() > deadline:
+            return False
+    return True
+
+
+def git_describe():
+    try:
+        return subprocess.run(["git", "describe", "--always", "--dirty"], capture_output=True,
+                              text=True, check=True,
+                              cwd=os.path.dirname(os.path.abspath(__file__))).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--exe", default="build/zephyr/zephyr.exe")
+    parser.add_argument("--broker", default="192.0.2.2")
+    parser.add_argument("--port", type=int, default=1883)
+    # the Kconfig seed used by boards/native_posix.conf
+    parser.add_argument("--platform", default="A")
+    parser.add_argument("--ref", type=int, default=1)
+    parser.add_argument("--presses", type=int, default=2000)
+    parser.add_argument("--scenario", choices=SCENARIOS, action="append",
+                        help="run only these, repeatable, default all")
+    parser.add_argument("--keepalive-rate", type=float, default=10.0, help="pings per second")
+    parser.add_argument("--summon-rate", type=float, default=200.0, help="summons per second")
+    parser.add_argument("--gap", type=float, default=0.05, help="seconds between presses")
+    parser.add_argument("--timeout", type=float, default=2.0)
+    parser.add_argument("--boot-timeout", type=float, default=30.0)
+    parser.add_argument("--firmware-log", default="latency_bench_fw.log")
+    parser.add_argument("-o", "--output", help="JSON results file, default stdout")
+    args = parser.parse_args()
+
+    arrivals = Arrivals()
+    client = mqtt.Client()
+    client.connect(args.broker, args.port)
+    client.message_callback_add(f"owlcms/decision/{args.platform}", arrivals.on_message)
+    client.subscribe(f"owlcms/decision/{args.platform}")
+    linked = watch_links(client, args)
+    client.loop_start()
+
+    with open(args.firmware_log, "wb") as log:
+        box = Box(args.exe, args.ref, log)
+        try:
+            if not wait_linked(linked, args, box):
+                print(f"box didn't come up, see {args.firmware_log}", file=sys.stderr)
+                return 1
+            results = [run_scenario(name, args, box, client, arrivals)
+                       for name in (args.scenario or SCENARIOS)]
+            crashed = not box.alive()
+        finally:
+            box.stop()
+            client.loop_stop()
+
+    report = {
+        "firmware": git_describe(),
+        "time": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+        "broker": f"{args.broker}:{args.port}",
+        "scenarios": results,
+    }
+    text = json.dumps(report, indent=2)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+
+    for r in results:
+        if "p50_ms" in r:
+            print(f"{r['scenario']:>9}: {r['received']}/{r['presses']} p50 {r['p50_ms']:.1f} "
+                  f"p99 {r['p99_ms']:.1f} max {r['max_ms']:.1f} ms", file=sys.stderr)
+        else:
+            print(f"{r['scenario']:>9}: no decisions received", file=sys.stderr)
+
+    if crashed:
+        print(f"firmware exited during the run, see {args.firmware_log}", file=sys.stderr)
+        return 1
+    return 0 if all(r["received"] for r in results) else 1
+
+
+if __name__ == "__main__":
+    raise SystemExit(main())
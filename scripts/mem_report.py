@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+"""Static RAM and flash use per subsystem, from the linker map.
+
+Every input section in the map is charged to the object it came from, app
+objects are grouped by module below, everything else by the library it was
+archived in. RAM is .bss, .noinit, .data and IRAM, flash is text, rodata
+and the load copy of .data and IRAM. Run it through the build:
+
+    west build -t mem_report
+    scripts/mem_report.py build/zephyr/zephyr.map
+"""
+
+import argparse
+import collections
+import os
+import re
+
+# app sources by subsystem, anything not listed shows up under its own name
+APP_SUBSYSTEMS = {
+    "comms": ["comms_mgr", "wifi_conn_esp32", "wifi_conn_native", "mqtt_client",
+              "owlcms_topics", "broker_resolver", "broker_failover", "ble_relay"],
+    "config": ["settings_util", "config_gatt_service", "ble_config_mgr"],
+    "io": ["io", "io_mgr", "sim_inputs", "ble_status_adv"],
+    "power": ["pwr_mgr", "energy_acct", "bat_mon"],
+    "diag": ["log_backend_mqtt", "journal", "alloc_guard", "diag_shell", "health_mon",
+             "perf_budget"],
+    "core": ["main", "msys", "task_handler"],
+}
+
+LIB_SUBSYSTEMS = [
+    (r"libkernel", "zephyr kernel"),
+    (r"subsys__bluetooth|libbt", "bluetooth"),
+    (r"subsys__net|libnet\.a|drivers__wifi", "networking"),
+    (r"libnet80211|libpp|libphy|libcore|libmesh|libespnow|librtc|libsmartconfig|libcoexist|libwpa", "wifi blobs"),
+    (r"mbedtls", "tls"),
+    (r"subsys__logging", "logging"),
+    (r"subsys__fs|subsys__storage|drivers__flash", "flash storage"),
+    (r"hal_espressif|modules__hal", "esp hal"),
+    (r"libc\.a|libm\.a|libgcc|libnosys|lib__libc", "libc"),
+]
+
+SECTION_RE = re.compile(r"^\s+(0x[0-9a-f]+)\s+(0x[0-9a-f]+)\s+(\S+)$")
+NAMED_SECTION_RE = re.compile(r"^\s(\.\S+)\s+(0x[0-9a-f]+)\s+(0x[0-9a-f]+)\s+(\S+)$")
+OUTPUT_SECTION_RE = re.compile(r"^(\.\S+)")
+
+# output sections by name or dotted prefix, ESP32 and native_posix layouts.
+# Anything else, text and rodata included, is flash only.
+RAM_SECTIONS = (".bss", ".sbss", ".noinit", ".dram0.bss", ".dram0.noinit", ".rtc.bss",
+                ".rtc.noinit")
+# held in RAM and loaded from a copy in flash
+LOADED_SECTIONS = (".data", ".sdata", ".dram0.data", ".iram0", ".rtc.data", ".rtc.text")
+
+
+def subsystem(origin):
+    match = re.search(r"libapp\.a\(([^)]+)\.c\.obj\)$", origin)
+    if match:
+        stem = match.group(1)
+        for name, modules in APP_SUBSYSTEMS.items():
+            if stem in modules:
+                return f"app/{name}"
+        return f"app/{stem}"
+
+    archive = origin.split("(")[0]
+    for pattern, name in LIB_SUBSYSTEMS:
+        if re.search(pattern, archive):
+            return name
+    return os.path.basename(archive) or "other"
+
+
+def section_in(output_section, names):
+    return any(output_section == name or output_section.startswith(name + ".")
+               for name in names)
+
+
+def classify(output_section):
+    # before the RAM names, .rodata and .flash.rodata also contain "data"
+    if "rodata" in output_section:
+        return ("flash",)
+    if section_in(output_section, RAM_SECTIONS):
+        return ("ram",)
+    if section_in(output_section, LOADED_SECTIONS):
+        return ("ram", "flash")
+    return ("flash",)
+
+
+def parse(map_path):
+    totals = collections.defaultdict(lambda: {"ram": 0, "flash": 0})
+    output_section = None
+    pending = False
+    in_map = False
+
+    with open(map_path) as f:
+        for line in f:
+            line = line.rstrip("\n")
+            if line.startswith("Linker script and memory map"):
+                in_map = True
+                continue
+            if not in_map:
+                continue
+
+            out = OUTPUT_SECTION_RE.match(line)
+            if out:
+                output_section = out.group(1)
+                pending = False
+                continue
+
+            named = NAMED_SECTION_RE.match(line)
+            if named:
+                size, origin = int(named.group(3), 16), named.group(4)
+            else:
+                plain = SECTION_RE.match(line) if pending else None
+                if plain is None:
+                    # long input section names wrap, the address is on the next line
+                    pending = line.startswith(" .") and len(line.split()) == 1
+                    continue
+                size, origin = int(plain.group(2), 16), plain.group(3)
+            pending = False
+
+            if size == 0 or output_section is None or output_section.startswith(".debug"):
+                continue
+            for kind in classify(output_section):
+                totals[subsystem(origin)][kind] += size
+
+    return totals
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("map", help="zephyr.map from the build directory")
+    parser.add_argument("--sort", choices=["ram", "flash"], default="ram")
+    args = parser.parse_args()
+
+    totals = parse(args.map)
+    print(f"{'subsystem':<24} {'ram':>9} {'flash':>9}")
+    for name, use in sorted(totals.items(), key=lambda kv: -kv[1][args.sort]):
+        print(f"{name:<24} {use['ram']:>9} {use['flash']:>9}")
+    print(f"{'total':<24} {sum(u['ram'] for u in totals.values()):>9} "
+          f"{sum(u['flash'] for u in totals.values()):>9}")
+
+
+if __name__ == "__main__":
+    main()
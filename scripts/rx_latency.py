@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+"""Measure broker -> box receive latency through the ping topic.
+
+Publishes timestamped pings on owlcms/ping/<platform>/<ref> and times the
+echo on owlcms/pong/<platform>/<ref>. The box only echoes when built with
+CONFIG_COMMS_MGR_PING_ECHO=y, and at most 20 a second. Run it against a
+local broker once per power profile (set with config TLV 0x10) and compare
+the figures; the box to broker leg is the same in every profile, so the
+difference between profiles is the receive side wakeup.
+
+    pip install paho-mqtt
+    scripts/rx_latency.py --broker 192.168.1.10 --platform A --ref 1
+"""
+
+import argparse
+import statistics
+import threading
+import time
+
+import paho.mqtt.client as mqtt
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--broker", required=True)
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--platform", required=True)
+    parser.add_argument("--ref", type=int, required=True)
+    parser.add_argument("--count", type=int, default=50)
+    # random spacing so pings don't line up with the beacon interval
+    parser.add_argument("--interval", type=float, default=1.0)
+    parser.add_argument("--timeout", type=float, default=3.0)
+    args = parser.parse_args()
+
+    ping_topic = f"owlcms/ping/{args.platform}/{args.ref}"
+    pong_topic = f"owlcms/pong/{args.platform}/{args.ref}"
+
+    pending = {}
+    results = []
+    lock = threading.Lock()
+
+    def on_message(client, userdata, msg):
+        now = time.monotonic()
+        seq = msg.payload.decode(errors="replace")
+        with lock:
+            sent = pending.pop(seq, None)
+        if sent is not None:
+            results.append((now - sent) * 1000)
+
+    client = mqtt.Client()
+    client.on_message = on_message
+    client.connect(args.broker, args.port)
+    client.subscribe(pong_topic)
+    client.loop_start()
+    time.sleep(0.5)
+
+    for seq in range(args.count):
+        with lock:
+            pending[str(seq)] = time.monotonic()
+        client.publish(ping_topic, str(seq))
+        time.sleep(args.interval * (0.5 + (seq * 7919 % 100) / 100))
+
+    time.sleep(args.timeout)
+    client.loop_stop()
+
+    lost = args.count - len(results)
+    if not results:
+        print(f"no echoes from {ping_topic}, is the box connected?")
+        return 1
+
+    results.sort()
+    p95 = results[min(len(results) - 1, int(len(results) * 0.95))]
+    print(f"{len(results)} echoes, {lost} lost")
+    print(f"rtt ms: min {results[0]:.1f} median {statistics.median(results):.1f} "
+          f"p95 {p95:.1f} max {results[-1]:.1f}")
+    return 0
+
+
+if __name__ == "__main__":
+    raise SystemExit(main())
@@ -0,0 +1,93 @@
+#include <logging/log.h>
+
+LOG_MODULE_REGISTER(alloc_guard, CONFIG_APP_LOG_LEVEL);
+
+#include <zephyr/zephyr.h>
+
+#include "alloc_guard.h"
+
+void *__real_k_malloc(size_t size);
+void *__real_k_calloc(size_t nmemb, size_t size);
+void *__real_k_aligned_alloc(size_t align, size_t size);
+
+static bool locked;
+static struct alloc_guard_stats stats;
+static void *sites[ALLOC_GUARD_MAX_SITES];
+static struct k_spinlock lock;
+static k_tid_t watched;
+static uint32_t watched_allocs;
+
+static void check(size_t size, void *caller)
+{
+    bool new_site = true;
+
+    if (watched != NULL && k_current_get() == watched)
+        watched_allocs++;
+    if (!locked)
+        return;
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    stats.late_allocs++;
+    stats.late_bytes += size;
+    for (uint8_t i = 0; i < stats.sites; i++)
+    {
+        if (sites[i] == caller)
+        {
+            new_site = false;
+            break;
+        }
+    }
+    if (new_site && stats.sites < ALLOC_GUARD_MAX_SITES)
+        sites[stats.sites++] = caller;
+    k_spin_unlock(&lock, key);
+
+    if (new_site)
+        LOG_ERR("heap alloc of %u bytes after init from %p", size, caller);
+
+#if defined(CONFIG_ALLOC_GUARD_FATAL)
+    k_panic();
+#endif
+}
+
+void *__wrap_k_malloc(size_t size)
+{
+    check(size, __builtin_return_address(0));
+    return __real_k_malloc(size);
+}
+
+void *__wrap_k_calloc(size_t nmemb, size_t size)
+{
+    check(nmemb * size, __builtin_return_address(0));
+    return __real_k_calloc(nmemb, size);
+}
+
+void *__wrap_k_aligned_alloc(size_t align, size_t size)
+{
+    check(size, __builtin_return_address(0));
+    return __real_k_aligned_alloc(align, size);
+}
+
+void alloc_guard_lock()
+{
+    locked = true;
+    LOG_INF("heap locked");
+}
+
+void alloc_guard_watch_begin()
+{
+    watched_allocs = 0;
+    watched = k_current_get();
+}
+
+uint32_t alloc_guard_watch_end()
+{
+    watched = NULL;
+    return watched_allocs;
+}
+
+void alloc_guard_get_stats(struct alloc_guard_stats *out)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    *out = stats;
+    k_spin_unlock(&lock, key);
+}
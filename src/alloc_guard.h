@@ -0,0 +1,34 @@
+#ifndef ALLOC_GUARD_H_
+#define ALLOC_GUARD_H_
+
+#include <stdint.h>
+#include <zephyr/kernel.h>
+
+/*
+*   The firmware keeps everything in static buffers, the system heap is only
+*   for the wifi driver and whatever runs before the app is up. k_malloc,
+*   k_calloc and k_aligned_alloc are wrapped at link time (see CMakeLists.txt)
+*   and every call after alloc_guard_lock() is counted and its call site
+*   logged as an error, once per site. CONFIG_ALLOC_GUARD_FATAL panics
+*   instead, the wifi blob allocates on scans so that's for bench builds.
+*/
+
+#define ALLOC_GUARD_MAX_SITES   8
+
+struct alloc_guard_stats {
+    uint32_t late_allocs;
+    uint32_t late_bytes;
+    uint8_t sites;
+};
+
+// called once init is done, from then on the heap shouldn't be touched
+void alloc_guard_lock();
+void alloc_guard_get_stats(struct alloc_guard_stats *stats);
+
+// counts the calling thread's own allocations between begin and end, so a
+// budget isn't charged for what other threads (the wifi driver) allocate
+// meanwhile; one watch at a time
+void alloc_guard_watch_begin();
+uint32_t alloc_guard_watch_end();
+
+#endif
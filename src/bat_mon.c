@@ -0,0 +1,182 @@
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(bat_mon, CONFIG_APP_LOG_LEVEL);
+
+#include <zephyr/zephyr.h>
+#include <zephyr/drivers/adc.h>
+
+#include "bat_mon.h"
+#include "io.h"
+#include "pwr_mgr.h"
+
+// first sample once everything else is up
+#define BAT_MON_FIRST_SAMPLE_MS     1000
+// EMA weight of a new sample is 1 / 2^shift
+#define BAT_MON_EMA_SHIFT           2
+
+struct discharge_point {
+    uint16_t mv;
+    uint8_t percent;
+};
+
+// 1S LiPo at light load, highest first
+static const struct discharge_point discharge_curve[] = {
+    {4200, 100},
+    {4100, 90 },
+    {4000, 80 },
+    {3900, 65 },
+    {3800, 50 },
+    {3750, 40 },
+    {3700, 30 },
+    {3650, 20 },
+    {3600, 10 },
+    {3500, 5  },
+    {3300, 0  }
+};
+
+// steady draw in each power profile, what the sag compensation adds back
+static const uint16_t profile_load_ma[] = {
+    [PWR_PROFILE_AUTO]          = 60,
+    [PWR_PROFILE_COMPETITION]   = 120,
+    [PWR_PROFILE_BALANCED]      = 60,
+    [PWR_PROFILE_STANDBY]       = 30
+};
+
+static const struct adc_dt_spec bat_adc = ADC_DT_SPEC_GET(DT_PATH(zephyr_user));
+
+static int32_t ema_mv;
+static uint8_t bat_percent = BAT_MON_PERCENT_UNKNOWN;
+static void (*update_cb)(uint16_t mv, uint8_t percent);
+
+static void sample_battery(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(sample_work, sample_battery);
+
+static int read_median_mv(int32_t *mv)
+{
+    int16_t raw;
+    int32_t readings[BAT_MON_OVERSAMPLE];
+    struct adc_sequence sequence = {
+        .buffer = &raw,
+        .buffer_size = sizeof(raw)
+    };
+
+    adc_sequence_init_dt(&bat_adc, &sequence);
+    for (uint8_t i = 0; i < BAT_MON_OVERSAMPLE; i++)
+    {
+        int ret = adc_read(bat_adc.dev, &sequence);
+        if (ret != 0)
+            return ret;
+        readings[i] = raw;
+    }
+
+    // insertion sort, it's nine values
+    for (uint8_t i = 1; i < BAT_MON_OVERSAMPLE; i++)
+    {
+        int32_t r = readings[i];
+        int8_t j = i - 1;
+        for (; j >= 0 && readings[j] > r; j--)
+            readings[j + 1] = readings[j];
+        readings[j + 1] = r;
+    }
+
+    *mv = readings[BAT_MON_OVERSAMPLE / 2];
+    return adc_raw_to_millivolts_dt(&bat_adc, mv);
+}
+
+static uint8_t mv_to_percent(uint16_t mv)
+{
+    if (mv >= discharge_curve[0].mv)
+        return discharge_curve[0].percent;
+
+    for (uint8_t i = 1; i < ARRAY_SIZE(discharge_curve); i++)
+    {
+        const struct discharge_point *hi = &discharge_curve[i - 1];
+        const struct discharge_point *lo = &discharge_curve[i];
+        if (mv >= lo->mv)
+            return lo->percent + (mv - lo->mv) * (hi->percent - lo->percent) / (hi->mv - lo->mv);
+    }
+    return 0;
+}
+
+static void sample_battery(struct k_work *work)
+{
+    int32_t mv;
+
+    if (io_buzzer_is_on())
+    {
+        k_work_reschedule(&sample_work, K_MSEC(BAT_MON_BUSY_RETRY_MS));
+        return;
+    }
+    k_work_reschedule(&sample_work, K_MSEC(BAT_MON_SAMPLE_MS));
+
+    if (read_median_mv(&mv) != 0)
+    {
+        LOG_ERR("battery read failed");
+        return;
+    }
+
+    mv = mv * BAT_MON_DIVIDER_NUM / BAT_MON_DIVIDER_DEN;
+    // what the cell would read unloaded
+    mv += profile_load_ma[pwr_mgr_get_profile()] * BAT_MON_INTERNAL_MOHM / 1000;
+
+    if (ema_mv == 0)
+        ema_mv = mv;
+    else
+        ema_mv += (mv - (int32_t)ema_mv) >> BAT_MON_EMA_SHIFT;
+
+    uint8_t percent = mv_to_percent(ema_mv);
+    LOG_DBG("battery %d mV, filtered %d mV %u%%", mv, ema_mv, percent);
+    if (percent != bat_percent)
+    {
+        bat_percent = percent;
+        if (update_cb != NULL)
+            update_cb(ema_mv, percent);
+    }
+}
+
+int bat_mon_init()
+{
+    int ret;
+
+    if (!device_is_ready(bat_adc.dev))
+    {
+        LOG_ERR("Failed to initialise ADC for battery monitor");
+        return -EIO;
+    }
+
+    ret = adc_channel_setup_dt(&bat_adc);
+    if (ret != 0)
+    {
+        LOG_ERR("Failed to set up battery ADC channel, ret: %d", ret);
+        return -EIO;
+    }
+
+    k_work_schedule(&sample_work, K_MSEC(BAT_MON_FIRST_SAMPLE_MS));
+    return 0;
+}
+
+uint16_t bat_mon_get_mv()
+{
+    return ema_mv;
+}
+
+uint8_t bat_mon_get_percent()
+{
+    return bat_percent;
+}
+
+uint8_t bat_mon_get_led_bits()
+{
+    if (bat_percent == BAT_MON_PERCENT_UNKNOWN || bat_percent <= 25)
+        return 0x01;
+    else if (bat_percent <= 50)
+        return 0x03;
+    else if (bat_percent <= 75)
+        return 0x07;
+    return 0x0F;
+}
+
+void bat_mon_set_update_cb(void (*cb)(uint16_t mv, uint8_t percent))
+{
+    update_cb = cb;
+}
@@ -0,0 +1,47 @@
+#ifndef BAT_MON_H_
+#define BAT_MON_H_
+
+#include <stdint.h>
+
+/*
+*   Battery monitor. Every BAT_MON_SAMPLE_MS a burst of ADC reads is taken,
+*   its median is compensated for the radio's load sag and smoothed with an
+*   EMA, then mapped to a percentage through the cell's discharge curve.
+*   The ADC is only touched for the burst.
+*/
+
+#ifndef BAT_MON_SAMPLE_MS
+#define BAT_MON_SAMPLE_MS           30000
+#endif
+// reads per sample, odd so the median is one of them
+#ifndef BAT_MON_OVERSAMPLE
+#define BAT_MON_OVERSAMPLE          9
+#endif
+// the buzzer pulls the cell down, samples wait this long for it to stop
+#ifndef BAT_MON_BUSY_RETRY_MS
+#define BAT_MON_BUSY_RETRY_MS       2000
+#endif
+// cell internal resistance plus wiring, for the load sag compensation
+#ifndef BAT_MON_INTERNAL_MOHM
+#define BAT_MON_INTERNAL_MOHM       150
+#endif
+// battery to ADC divider
+#ifndef BAT_MON_DIVIDER_NUM
+#define BAT_MON_DIVIDER_NUM         2
+#define BAT_MON_DIVIDER_DEN         1
+#endif
+
+#define BAT_MON_PERCENT_UNKNOWN     0xff
+
+int bat_mon_init();
+
+// smoothed, compensated cell voltage, 0 before the first sample
+uint16_t bat_mon_get_mv();
+uint8_t bat_mon_get_percent();
+// 4-level gauge as LED bits, one to four LEDs lit
+uint8_t bat_mon_get_led_bits();
+
+// called after every sample whose percentage changed
+void bat_mon_set_update_cb(void (*cb)(uint16_t mv, uint8_t percent));
+
+#endif
@@ -1,6 +1,6 @@
 #include <zephyr/logging/log.h>
 
-LOG_MODULE_REGISTER(ble_config_mgr, LOG_LEVEL_DBG);
+LOG_MODULE_REGISTER(ble_config_mgr, CONFIG_APP_LOG_LEVEL);
 
 
 #include <zephyr/zephyr.h>
@@ -9,37 +9,37 @@ LOG_MODULE_REGISTER(ble_config_mgr, LOG_LEVEL_DBG);
 #include <zephyr/bluetooth/conn.h>
 #include <zephyr/bluetooth/uuid.h>
 #include <zephyr/bluetooth/gatt.h>
-#include <zephyr/sys/reboot.h>
 
 #include "ble_config_mgr.h"
 #include "config_gatt_service.h"
+#include "msys.h"
+#include "ble_status_adv.h"
 
 #define BLE_CONFIG_MGR_THREAD_STACK_SIZE        4096
 
-#define DEVICE_NAME             "BLE Config Device12"
-#define DEVICE_NAME_LEN         20
-
 struct bt_conn *conn;
 
-static struct bt_data ad[] = {
-    BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
-};
-
-static const struct bt_data sd[] = {
-    BT_DATA(BT_DATA_NAME_COMPLETE, DEVICE_NAME, DEVICE_NAME_LEN),
-};
-
 static void ble_host_connected(struct bt_conn *connected, uint8_t err);
 static void ble_host_disconnected(struct bt_conn *connected, uint8_t reason);
 
 struct config_settings settings_temp;
+static bool config_mode;
+
+static void mtu_exchanged(struct bt_conn *connected, uint8_t err,
+            struct bt_gatt_exchange_params *params);
+
+static struct bt_gatt_exchange_params mtu_exchange_params = {
+    .func = mtu_exchanged
+};
 
 BT_CONN_CB_DEFINE(conn_callbacks) = {
     .connected = ble_host_connected,
     .disconnected = ble_host_disconnected,
 };
 
-int ble_config_mgr_init()
+// bluetooth stays up for the life of the box, outside config mode it only
+// carries the status advertiser
+int ble_config_mgr_init(uint8_t ref_id)
 {
     int ret = 0;
 
@@ -50,23 +50,7 @@ int ble_config_mgr_init()
         return ret;
     }
 
-
-    //k_thread_start(ble_config_mgr_th);
-    
-    return ret;
-}
-
-int ble_config_mgr_deinit()
-{
-    int ret = 0;
-
-    ret = bt_disable();
-    if (ret != 0)
-    {
-        LOG_ERR("Bluetooth deinit failed: %d", ret);
-        return ret;
-    }
-    return ret;
+    return ble_status_adv_init(ref_id);
 }
 
 static void auth_cancel(struct bt_conn *conn)
@@ -84,19 +68,20 @@ static struct bt_conn_auth_cb auth_cb_display = {
 
 int ble_config_mgr_start(struct config_settings *settings)
 {
-    int ret = 0;
-    ble_config_mgr_init();
+    config_mode = true;
     config_gatt_service_init(settings);
 
-    ret = bt_le_adv_start(BT_LE_ADV_CONN, ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
-    //bt_conn_auth_cb_register(&auth_cb_display);
-
-    return ret;
+    return ble_status_adv_set_config_mode(true);
 }
 
 int ble_config_mgr_stop()
 {
-    ble_config_mgr_deinit();
+    config_mode = false;
+    config_gatt_service_remove();
+    if (conn)
+        bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+
+    return ble_status_adv_set_config_mode(false);
 }
 
 static void ble_host_connected(struct bt_conn *connected, uint8_t err)
@@ -105,22 +90,41 @@ static void ble_host_connected(struct bt_conn *connected, uint8_t err)
         LOG_INF("connection error: 0x%02x", err);
     else
     {
+        struct bt_conn_info info;
+
+        // only the first phone to connect in config mode is the config host,
+        // relay links (our central ones, or boxes using us as a gateway) aren't
+        bt_conn_get_info(connected, &info);
+        if (!config_mode || conn || info.role != BT_CONN_ROLE_PERIPHERAL)
+            return;
+
         LOG_INF("host connected");
-        if (!conn)
-        {
-            conn = bt_conn_ref(connected);
-        }
+        conn = bt_conn_ref(connected);
+        // bigger MTU means fewer chunks for the CA and the bulk config blob
+        int ret = bt_gatt_exchange_mtu(connected, &mtu_exchange_params);
+        if (ret != 0)
+            LOG_WRN("mtu exchange failed to start: %d", ret);
     }
 }
 
+static void mtu_exchanged(struct bt_conn *connected, uint8_t err,
+            struct bt_gatt_exchange_params *params)
+{
+    LOG_INF("mtu exchange %s, mtu %d", err ? "failed" : "done", bt_gatt_get_mtu(connected));
+}
+
 static void ble_host_disconnected(struct bt_conn *connected, uint8_t reason)
 {
+    if (connected != conn)
+        return;
+
     LOG_INF("disconnected, reason: 0x%02x", reason);
-    if (conn)
-    {
-        bt_conn_unref(connected);
-        conn = NULL;
-    }
-    sys_reboot(SYS_REBOOT_COLD);
+    bt_conn_unref(conn);
+    conn = NULL;
+
+    // host going away ends the config session, unless we're the ones
+    // shutting BLE down at the end of it
+    if (config_mode)
+        msys_signal_evt(SYS_EVT_CONFIG_END);
 }
 
@@ -2,6 +2,10 @@
 #define BLE_CONFIG_MGR_H_
 
 #include "config_gatt_service.h"
+
+// enable bluetooth and start the status advertiser, once at boot
+int ble_config_mgr_init(uint8_t ref_id);
+
 // signal to the config mgr thread to enter config state
 int ble_config_mgr_start(struct config_settings *settings);
 
@@ -0,0 +1,508 @@
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(ble_relay, CONFIG_APP_LOG_LEVEL);
+
+#include <zephyr/zephyr.h>
+#include <zephyr/random/rand32.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/hci.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/uuid.h>
+#include <zephyr/bluetooth/gatt.h>
+#include <zephyr/bluetooth/crypto.h>
+#include <mbedtls/md.h>
+
+#include "ble_relay.h"
+#include "ble_status_adv.h"
+
+// 30-50ms interval, no peripheral latency: a write is on the gateway within
+// one or two intervals of the press
+#define RELAY_CONN_PARAM        BT_LE_CONN_PARAM(24, 40, 0, 400)
+
+// gateway link lost or refused, back off before scanning again
+#define RELAY_RESCAN_DELAY_MS   1000
+
+// referee ids are small, but they come over the air
+#define RELAY_MAX_REF_ID        16
+
+static struct bt_uuid_128 relay_service_uuid = BT_UUID_INIT_128(
+	BT_UUID_128_ENCODE(0x0000fe60, 0xcc7a, 0x482a, 0x984a, 0x7f2ed5b3e58f));
+
+static struct bt_uuid_128 relay_decision_uuid = BT_UUID_INIT_128(
+	BT_UUID_128_ENCODE(0x0000fe61, 0x8e22, 0x4541, 0x9d4c, 0x21edae82ed19));
+
+static struct bt_uuid_128 relay_nonce_uuid = BT_UUID_INIT_128(
+	BT_UUID_128_ENCODE(0x0000fe62, 0x8e22, 0x4541, 0x9d4c, 0x21edae82ed19));
+
+static void (*relay_rx_cb)(const struct ble_relay_decision *decision);
+static void (*relay_ready_cb)(bool ready);
+static void (*relay_sent_cb)(int err);
+
+static uint8_t relay_key[BLE_RELAY_KEY_LEN];
+static bool relay_key_set;
+
+// gateway side
+static bool gateway_enabled;
+static bool gateway_online;
+// per link, 0 until the client reads it
+static uint32_t conn_nonce[CONFIG_BT_MAX_CONN];
+static bool ref_seq_valid[RELAY_MAX_REF_ID];
+static uint16_t ref_last_seq[RELAY_MAX_REF_ID];
+static struct ble_relay_stats stats;
+
+// client side
+static bool client_active;
+// set on the BT RX thread, read and claimed from the comms thread
+static atomic_t client_ready;
+static atomic_t write_pending;
+static char client_platform[BLE_STATUS_ADV_PLATFORM_LEN];
+static struct bt_conn *gateway_conn;
+static uint16_t decision_handle;
+static uint32_t gateway_nonce;
+static uint16_t tx_seq;
+static struct ble_relay_record tx_record;
+static struct bt_gatt_write_params write_params;
+static struct bt_gatt_discover_params discover_params;
+static struct bt_gatt_read_params read_params;
+static struct k_work_delayable rescan_work;
+
+struct gateway_match {
+    struct ble_status_payload payload;
+    bool found;
+};
+
+static void relay_connected(struct bt_conn *conn, uint8_t err);
+static void relay_disconnected(struct bt_conn *conn, uint8_t reason);
+static int start_scan();
+static int record_tag(uint32_t nonce, const struct ble_relay_record *record, uint8_t *tag);
+
+BT_CONN_CB_DEFINE(relay_conn_callbacks) = {
+    .connected = relay_connected,
+    .disconnected = relay_disconnected,
+};
+
+static int record_tag(uint32_t nonce, const struct ble_relay_record *record, uint8_t *tag)
+{
+    uint8_t msg[sizeof(nonce) + offsetof(struct ble_relay_record, tag)];
+    uint8_t mac[32];
+    int ret;
+
+    sys_put_le32(nonce, msg);
+    memcpy(&msg[sizeof(nonce)], record, offsetof(struct ble_relay_record, tag));
+
+    ret = mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), relay_key,
+                sizeof(relay_key), msg, sizeof(msg), mac);
+    if (ret != 0)
+        return -EIO;
+
+    memcpy(tag, mac, BLE_RELAY_TAG_LEN);
+    return 0;
+}
+
+void ble_relay_set_key(const uint8_t *key)
+{
+    memcpy(relay_key, key, sizeof(relay_key));
+    relay_key_set = false;
+    for (uint8_t i = 0; i < sizeof(relay_key); i++)
+        relay_key_set |= relay_key[i] != 0;
+
+    if (!relay_key_set)
+    {
+        LOG_WRN("no relay key configured, decision relay disabled");
+        ble_relay_client_stop();
+    }
+}
+
+/*
+*       Gateway
+*/
+
+static ssize_t read_relay_nonce(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+            void *buf, uint16_t len, uint16_t offset)
+{
+    uint8_t idx = bt_conn_index(conn);
+    uint8_t value[sizeof(uint32_t)];
+
+    if (!gateway_enabled || !relay_key_set)
+        return BT_GATT_ERR(BT_ATT_ERR_READ_NOT_PERMITTED);
+
+    // fresh for every link, 0 is kept to mean unset
+    while (conn_nonce[idx] == 0)
+    {
+        if (bt_rand(&conn_nonce[idx], sizeof(conn_nonce[idx])) != 0)
+            return BT_GATT_ERR(BT_ATT_ERR_UNLIKELY);
+    }
+
+    sys_put_le32(conn_nonce[idx], value);
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, value, sizeof(value));
+}
+
+static ssize_t write_relay_decision(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+            const void *buf, uint16_t len, uint16_t offset, uint8_t flags)
+{
+    struct ble_relay_record record;
+    struct ble_relay_decision decision;
+    uint8_t tag[BLE_RELAY_TAG_LEN];
+    uint8_t diff = 0;
+    uint32_t nonce = conn_nonce[bt_conn_index(conn)];
+    uint16_t seq;
+
+    if (!gateway_enabled || !gateway_online || !relay_key_set || relay_rx_cb == NULL)
+        return BT_GATT_ERR(BT_ATT_ERR_WRITE_NOT_PERMITTED);
+    if (offset != 0 || len != sizeof(record))
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    // no nonce read on this link, nothing can be tagged yet
+    if (nonce == 0)
+        return BT_GATT_ERR(BT_ATT_ERR_AUTHORIZATION);
+
+    memcpy(&record, buf, sizeof(record));
+    if (record_tag(nonce, &record, tag) != 0)
+        return BT_GATT_ERR(BT_ATT_ERR_UNLIKELY);
+    // constant time, the compare shouldn't leak how much of the tag matched
+    for (uint8_t i = 0; i < BLE_RELAY_TAG_LEN; i++)
+        diff |= tag[i] ^ record.tag[i];
+    if (diff != 0)
+    {
+        LOG_WRN("dropped relayed decision with a bad tag");
+        return BT_GATT_ERR(BT_ATT_ERR_AUTHORIZATION);
+    }
+
+    if (record.ref_id >= RELAY_MAX_REF_ID)
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+
+    // a resend after a lost write response, it's already been relayed
+    seq = sys_le16_to_cpu(record.seq);
+    if (ref_seq_valid[record.ref_id] && ref_last_seq[record.ref_id] == seq)
+        return len;
+    ref_seq_valid[record.ref_id] = true;
+    ref_last_seq[record.ref_id] = seq;
+
+    decision.ref_id = record.ref_id;
+    decision.decision = record.decision;
+    decision.press_time = k_uptime_get() - sys_le32_to_cpu(record.press_age_ms);
+    relay_rx_cb(&decision);
+
+    return len;
+}
+
+BT_GATT_SERVICE_DEFINE(relay_service,
+    BT_GATT_PRIMARY_SERVICE(&relay_service_uuid),
+        BT_GATT_CHARACTERISTIC(&relay_decision_uuid.uuid,
+            BT_GATT_CHRC_WRITE,
+            BT_GATT_PERM_WRITE,
+            NULL, write_relay_decision, NULL),
+        BT_GATT_CHARACTERISTIC(&relay_nonce_uuid.uuid,
+            BT_GATT_CHRC_READ,
+            BT_GATT_PERM_READ,
+            read_relay_nonce, NULL, NULL)
+);
+
+int ble_relay_set_gateway(bool enabled)
+{
+    gateway_enabled = enabled;
+    // a gateway never relays through someone else
+    if (enabled)
+        ble_relay_client_stop();
+
+    return ble_status_adv_set_gateway_mode(enabled);
+}
+
+void ble_relay_set_gateway_online(bool online)
+{
+    gateway_online = online;
+}
+
+void ble_relay_record_latency(const struct ble_relay_decision *decision)
+{
+    uint32_t latency = (uint32_t)(k_uptime_get() - decision->press_time);
+
+    stats.relayed++;
+    stats.last_latency_ms = latency;
+    stats.max_latency_ms = MAX(stats.max_latency_ms, latency);
+    if (latency > BLE_RELAY_LATENCY_BUDGET_MS)
+    {
+        stats.over_budget++;
+        LOG_WRN("relayed decision from ref %d took %d ms (budget %d ms)", decision->ref_id,
+                    latency, BLE_RELAY_LATENCY_BUDGET_MS);
+    }
+    else
+        LOG_INF("relayed decision from ref %d in %d ms", decision->ref_id, latency);
+}
+
+void ble_relay_get_stats(struct ble_relay_stats *out)
+{
+    memcpy(out, &stats, sizeof(stats));
+}
+
+/*
+*       Client
+*/
+
+static bool parse_ad(struct bt_data *data, void *user_data)
+{
+    struct gateway_match *match = user_data;
+
+    if (data->type != BT_DATA_MANUFACTURER_DATA)
+        return true;
+
+    match->found = ble_status_adv_parse(data->data, data->data_len, &match->payload);
+    return false;
+}
+
+static void device_found(const bt_addr_le_t *addr, int8_t rssi, uint8_t type,
+            struct net_buf_simple *ad)
+{
+    struct gateway_match match = {0};
+    const uint8_t want = BLE_STATUS_FLAG_GATEWAY | BLE_STATUS_FLAG_MQTT;
+    int ret;
+
+    if (!client_active || gateway_conn != NULL || type != BT_GAP_ADV_TYPE_ADV_IND)
+        return;
+
+    bt_data_parse(ad, parse_ad, &match);
+    if (!match.found || (match.payload.flags & want) != want
+            || (match.payload.flags & BLE_STATUS_FLAG_CONFIG)
+            || memcmp(match.payload.platform, client_platform, sizeof(client_platform)) != 0)
+        return;
+
+    LOG_INF("gateway ref %d found, rssi %d", match.payload.ref_id, rssi);
+    bt_le_scan_stop();
+    ret = bt_conn_le_create(addr, BT_CONN_LE_CREATE_CONN, RELAY_CONN_PARAM, &gateway_conn);
+    if (ret != 0)
+    {
+        LOG_ERR("gateway connect failed: %d", ret);
+        gateway_conn = NULL;
+        k_work_reschedule(&rescan_work, K_MSEC(RELAY_RESCAN_DELAY_MS));
+    }
+}
+
+static uint8_t nonce_read(struct bt_conn *conn, uint8_t err, struct bt_gatt_read_params *params,
+            const void *data, uint16_t length)
+{
+    if (data == NULL)
+        return BT_GATT_ITER_STOP;
+
+    if (err != 0 || length != sizeof(uint32_t))
+    {
+        LOG_ERR("gateway nonce read failed: 0x%02x", err);
+        bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+        return BT_GATT_ITER_STOP;
+    }
+
+    gateway_nonce = sys_get_le32(data);
+    atomic_set(&client_ready, 1);
+    LOG_INF("relaying decisions through gateway");
+    relay_ready_cb(true);
+
+    return BT_GATT_ITER_STOP;
+}
+
+// decision characteristic first, then the nonce, then read the nonce
+static uint8_t discover_func(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+            struct bt_gatt_discover_params *params)
+{
+    int ret;
+
+    if (attr == NULL)
+    {
+        LOG_ERR("gateway has no relay characteristic");
+        bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+        return BT_GATT_ITER_STOP;
+    }
+
+    if (params->uuid == &relay_decision_uuid.uuid)
+    {
+        decision_handle = ((struct bt_gatt_chrc *)attr->user_data)->value_handle;
+        params->uuid = &relay_nonce_uuid.uuid;
+        params->start_handle = attr->handle + 1;
+        ret = bt_gatt_discover(conn, params);
+    }
+    else
+    {
+        read_params.func = nonce_read;
+        read_params.handle_count = 1;
+        read_params.single.handle = ((struct bt_gatt_chrc *)attr->user_data)->value_handle;
+        read_params.single.offset = 0;
+        ret = bt_gatt_read(conn, &read_params);
+    }
+
+    if (ret != 0)
+    {
+        LOG_ERR("relay discovery failed: %d", ret);
+        bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+    }
+    return BT_GATT_ITER_STOP;
+}
+
+static void relay_connected(struct bt_conn *conn, uint8_t err)
+{
+    int ret;
+
+    if (conn != gateway_conn)
+        return;
+
+    if (err != 0)
+    {
+        LOG_ERR("gateway connection failed: 0x%02x", err);
+        bt_conn_unref(gateway_conn);
+        gateway_conn = NULL;
+        k_work_reschedule(&rescan_work, K_MSEC(RELAY_RESCAN_DELAY_MS));
+        return;
+    }
+
+    discover_params.uuid = &relay_decision_uuid.uuid;
+    discover_params.func = discover_func;
+    discover_params.start_handle = 0x0001;
+    discover_params.end_handle = 0xffff;
+    discover_params.type = BT_GATT_DISCOVER_CHARACTERISTIC;
+
+    ret = bt_gatt_discover(conn, &discover_params);
+    if (ret != 0)
+    {
+        LOG_ERR("relay discovery failed: %d", ret);
+        bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+    }
+}
+
+static void relay_disconnected(struct bt_conn *conn, uint8_t reason)
+{
+    bool was_ready = atomic_get(&client_ready);
+
+    // the next link from this slot gets a new nonce
+    conn_nonce[bt_conn_index(conn)] = 0;
+
+    if (conn != gateway_conn)
+        return;
+
+    LOG_INF("gateway link lost, reason: 0x%02x", reason);
+    bt_conn_unref(gateway_conn);
+    gateway_conn = NULL;
+    atomic_set(&client_ready, 0);
+
+    if (atomic_cas(&write_pending, 1, 0))
+        relay_sent_cb(-ENOTCONN);
+    if (was_ready)
+        relay_ready_cb(false);
+    if (client_active)
+        k_work_reschedule(&rescan_work, K_MSEC(RELAY_RESCAN_DELAY_MS));
+}
+
+static void write_done(struct bt_conn *conn, uint8_t err, struct bt_gatt_write_params *params)
+{
+    // relay_disconnected() already reported it
+    if (!atomic_cas(&write_pending, 1, 0))
+        return;
+
+    if (err != 0)
+    {
+        // gateway lost its broker (or is being reconfigured), find another
+        LOG_ERR("gateway refused decision: 0x%02x", err);
+        bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+    }
+    relay_sent_cb(err ? -EIO : 0);
+}
+
+static int start_scan()
+{
+    int ret = bt_le_scan_start(BT_LE_SCAN_PASSIVE, device_found);
+
+    if (ret != 0 && ret != -EALREADY)
+    {
+        LOG_ERR("relay scan failed to start: %d", ret);
+        k_work_reschedule(&rescan_work, K_MSEC(RELAY_RESCAN_DELAY_MS));
+    }
+    return ret;
+}
+
+static void rescan_work_fn(struct k_work *work)
+{
+    if (client_active && gateway_conn == NULL)
+        start_scan();
+}
+
+int ble_relay_client_start(const char *platform)
+{
+    if (gateway_enabled)
+        return -EPERM;
+    if (!relay_key_set)
+        return -EACCES;
+
+    memset(client_platform, 0, sizeof(client_platform));
+    memcpy(client_platform, platform, MIN(strlen(platform), sizeof(client_platform)));
+
+    if (client_active)
+        return 0;
+
+    LOG_INF("looking for a gateway");
+    client_active = true;
+    return start_scan();
+}
+
+void ble_relay_client_stop()
+{
+    if (!client_active)
+        return;
+
+    client_active = false;
+    k_work_cancel_delayable(&rescan_work);
+    bt_le_scan_stop();
+    if (gateway_conn != NULL)
+        bt_conn_disconnect(gateway_conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+}
+
+bool ble_relay_client_ready()
+{
+    return atomic_get(&client_ready);
+}
+
+int ble_relay_send_decision(uint8_t ref_id, uint8_t decision, uint32_t press_cycles)
+{
+    int ret;
+
+    if (!atomic_get(&client_ready))
+        return -ENOTCONN;
+    if (!atomic_cas(&write_pending, 0, 1))
+        return -EBUSY;
+
+    tx_record.ref_id = ref_id;
+    tx_record.decision = decision;
+    tx_record.seq = sys_cpu_to_le16(tx_seq++);
+    tx_record.press_age_ms = sys_cpu_to_le32(k_cyc_to_ms_floor32(k_cycle_get_32() - press_cycles));
+    ret = record_tag(gateway_nonce, &tx_record, tx_record.tag);
+    if (ret != 0)
+    {
+        atomic_set(&write_pending, 0);
+        return ret;
+    }
+
+    write_params.func = write_done;
+    write_params.handle = decision_handle;
+    write_params.offset = 0;
+    write_params.data = &tx_record;
+    write_params.length = sizeof(tx_record);
+
+    ret = bt_gatt_write(gateway_conn, &write_params);
+    if (ret != 0)
+    {
+        atomic_set(&write_pending, 0);
+        LOG_ERR("relay write failed: %d", ret);
+    }
+    return ret;
+}
+
+int ble_relay_init(void (*rx_cb)(const struct ble_relay_decision *decision),
+                    void (*ready_cb)(bool ready),
+                    void (*sent_cb)(int err))
+{
+    relay_rx_cb = rx_cb;
+    relay_ready_cb = ready_cb;
+    relay_sent_cb = sent_cb;
+
+    k_work_init_delayable(&rescan_work, rescan_work_fn);
+    // seq only has to differ from the last one the gateway saw from this ref,
+    // starting from a random point covers a reboot between decisions
+    tx_seq = (uint16_t)sys_rand32_get();
+
+    return 0;
+}
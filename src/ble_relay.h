@@ -0,0 +1,75 @@
+#ifndef BLE_RELAY_H_
+#define BLE_RELAY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <zephyr/toolchain.h>
+
+/*
+*   Decision fallback over BLE. A box that has lost wifi connects to a
+*   gateway box on the same platform (found from its status advertisement)
+*   and writes each decision to the gateway's relay characteristic, which
+*   publishes it on the gateway's MQTT session.
+*
+*   Boxes on a platform share a relay key. The gateway hands each
+*   connection a random nonce and only takes records tagged with
+*   HMAC-SHA256(key, nonce || record) under it, so a phone in range can't
+*   inject decisions and a sniffed record can't be replayed on a later link.
+*/
+
+// press to MQTT publish on the gateway, relays over this are counted and logged
+#ifndef BLE_RELAY_LATENCY_BUDGET_MS
+#define BLE_RELAY_LATENCY_BUDGET_MS     250
+#endif
+
+#define BLE_RELAY_KEY_LEN               16
+// truncated HMAC, enough against online guessing over a BLE link
+#define BLE_RELAY_TAG_LEN               8
+
+// what goes over the air, press_age_ms is press to write on the sender's clock
+struct ble_relay_record {
+    uint8_t ref_id;
+    uint8_t decision;
+    uint16_t seq;
+    uint32_t press_age_ms;
+    uint8_t tag[BLE_RELAY_TAG_LEN];
+} __packed;
+
+// a relayed decision as seen by the gateway, press_time is on the gateway's clock
+struct ble_relay_decision {
+    uint8_t ref_id;
+    uint8_t decision;
+    int64_t press_time;
+};
+
+struct ble_relay_stats {
+    uint32_t relayed;
+    uint32_t over_budget;
+    uint32_t last_latency_ms;
+    uint32_t max_latency_ms;
+};
+
+// rx_cb runs on the BT RX thread on a gateway, ready_cb whenever a client's
+// link to a gateway comes up or goes away, sent_cb with each write result
+int ble_relay_init(void (*rx_cb)(const struct ble_relay_decision *decision),
+                    void (*ready_cb)(bool ready),
+                    void (*sent_cb)(int err));
+
+// an all zero key turns the relay off on both sides
+void ble_relay_set_key(const uint8_t *key);
+int ble_relay_set_gateway(bool enabled);
+// gateways only take relays while their own MQTT session is up
+void ble_relay_set_gateway_online(bool online);
+
+// look for (and stay connected to) a gateway on this platform
+int ble_relay_client_start(const char *platform);
+void ble_relay_client_stop();
+bool ble_relay_client_ready();
+// press_cycles is k_cycle_get_32() when the press came in, the gateway gets its age
+int ble_relay_send_decision(uint8_t ref_id, uint8_t decision, uint32_t press_cycles);
+
+// gateway side, call once the relayed decision is published
+void ble_relay_record_latency(const struct ble_relay_decision *decision);
+void ble_relay_get_stats(struct ble_relay_stats *stats);
+
+#endif
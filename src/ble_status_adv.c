@@ -0,0 +1,220 @@
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(ble_status_adv, CONFIG_APP_LOG_LEVEL);
+
+#include <zephyr/zephyr.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/hci.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "ble_status_adv.h"
+#include "wifi_conn.h"
+#include "fw_version.h"
+
+// RSSI isn't event driven, so it's sampled on this period
+#ifndef BLE_STATUS_ADV_REFRESH_MS
+#define BLE_STATUS_ADV_REFRESH_MS       30000
+#endif
+
+// bursts of state changes are folded into one advertising data update
+#define BLE_STATUS_ADV_COALESCE_MS      100
+
+#define NAME_BASE                       "OWL Ref "
+#define NAME_MAXLEN                     (sizeof(NAME_BASE) + 4)
+
+// ~1s between advertisements in normal operation, the radio barely wakes
+#define ADV_PARAM_STATUS    BT_LE_ADV_PARAM(BT_LE_ADV_OPT_USE_IDENTITY, \
+                                            BT_GAP_ADV_SLOW_INT_MIN, \
+                                            BT_GAP_ADV_SLOW_INT_MAX, NULL)
+// a gateway has to take connections from boxes relaying through it
+#define ADV_PARAM_GATEWAY   BT_LE_ADV_PARAM(BT_LE_ADV_OPT_CONNECTABLE | BT_LE_ADV_OPT_USE_IDENTITY, \
+                                            BT_GAP_ADV_SLOW_INT_MIN, \
+                                            BT_GAP_ADV_SLOW_INT_MAX, NULL)
+#define ADV_PARAM_CONFIG    BT_LE_ADV_PARAM(BT_LE_ADV_OPT_CONNECTABLE | BT_LE_ADV_OPT_USE_IDENTITY, \
+                                            BT_GAP_ADV_FAST_INT_MIN_2, \
+                                            BT_GAP_ADV_FAST_INT_MAX_2, NULL)
+
+static struct ble_status_payload status;
+static char device_name[NAME_MAXLEN];
+static bool config_mode;
+static bool gateway_mode;
+static bool advertising;
+
+static struct bt_data ad[] = {
+    BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
+    BT_DATA(BT_DATA_MANUFACTURER_DATA, &status, sizeof(status)),
+};
+
+static struct bt_data sd[] = {
+    BT_DATA(BT_DATA_NAME_COMPLETE, device_name, 0),
+};
+
+static struct k_work_delayable update_work;
+static struct k_work_delayable refresh_work;
+
+static void update_work_fn(struct k_work *work);
+static void refresh_work_fn(struct k_work *work);
+static int start_advertising();
+
+static void build_device_name()
+{
+    bt_addr_le_t addrs[CONFIG_BT_ID_MAX];
+    size_t count = ARRAY_SIZE(addrs);
+
+    bt_id_get(addrs, &count);
+    if (count > 0)
+        snprintk(device_name, sizeof(device_name), "%s%02X%02X", NAME_BASE,
+                    addrs[0].a.val[1], addrs[0].a.val[0]);
+    else
+        snprintk(device_name, sizeof(device_name), "%s????", NAME_BASE);
+
+    sd[0].data_len = strlen(device_name);
+}
+
+static void schedule_update()
+{
+    k_work_reschedule(&update_work, K_MSEC(BLE_STATUS_ADV_COALESCE_MS));
+}
+
+static void update_work_fn(struct k_work *work)
+{
+    int ret;
+
+    if (!advertising)
+        return;
+
+    ret = bt_le_adv_update_data(ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
+    if (ret != 0)
+        LOG_WRN("adv data update failed: %d", ret);
+}
+
+static void refresh_work_fn(struct k_work *work)
+{
+    int8_t rssi;
+
+    if (wifi_conn_get_rssi(&rssi) != 0)
+        rssi = BLE_STATUS_RSSI_UNKNOWN;
+
+    if (rssi != status.rssi)
+    {
+        status.rssi = rssi;
+        schedule_update();
+    }
+    k_work_reschedule(&refresh_work, K_MSEC(BLE_STATUS_ADV_REFRESH_MS));
+}
+
+static int start_advertising()
+{
+    int ret;
+
+    if (config_mode)
+        ret = bt_le_adv_start(ADV_PARAM_CONFIG, ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
+    else if (gateway_mode)
+        ret = bt_le_adv_start(ADV_PARAM_GATEWAY, ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
+    else
+        ret = bt_le_adv_start(ADV_PARAM_STATUS, ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
+
+    advertising = (ret == 0);
+    if (ret != 0)
+        LOG_ERR("failed to start advertising: %d", ret);
+    return ret;
+}
+
+int ble_status_adv_init(uint8_t ref_id)
+{
+    k_work_init_delayable(&update_work, update_work_fn);
+    k_work_init_delayable(&refresh_work, refresh_work_fn);
+
+    sys_put_le16(BLE_STATUS_ADV_COMPANY_ID, (uint8_t *)&status.company_id);
+    status.format = BLE_STATUS_ADV_FORMAT;
+    status.ref_id = ref_id;
+    status.flags = 0;
+    status.battery = BLE_STATUS_BATTERY_UNKNOWN;
+    status.rssi = BLE_STATUS_RSSI_UNKNOWN;
+    status.fw_version[0] = FW_VERSION_MAJOR;
+    status.fw_version[1] = FW_VERSION_MINOR;
+    status.fw_version[2] = FW_VERSION_PATCH;
+
+    build_device_name();
+    LOG_INF("advertising as %s", device_name);
+
+    k_work_reschedule(&refresh_work, K_MSEC(BLE_STATUS_ADV_REFRESH_MS));
+    return start_advertising();
+}
+
+int ble_status_adv_set_config_mode(bool enabled)
+{
+    if (enabled == config_mode)
+        return 0;
+
+    config_mode = enabled;
+    if (enabled)
+        status.flags |= BLE_STATUS_FLAG_CONFIG;
+    else
+        status.flags &= ~BLE_STATUS_FLAG_CONFIG;
+
+    bt_le_adv_stop();
+    advertising = false;
+    return start_advertising();
+}
+
+int ble_status_adv_set_gateway_mode(bool enabled)
+{
+    if (enabled == gateway_mode)
+        return 0;
+
+    gateway_mode = enabled;
+    if (enabled)
+        status.flags |= BLE_STATUS_FLAG_GATEWAY;
+    else
+        status.flags &= ~BLE_STATUS_FLAG_GATEWAY;
+
+    bt_le_adv_stop();
+    advertising = false;
+    return start_advertising();
+}
+
+bool ble_status_adv_parse(const uint8_t *data, uint8_t len, struct ble_status_payload *payload)
+{
+    if (len != sizeof(*payload))
+        return false;
+
+    memcpy(payload, data, sizeof(*payload));
+    return sys_le16_to_cpu(payload->company_id) == BLE_STATUS_ADV_COMPANY_ID
+                && payload->format == BLE_STATUS_ADV_FORMAT;
+}
+
+const char *ble_status_adv_get_name()
+{
+    return device_name;
+}
+
+void ble_status_adv_set_flags(uint8_t flags)
+{
+    const uint8_t mode_flags = BLE_STATUS_FLAG_CONFIG | BLE_STATUS_FLAG_GATEWAY;
+    uint8_t new_flags = (status.flags & mode_flags) | (flags & ~mode_flags);
+
+    if (new_flags == status.flags)
+        return;
+
+    status.flags = new_flags;
+    // link changes are also a good time to resample the RSSI
+    k_work_reschedule(&refresh_work, K_NO_WAIT);
+    schedule_update();
+}
+
+void ble_status_adv_set_platform(const char *platform)
+{
+    memset(status.platform, 0, sizeof(status.platform));
+    memcpy(status.platform, platform, MIN(strlen(platform), sizeof(status.platform)));
+    schedule_update();
+}
+
+void ble_status_adv_set_battery(uint8_t percent)
+{
+    if (percent == status.battery)
+        return;
+
+    status.battery = percent;
+    schedule_update();
+}
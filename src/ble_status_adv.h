@@ -0,0 +1,66 @@
+#ifndef BLE_STATUS_ADV_H_
+#define BLE_STATUS_ADV_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/toolchain.h>
+
+/*
+*   Box status carried in the manufacturer data of every advertisement, so a
+*   scan shows the whole fleet without connecting:
+*
+*       [company:2 LE][format:1][ref_id:1][flags:1][battery:1][rssi:1]
+*       [fw major:1][fw minor:1][fw patch:1][platform:8, zero padded]
+*
+*   The scan response carries the name, "OWL Ref " plus the last two bytes
+*   of the BLE address.
+*/
+// Bluetooth SIG id reserved for testing, until the project has its own
+#ifndef BLE_STATUS_ADV_COMPANY_ID
+#define BLE_STATUS_ADV_COMPANY_ID       0xffff
+#endif
+
+#define BLE_STATUS_ADV_FORMAT           1
+#define BLE_STATUS_ADV_PLATFORM_LEN     8
+
+#define BLE_STATUS_FLAG_WIFI            BIT(0)
+#define BLE_STATUS_FLAG_MQTT            BIT(1)
+#define BLE_STATUS_FLAG_CONFIG          BIT(2)
+#define BLE_STATUS_FLAG_TRIAL           BIT(3)
+#define BLE_STATUS_FLAG_GATEWAY         BIT(4)
+
+#define BLE_STATUS_BATTERY_UNKNOWN      0xff
+#define BLE_STATUS_RSSI_UNKNOWN         127
+
+struct ble_status_payload {
+    uint16_t company_id;
+    uint8_t format;
+    uint8_t ref_id;
+    uint8_t flags;
+    uint8_t battery;
+    int8_t rssi;
+    uint8_t fw_version[3];
+    char platform[BLE_STATUS_ADV_PLATFORM_LEN];
+} __packed;
+
+// call once bluetooth is enabled, starts the low duty cycle advertiser
+int ble_status_adv_init(uint8_t ref_id);
+
+// config mode swaps to fast connectable advertising with the same data
+int ble_status_adv_set_config_mode(bool enabled);
+
+// a gateway advertises connectable so other boxes can relay through it
+int ble_status_adv_set_gateway_mode(bool enabled);
+
+const char *ble_status_adv_get_name();
+
+// manufacturer data from another box's advertisement, false if it isn't ours
+bool ble_status_adv_parse(const uint8_t *data, uint8_t len, struct ble_status_payload *payload);
+
+// BLE_STATUS_FLAG_WIFI/MQTT/TRIAL, config and gateway follow their modes
+void ble_status_adv_set_flags(uint8_t flags);
+void ble_status_adv_set_platform(const char *platform);
+void ble_status_adv_set_battery(uint8_t percent);
+
+#endif
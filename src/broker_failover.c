@@ -0,0 +1,321 @@
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(broker_failover, CONFIG_APP_LOG_LEVEL);
+
+#include <fcntl.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/net/socket.h>
+
+#include "broker_failover.h"
+#include "broker_resolver.h"
+#include "settings_util.h"
+
+#ifndef BROKER_FAILOVER_DEFAULT_THRESHOLD
+#define BROKER_FAILOVER_DEFAULT_THRESHOLD       3
+#endif
+
+#ifndef BROKER_FAILOVER_PROBE_PERIOD_MS
+#define BROKER_FAILOVER_PROBE_PERIOD_MS         30000
+#endif
+
+// retry for a fail back that came due while the box was busy
+#ifndef BROKER_FAILOVER_PROBE_DEFER_MS
+#define BROKER_FAILOVER_PROBE_DEFER_MS          5000
+#endif
+
+// a primary that's only half up (accepts TCP, then drops or doesn't answer)
+// mustn't pull the box off a working backup, it has to pass this many
+// probes in a row, CONFIRM_MS apart
+#ifndef BROKER_FAILOVER_PROBE_SUCCESSES
+#define BROKER_FAILOVER_PROBE_SUCCESSES         3
+#endif
+
+#ifndef BROKER_FAILOVER_PROBE_CONFIRM_MS
+#define BROKER_FAILOVER_PROBE_CONFIRM_MS        5000
+#endif
+
+// the connect is non-blocking, the work item checks on it this often
+#ifndef BROKER_FAILOVER_PROBE_POLL_MS
+#define BROKER_FAILOVER_PROBE_POLL_MS           250
+#endif
+
+#ifndef BROKER_FAILOVER_PROBE_TIMEOUT_MS
+#define BROKER_FAILOVER_PROBE_TIMEOUT_MS        3000
+#endif
+
+static struct mqtt_config_settings *config;
+static uint8_t current;
+static uint8_t fail_count;
+static int64_t failover_start;
+static struct broker_failover_stats stats;
+
+static void (*primary_back_cb)(void);
+static struct k_work_delayable probe_work;
+// the probe runs on the system workqueue, only probe_work_fn and callers
+// that have cancelled probe_work touch these
+static int probe_sock = -1;
+static int64_t probe_start;
+static uint8_t probe_successes;
+
+static void probe_work_fn(struct k_work *work);
+static void stop_probe();
+
+static bool broker_valid(uint8_t index)
+{
+    if (index == 0)
+        return true;    // an empty primary means DNS-SD discovery
+
+    if (index >= SETTINGS_UTIL_MAX_BROKERS)
+        return false;
+
+    return (strlen(config->backup_brokers[index - 1].addr) > 0)
+                && (config->backup_brokers[index - 1].port != 0);
+}
+
+static uint8_t next_broker(uint8_t index)
+{
+    for (uint8_t i = 1; i <= SETTINGS_UTIL_MAX_BROKERS; i++)
+    {
+        uint8_t next = (index + i) % SETTINGS_UTIL_MAX_BROKERS;
+        if (broker_valid(next))
+            return next;
+    }
+    return index;
+}
+
+static uint8_t failover_threshold()
+{
+    return (config->failover_threshold > 0) ? config->failover_threshold
+                                            : BROKER_FAILOVER_DEFAULT_THRESHOLD;
+}
+
+static void close_probe()
+{
+    if (probe_sock >= 0)
+    {
+        zsock_close(probe_sock);
+        probe_sock = -1;
+    }
+}
+
+// the resolver only answers from its cache here, a primary hostname that
+// isn't cached is resolved in the background for the next probe
+static int start_probe()
+{
+    int ret = 0;
+    struct sockaddr_in addr;
+
+    ret = broker_resolver_get_cached(config, &addr);
+    if (ret != 0)
+    {
+        broker_resolver_report_failure(config);
+        return ret;
+    }
+
+    probe_sock = zsock_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (probe_sock < 0)
+        return -errno;
+
+    if (zsock_fcntl(probe_sock, F_SETFL, O_NONBLOCK) < 0)
+    {
+        ret = -errno;
+        close_probe();
+        return ret;
+    }
+
+    probe_start = k_uptime_get();
+    if (zsock_connect(probe_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+    {
+        ret = -errno;
+        close_probe();
+        return ret;
+    }
+    return 0;
+}
+
+// 0 once connected, -EINPROGRESS while the connect is still going
+static int check_probe()
+{
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    struct zsock_pollfd fd = {
+        .fd = probe_sock,
+        .events = ZSOCK_POLLOUT
+    };
+
+    if (zsock_poll(&fd, 1, 0) == 0)
+    {
+        if (k_uptime_get() - probe_start < BROKER_FAILOVER_PROBE_TIMEOUT_MS)
+            return -EINPROGRESS;
+        return -ETIMEDOUT;
+    }
+
+    if (zsock_getsockopt(probe_sock, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0)
+        return -errno;
+    return -err;
+}
+
+static void probe_work_fn(struct k_work *work)
+{
+    int ret = 0;
+
+    if (current == 0)
+    {
+        close_probe();
+        return;
+    }
+
+    // passed enough probes, the comms thread switches once the box is idle.
+    // If it defers, one more fresh probe has to pass before it's asked again.
+    if (probe_successes >= BROKER_FAILOVER_PROBE_SUCCESSES)
+    {
+        probe_successes = BROKER_FAILOVER_PROBE_SUCCESSES - 1;
+        if (primary_back_cb != NULL)
+            primary_back_cb();
+        return;
+    }
+
+    if (probe_sock < 0)
+        ret = start_probe();
+    if (ret == 0)
+        ret = check_probe();
+
+    if (ret == -EINPROGRESS)
+    {
+        k_work_reschedule(&probe_work, K_MSEC(BROKER_FAILOVER_PROBE_POLL_MS));
+        return;
+    }
+    close_probe();
+
+    if (ret != 0)
+    {
+        LOG_DBG("primary broker still unreachable (%d)", ret);
+        probe_successes = 0;
+        k_work_reschedule(&probe_work, K_MSEC(BROKER_FAILOVER_PROBE_PERIOD_MS));
+        return;
+    }
+
+    probe_successes++;
+    LOG_INF("primary broker reachable (%d of %d)", probe_successes, BROKER_FAILOVER_PROBE_SUCCESSES);
+    k_work_reschedule(&probe_work, (probe_successes < BROKER_FAILOVER_PROBE_SUCCESSES)
+                                        ? K_MSEC(BROKER_FAILOVER_PROBE_CONFIRM_MS) : K_NO_WAIT);
+}
+
+// call from anything but the system workqueue
+static void stop_probe()
+{
+    struct k_work_sync sync;
+
+    k_work_cancel_delayable_sync(&probe_work, &sync);
+    close_probe();
+    probe_successes = 0;
+}
+
+int broker_failover_init(struct mqtt_config_settings *mqtt_config, void (*primary_back)(void))
+{
+    config = mqtt_config;
+    primary_back_cb = primary_back;
+    fail_count = 0;
+    failover_start = 0;
+
+    // sticky preference, start with whichever broker last worked
+    current = broker_valid(config->preferred_broker) ? config->preferred_broker : 0;
+    stats.active_broker = current;
+
+    k_work_init_delayable(&probe_work, probe_work_fn);
+
+    LOG_INF("starting with broker %d", current);
+    return 0;
+}
+
+void broker_failover_reset()
+{
+    stop_probe();
+
+    // the old list's indexes mean nothing now, start over on the primary
+    current = 0;
+    fail_count = 0;
+    failover_start = 0;
+    stats.active_broker = 0;
+    config->preferred_broker = 0;
+
+    LOG_INF("broker list changed, back to the primary");
+}
+
+void broker_failover_select(struct mqtt_config_settings *active)
+{
+    *active = *config;
+
+    if (current != 0)
+    {
+        strcpy(active->broker_addr, config->backup_brokers[current - 1].addr);
+        active->port = config->backup_brokers[current - 1].port;
+    }
+}
+
+void broker_failover_report_failure()
+{
+    if (failover_start == 0)
+        failover_start = k_uptime_get();
+
+    if (++fail_count < failover_threshold())
+        return;
+
+    fail_count = 0;
+    uint8_t next = next_broker(current);
+    if (next == current)
+    {
+        LOG_WRN("broker %d unreachable and no other broker configured", current);
+        return;
+    }
+
+    LOG_WRN("broker %d failed %d times, failing over to broker %d", current,
+                failover_threshold(), next);
+    current = next;
+}
+
+void broker_failover_report_success()
+{
+    fail_count = 0;
+
+    if (failover_start != 0 && current != stats.active_broker)
+    {
+        stats.failovers++;
+        stats.last_failover_ms = (uint32_t)(k_uptime_get() - failover_start);
+        LOG_INF("failover to broker %d took %d ms", current, stats.last_failover_ms);
+    }
+    failover_start = 0;
+    stats.active_broker = current;
+
+    // only writes flash when the working broker actually changed
+    settings_util_set_mqtt_preferred_broker(current);
+    config->preferred_broker = current;
+
+    stop_probe();
+    if (current != 0)
+        k_work_schedule(&probe_work, K_MSEC(BROKER_FAILOVER_PROBE_PERIOD_MS));
+}
+
+void broker_failover_use_primary()
+{
+    stop_probe();
+    if (current == 0)
+        return;
+
+    LOG_INF("primary broker reachable again, switching back");
+    current = 0;
+    fail_count = 0;
+    failover_start = k_uptime_get();
+}
+
+void broker_failover_defer_probe()
+{
+    if (current != 0)
+        k_work_reschedule(&probe_work, K_MSEC(BROKER_FAILOVER_PROBE_DEFER_MS));
+}
+
+void broker_failover_get_stats(struct broker_failover_stats *out)
+{
+    *out = stats;
+}
@@ -0,0 +1,33 @@
+#ifndef BROKER_FAILOVER_H_
+#define BROKER_FAILOVER_H_
+
+#include <stdbool.h>
+#include "settings_util.h"
+
+struct broker_failover_stats {
+    uint32_t failovers;
+    uint32_t last_failover_ms;      // first failed connect to CONNACK on the new broker
+    uint8_t active_broker;
+};
+
+// while on a backup the primary is probed from the system workqueue with a
+// non-blocking connect. primary_back is called from there once it has
+// passed enough probes in a row, switch with broker_failover_use_primary().
+int broker_failover_init(struct mqtt_config_settings *config, void (*primary_back)(void));
+// the broker list changed, drop the failover state and any pending probe
+void broker_failover_reset();
+
+// copy of config with the broker address/port of the currently selected broker
+void broker_failover_select(struct mqtt_config_settings *active);
+
+void broker_failover_report_failure();
+void broker_failover_report_success();
+
+// select the primary for the next connect
+void broker_failover_use_primary();
+// the box is busy, ask again shortly after one more probe
+void broker_failover_defer_probe();
+
+void broker_failover_get_stats(struct broker_failover_stats *stats);
+
+#endif
@@ -0,0 +1,459 @@
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(broker_resolver, CONFIG_APP_LOG_LEVEL);
+
+#include <strings.h>
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/net/socket.h>
+
+#include "broker_resolver.h"
+#include "settings_util.h"
+
+#ifndef BROKER_RESOLVER_DISCOVERY_TIMEOUT_MS
+#define BROKER_RESOLVER_DISCOVERY_TIMEOUT_MS    2000
+#endif
+
+#define MDNS_IPV4_ADDR                  "224.0.0.251"
+#define MDNS_PORT                       5353
+#define MDNS_MSG_MAX_LEN                512
+#define MDNS_MAX_A_RECORDS              4
+
+#define DNS_HEADER_LEN                  12
+#define DNS_RR_FIXED_LEN                10
+#define DNS_NAME_MAX_LEN                64
+#define DNS_MAX_PTR_JUMPS               8
+
+#define DNS_TYPE_A                      1
+#define DNS_TYPE_PTR                    12
+#define DNS_TYPE_SRV                    33
+#define DNS_CLASS_IN                    1
+#define MDNS_CLASS_UNICAST_RESPONSE     0x8000
+
+#define RESOLVER_THREAD_STACK_SIZE      3072
+
+struct mdns_a_record {
+    char name[DNS_NAME_MAX_LEN];
+    uint8_t addr[4];
+};
+
+static struct settings_broker_cache cache;
+static struct k_mutex cache_lock;
+
+static struct k_work_q resolver_work_q;
+K_THREAD_STACK_DEFINE(resolver_work_q_stack, RESOLVER_THREAD_STACK_SIZE);
+static struct k_work resolve_work;
+// written by the failing caller, read by the work item
+static struct k_mutex pending_lock;
+static char pending_name[32];
+static uint16_t pending_port;
+
+// only ever used from one resolution at a time, callers hold resolve_lock
+static struct k_mutex resolve_lock;
+static uint8_t mdns_buf[MDNS_MSG_MAX_LEN];
+static struct mdns_a_record mdns_a_records[MDNS_MAX_A_RECORDS];
+
+static int resolve(const char *name, uint16_t port, struct settings_broker_cache *result);
+static int resolve_hostname(const char *name, uint16_t port, struct settings_broker_cache *result);
+static int mdns_discover(struct settings_broker_cache *result);
+static void store_cache(const struct settings_broker_cache *result);
+static void resolve_work_fn(struct k_work *work);
+
+static bool is_discovery_name(const char *name)
+{
+    return (strlen(name) == 0) || (strcmp(name, BROKER_RESOLVER_DNSSD_SERVICE) == 0);
+}
+
+// SRV owner names are <instance>._mqtt._tcp.local
+static bool is_wanted_instance(const char *srv_name)
+{
+    size_t len = strlen(CONFIG_BROKER_RESOLVER_INSTANCE);
+
+    if (len == 0)
+        return true;
+
+    return strncasecmp(srv_name, CONFIG_BROKER_RESOLVER_INSTANCE, len) == 0
+            && srv_name[len] == '.';
+}
+
+int broker_resolver_init()
+{
+    k_mutex_init(&cache_lock);
+    k_mutex_init(&resolve_lock);
+    k_mutex_init(&pending_lock);
+    settings_util_load_broker_cache(&cache);
+
+    k_work_init(&resolve_work, resolve_work_fn);
+    k_work_queue_start(&resolver_work_q, resolver_work_q_stack,
+                        K_THREAD_STACK_SIZEOF(resolver_work_q_stack),
+                        8, NULL);
+
+    LOG_DBG("cached broker %s -> %d.%d.%d.%d:%d", cache.name, cache.addr[0],
+                cache.addr[1], cache.addr[2], cache.addr[3], cache.port);
+    return 0;
+}
+
+int broker_resolver_get_cached(const struct mqtt_config_settings *config, struct sockaddr_in *addr)
+{
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(config->port);
+
+    // a dotted quad needs no resolution or caching
+    if (zsock_inet_pton(AF_INET, config->broker_addr, &addr->sin_addr) == 1)
+        return 0;
+
+    k_mutex_lock(&cache_lock, K_FOREVER);
+    if (strcmp(cache.name, config->broker_addr) == 0 && cache.port != 0)
+    {
+        memcpy(&addr->sin_addr, cache.addr, sizeof(cache.addr));
+        addr->sin_port = htons(cache.port);
+        k_mutex_unlock(&cache_lock);
+        LOG_DBG("using cached address for %s", config->broker_addr);
+        return 0;
+    }
+    k_mutex_unlock(&cache_lock);
+
+    return -ENOENT;
+}
+
+int broker_resolver_get(const struct mqtt_config_settings *config, struct sockaddr_in *addr)
+{
+    int ret = 0;
+    struct settings_broker_cache result;
+
+    if (broker_resolver_get_cached(config, addr) == 0)
+        return 0;
+
+    // nothing cached for this name yet, so resolve in the foreground
+    LOG_INF("resolving broker %s", config->broker_addr);
+    ret = resolve(config->broker_addr, config->port, &result);
+    if (ret != 0)
+    {
+        LOG_ERR("failed to resolve broker %s (%d)", config->broker_addr, ret);
+        return ret;
+    }
+
+    store_cache(&result);
+    memcpy(&addr->sin_addr, result.addr, sizeof(result.addr));
+    addr->sin_port = htons(result.port);
+    return 0;
+}
+
+void broker_resolver_report_failure(const struct mqtt_config_settings *config)
+{
+    struct in_addr tmp;
+
+    if (zsock_inet_pton(AF_INET, config->broker_addr, &tmp) == 1)
+        return;
+
+    // a resolve already queued picks up the latest name
+    k_mutex_lock(&pending_lock, K_FOREVER);
+    strcpy(pending_name, config->broker_addr);
+    pending_port = config->port;
+    k_mutex_unlock(&pending_lock);
+
+    LOG_INF("cached broker address failed, re-resolving %s", config->broker_addr);
+    k_work_submit_to_queue(&resolver_work_q, &resolve_work);
+}
+
+static void resolve_work_fn(struct k_work *work)
+{
+    int ret = 0;
+    char name[sizeof(pending_name)];
+    uint16_t port;
+    struct settings_broker_cache result;
+
+    k_mutex_lock(&pending_lock, K_FOREVER);
+    strcpy(name, pending_name);
+    port = pending_port;
+    k_mutex_unlock(&pending_lock);
+
+    ret = resolve(name, port, &result);
+    if (ret != 0)
+    {
+        LOG_ERR("background resolve of %s failed (%d)", name, ret);
+        return;
+    }
+
+    store_cache(&result);
+}
+
+static void store_cache(const struct settings_broker_cache *result)
+{
+    k_mutex_lock(&cache_lock, K_FOREVER);
+    // only touch flash when the answer actually changed
+    if (memcmp(&cache, result, sizeof(cache)) != 0)
+    {
+        memcpy(&cache, result, sizeof(cache));
+        settings_util_set_broker_cache(&cache);
+    }
+    k_mutex_unlock(&cache_lock);
+
+    LOG_INF("broker %s resolved to %d.%d.%d.%d:%d", result->name, result->addr[0],
+                result->addr[1], result->addr[2], result->addr[3], result->port);
+}
+
+static int resolve(const char *name, uint16_t port, struct settings_broker_cache *result)
+{
+    int ret = 0;
+
+    memset(result, 0, sizeof(*result));
+
+    k_mutex_lock(&resolve_lock, K_FOREVER);
+    if (is_discovery_name(name))
+        ret = mdns_discover(result);
+    else
+        ret = resolve_hostname(name, port, result);
+    k_mutex_unlock(&resolve_lock);
+
+    if (ret == 0)
+        strcpy(result->name, name);
+
+    return ret;
+}
+
+static int resolve_hostname(const char *name, uint16_t port, struct settings_broker_cache *result)
+{
+    int ret = 0;
+    struct zsock_addrinfo *res = NULL;
+    struct zsock_addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM
+    };
+
+    // .local names go out over mDNS, anything else to the DHCP provided server
+    ret = zsock_getaddrinfo(name, NULL, &hints, &res);
+    if (ret != 0 || res == NULL)
+        return -EHOSTUNREACH;
+
+    memcpy(result->addr, &net_sin(res->ai_addr)->sin_addr, sizeof(result->addr));
+    result->port = port;
+    zsock_freeaddrinfo(res);
+
+    return 0;
+}
+
+/*
+*       Minimal one-shot mDNS/DNS-SD browse (RFC 6762 5.1, RFC 6763)
+*/
+
+static int dns_write_name(uint8_t *buf, size_t buf_len, const char *name)
+{
+    size_t pos = 0;
+    const char *label = name;
+
+    while (*label != '\0')
+    {
+        const char *dot = strchr(label, '.');
+        size_t label_len = (dot != NULL) ? (size_t)(dot - label) : strlen(label);
+
+        if (label_len == 0 || label_len > 63 || pos + label_len + 2 > buf_len)
+            return -EINVAL;
+
+        buf[pos++] = label_len;
+        memcpy(buf + pos, label, label_len);
+        pos += label_len;
+        label += label_len;
+        if (*label == '.')
+            label++;
+    }
+
+    buf[pos++] = 0;
+    return pos;
+}
+
+// decode a possibly compressed name at offset, returns the offset just past
+// the name in its original position
+static int dns_read_name(const uint8_t *msg, size_t msg_len, size_t offset,
+                            char *name, size_t name_len)
+{
+    size_t pos = offset;
+    size_t out = 0;
+    int end = -1;
+    uint8_t jumps = 0;
+
+    while (pos < msg_len)
+    {
+        uint8_t label_len = msg[pos];
+
+        if (label_len == 0)
+        {
+            if (end < 0)
+                end = pos + 1;
+            name[out] = '\0';
+            return end;
+        }
+
+        if ((label_len & 0xC0) == 0xC0)
+        {
+            if (pos + 1 >= msg_len || ++jumps > DNS_MAX_PTR_JUMPS)
+                return -EBADMSG;
+            if (end < 0)
+                end = pos + 2;
+            pos = ((label_len & 0x3F) << 8) | msg[pos + 1];
+            continue;
+        }
+
+        pos++;
+        if (pos + label_len > msg_len || out + label_len + 2 > name_len)
+            return -EBADMSG;
+
+        if (out > 0)
+            name[out++] = '.';
+        memcpy(name + out, msg + pos, label_len);
+        out += label_len;
+        pos += label_len;
+    }
+
+    return -EBADMSG;
+}
+
+static int mdns_build_query(uint8_t *buf, size_t buf_len)
+{
+    int ret = 0;
+    size_t pos = DNS_HEADER_LEN;
+
+    memset(buf, 0, DNS_HEADER_LEN);
+    sys_put_be16(1, buf + 4);       // one question
+
+    ret = dns_write_name(buf + pos, buf_len - pos - 4, BROKER_RESOLVER_DNSSD_SERVICE ".local");
+    if (ret < 0)
+        return ret;
+    pos += ret;
+
+    sys_put_be16(DNS_TYPE_PTR, buf + pos);
+    // ask for a unicast reply so we don't need to join the mDNS group
+    sys_put_be16(DNS_CLASS_IN | MDNS_CLASS_UNICAST_RESPONSE, buf + pos + 2);
+    pos += 4;
+
+    return pos;
+}
+
+static int mdns_parse_response(const uint8_t *msg, size_t msg_len,
+                                struct settings_broker_cache *result)
+{
+    int ret = 0;
+    size_t pos = DNS_HEADER_LEN;
+    char name[DNS_NAME_MAX_LEN];
+    char srv_target[DNS_NAME_MAX_LEN] = "";
+    uint16_t srv_port = 0;
+    uint8_t num_a = 0;
+
+    if (msg_len < DNS_HEADER_LEN)
+        return -EBADMSG;
+
+    uint16_t num_qd = sys_get_be16(msg + 4);
+    uint16_t num_rr = sys_get_be16(msg + 6) + sys_get_be16(msg + 8) + sys_get_be16(msg + 10);
+
+    for (uint16_t i = 0; i < num_qd; i++)
+    {
+        ret = dns_read_name(msg, msg_len, pos, name, sizeof(name));
+        if (ret < 0)
+            return ret;
+        pos = ret + 4;
+    }
+
+    for (uint16_t i = 0; i < num_rr; i++)
+    {
+        ret = dns_read_name(msg, msg_len, pos, name, sizeof(name));
+        if (ret < 0 || ret + DNS_RR_FIXED_LEN > msg_len)
+            return -EBADMSG;
+        pos = ret;
+
+        uint16_t type = sys_get_be16(msg + pos);
+        uint16_t rd_len = sys_get_be16(msg + pos + 8);
+        pos += DNS_RR_FIXED_LEN;
+        if (pos + rd_len > msg_len)
+            return -EBADMSG;
+
+        if (type == DNS_TYPE_SRV && rd_len > 6 && srv_port == 0 && is_wanted_instance(name))
+        {
+            srv_port = sys_get_be16(msg + pos + 4);
+            ret = dns_read_name(msg, msg_len, pos + 6, srv_target, sizeof(srv_target));
+            if (ret < 0)
+                return ret;
+        }
+        else if (type == DNS_TYPE_A && rd_len == 4 && num_a < MDNS_MAX_A_RECORDS)
+        {
+            strcpy(mdns_a_records[num_a].name, name);
+            memcpy(mdns_a_records[num_a].addr, msg + pos, 4);
+            num_a++;
+        }
+
+        pos += rd_len;
+    }
+
+    if (srv_port == 0)
+        return -ENOENT;
+
+    result->port = srv_port;
+    for (uint8_t i = 0; i < num_a; i++)
+    {
+        if (strcasecmp(mdns_a_records[i].name, srv_target) == 0)
+        {
+            memcpy(result->addr, mdns_a_records[i].addr, sizeof(result->addr));
+            return 0;
+        }
+    }
+
+    // responder didn't include the address record, look the target up directly
+    LOG_DBG("no A record for %s in response, resolving", srv_target);
+    return resolve_hostname(srv_target, srv_port, result);
+}
+
+static int mdns_discover(struct settings_broker_cache *result)
+{
+    int ret = 0;
+    int sock = 0;
+    int64_t start = k_uptime_get();
+    struct zsock_pollfd fd;
+    struct sockaddr_in dst = {
+        .sin_family = AF_INET,
+        .sin_port = htons(MDNS_PORT)
+    };
+
+    zsock_inet_pton(AF_INET, MDNS_IPV4_ADDR, &dst.sin_addr);
+
+    sock = zsock_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0)
+        return -errno;
+
+    ret = mdns_build_query(mdns_buf, sizeof(mdns_buf));
+    if (ret < 0)
+        goto exit;
+
+    ret = zsock_sendto(sock, mdns_buf, ret, 0, (struct sockaddr *)&dst, sizeof(dst));
+    if (ret < 0)
+    {
+        ret = -errno;
+        goto exit;
+    }
+
+    fd.fd = sock;
+    fd.events = ZSOCK_POLLIN;
+    ret = -ETIMEDOUT;
+    while (k_uptime_get() - start < BROKER_RESOLVER_DISCOVERY_TIMEOUT_MS)
+    {
+        int remaining = BROKER_RESOLVER_DISCOVERY_TIMEOUT_MS - (int)(k_uptime_get() - start);
+        if (zsock_poll(&fd, 1, remaining) <= 0)
+            break;
+
+        int len = zsock_recv(sock, mdns_buf, sizeof(mdns_buf), 0);
+        if (len <= 0)
+            continue;
+
+        // other responders may answer for unrelated services or other
+        // instances, keep listening
+        if (mdns_parse_response(mdns_buf, len, result) == 0)
+        {
+            LOG_INF("discovered broker in %d ms", (int)(k_uptime_get() - start));
+            ret = 0;
+            break;
+        }
+    }
+
+exit:
+    zsock_close(sock);
+    return ret;
+}
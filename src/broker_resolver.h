@@ -0,0 +1,22 @@
+#ifndef BROKER_RESOLVER_H_
+#define BROKER_RESOLVER_H_
+
+#include <zephyr/net/socket.h>
+
+#include "settings_util.h"
+
+// broker_addr values that trigger DNS-SD discovery instead of a name lookup
+#define BROKER_RESOLVER_DNSSD_SERVICE       "_mqtt._tcp"
+
+int broker_resolver_init();
+
+// fill in the broker address for a config, using the NVS cache when the
+// broker is a hostname or discovery name so boot doesn't wait on the network
+int broker_resolver_get(const struct mqtt_config_settings *config, struct sockaddr_in *addr);
+// same without ever touching the network, -ENOENT when the name isn't cached
+int broker_resolver_get_cached(const struct mqtt_config_settings *config, struct sockaddr_in *addr);
+
+// the cached address didn't work, re-resolve in the background
+void broker_resolver_report_failure(const struct mqtt_config_settings *config);
+
+#endif
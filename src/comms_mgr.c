@@ -1,8 +1,9 @@
 #include <logging/log.h>
 
-LOG_MODULE_REGISTER(comms_mgr, LOG_LEVEL_DBG);
+LOG_MODULE_REGISTER(comms_mgr, CONFIG_APP_LOG_LEVEL);
 
 #include <zephyr/zephyr.h>
+#include <zephyr/logging/log_ctrl.h>
 #include <net/net_if.h>
 #include <net/net_core.h>
 #include <net/net_context.h>
@@ -13,33 +14,77 @@ LOG_MODULE_REGISTER(comms_mgr, LOG_LEVEL_DBG);
 #include <net/net_event.h>
 #include <net/mqtt.h>
 
-#include <esp_wifi.h>
-#include <esp_event.h>
-#include <esp_timer.h>
-
 #include "comms_mgr.h"
 #include "wifi_conn.h"
 #include "mqtt_client.h"
+#include "broker_failover.h"
 #include "settings_util.h"
 #include "msys.h"
 #include "ble_config_mgr.h"
 #include "config_gatt_service.h"
 #include "io_mgr.h"
+#include "ble_status_adv.h"
+#include "ble_relay.h"
+#include "pwr_mgr.h"
+#include "energy_acct.h"
+#include "bat_mon.h"
+#include "log_backend_mqtt.h"
+#include "journal.h"
+#include "health_mon.h"
+#include "diag_shell.h"
+#include "alloc_guard.h"
+#include "perf_budget.h"
+#include "owlcms_topics.h"
 
 #define SIGNAL_CMD_MAX_RETRIES          10
 
+// the TLS handshake runs on the comms thread inside mqtt_client_start()
+#if defined(CONFIG_MQTT_LIB_TLS)
+#define COMMS_MGR_THREAD_STACK_SIZE     8192
+#else
+#define COMMS_MGR_THREAD_STACK_SIZE     4096
+#endif
+
+// how long a newly provisioned config gets to reach CONNACK before rollback
+#ifndef COMMS_MGR_CONFIG_TRIAL_TIMEOUT_MS
+#define COMMS_MGR_CONFIG_TRIAL_TIMEOUT_MS   60000
+#endif
+
+// how long each phase of a BLE connection test gets before it's called failed
+#ifndef COMMS_MGR_CONFIG_TEST_PHASE_TIMEOUT_MS
+#define COMMS_MGR_CONFIG_TEST_PHASE_TIMEOUT_MS  20000
+#endif
+
+// while decisions go through a BLE gateway, how often wifi is retried
+#ifndef COMMS_MGR_RELAY_WIFI_RETRY_MS
+#define COMMS_MGR_RELAY_WIFI_RETRY_MS   15000
+#endif
+
+// journal dumps go out in chunks of whole 12 byte entries
+#ifndef COMMS_MGR_JOURNAL_CHUNK_LEN
+#define COMMS_MGR_JOURNAL_CHUNK_LEN     240
+#endif
+
+// how long a diag bench ping gets to come back before it counts as lost
+#ifndef COMMS_MGR_BENCH_TIMEOUT_MS
+#define COMMS_MGR_BENCH_TIMEOUT_MS      2000
+#endif
+
+// pong echoes with CONFIG_COMMS_MGR_PING_ECHO, anything above this in one
+// second is dropped so a flood on the ping topic can't keep the radio busy
+#ifndef COMMS_MGR_PING_ECHO_PER_S
+#define COMMS_MGR_PING_ECHO_PER_S       20
+#endif
+
+#define MQTT_SHELL_CMD_MAXLEN           72
+
 #define MQTT_CLIENT_NAME_BASE           "owlcms_ref_"
 
-#define DECISION_TOPIC_BASE             "owlcms/decision/"
 #define DECISION_GOOD               0
 #define DECISION_BAD                1
 
 static const char *decision_msg[] = {"good", "bad"};
 
-#define STARTUP_TOPIC_BASE              "owlcms/led/"
-#define SUMMON_TOPIC_BASE               "owlcms/summon/"
-#define DECISION_REQ_TOPIC_BASE         "owlcms/decisionRequest/"
-
 
 typedef enum {
     CMD_NONE,
@@ -47,32 +92,77 @@ typedef enum {
     CMD_CONNECT,
     CMD_DISCONNECT,
     CMD_MQTT_START,
+    CMD_MQTT_STOP,
     CMD_CONFIG_START,
-    CMD_CONFIG_STOP
+    CMD_CONFIG_STOP,
+    CMD_BROKER_FAILBACK,
+    CMD_CONFIG_ROLLBACK,
+    CMD_CONFIG_TEST,
+    CMD_CONFIG_TEST_TIMEOUT,
+    CMD_CONFIG_TEST_FAILED,
+    CMD_RELAY_DECISION,
+    CMD_JOURNAL_DUMP,
+    CMD_SHELL_EXEC
 } comms_cmd_t;
 
 static struct k_thread comms_mgr_th;
-K_THREAD_STACK_DEFINE(comms_mgr_thread_stack, 4096);
+K_THREAD_STACK_DEFINE(comms_mgr_thread_stack, COMMS_MGR_THREAD_STACK_SIZE);
 static struct k_msgq  comms_cmd_queue;
 char __aligned(1) cmd_msg_buf[10 * sizeof(uint8_t)];
 static bool wifi_connected;
 static bool net_connected;
 static bool mqtt_connected;
 
-struct wifi_config_settings wifi_config;
+static char wifi_ssid[SETTING_TYPE_STR_MAXLEN];
+static char wifi_psk[SETTING_TYPE_STR_MAXLEN];
+struct wifi_config_settings wifi_config = {
+    .ssid = wifi_ssid,
+    .psk = wifi_psk
+};
+static struct settings_wifi_network wifi_networks[SETTINGS_UTIL_MAX_WIFI_NETWORKS];
+// index of the network wifi_config was last set up for
+static uint8_t wifi_network;
+static bool wifi_joining;
 struct owlcms_config_settings owlcms_config;
 struct mqtt_config_settings mqtt_config;
-static uint8_t *decision_topic;
-static uint8_t decision_topic_len;
+// mqtt_config with the broker fields of whichever broker failover selected
+static struct mqtt_config_settings active_mqtt_config;
+static struct owlcms_topics topics;
+static uint32_t journal_from_seq;
+static struct comms_mgr_stats stats;
+// one command line waiting for the comms thread
+static char shell_cmd[MQTT_SHELL_CMD_MAXLEN];
+// a bench ping in flight, matched on its payload. Set from the shell
+// thread and read on the MQTT thread.
+static K_SEM_DEFINE(bench_sem, 0, 1);
+static atomic_t bench_seq;
+static atomic_t bench_active;
 static uint8_t ref_number;
-static uint8_t *startup_topic;
-static uint8_t *summon_topic;
-static uint8_t *decision_req_topic;
 
 static struct k_work_delayable wifi_connect_work;
 static struct k_work_delayable wifi_disconnect_work;
 static struct k_work_delayable wifi_reset_work;
 static struct k_work_delayable wifi_setup_work;
+static struct k_work_delayable config_trial_work;
+static struct k_work_delayable config_test_work;
+static struct k_work_delayable relay_wifi_retry_work;
+
+// decisions from other boxes when this one is a BLE gateway
+K_MSGQ_DEFINE(relay_decision_queue, sizeof(struct ble_relay_decision), 8, 4);
+
+// BLE connection test of the staged config, test_phase is a CONFIG_TEST_PHASE_*
+// or TEST_PHASE_WIFI_DROP while the current network is being left
+#define TEST_PHASE_WIFI_DROP            0xff
+static uint8_t test_phase;
+static uint32_t test_phase_start;
+static bool test_wifi_switched;
+static char test_ssid[SETTING_TYPE_STR_MAXLEN];
+static char test_psk[SETTING_TYPE_STR_MAXLEN];
+static struct wifi_config_settings test_wifi_config = {
+    .ssid = test_ssid,
+    .psk = test_psk
+};
+static struct mqtt_config_settings test_mqtt_config;
 
 void comms_mgr_thread();
 static void process_comms_cmd(comms_cmd_t cmd);
@@ -80,10 +170,48 @@ void signal_net_state(uint8_t wifi_state, uint8_t net_state);
 void signal_mqtt_state(uint8_t mqtt_state);
 static int comms_mgr_signal_cmd(comms_cmd_t cmd);
 static void setup_mqtt_topics();
+static void setup_platform_names();
+static void apply_config();
+static void confirm_trial_config();
+static void broker_primary_back();
+static void config_trial_expired(struct k_work *work);
+static void config_test_requested();
+static void config_test_expired(struct k_work *work);
+static void start_config_test();
+static void set_test_phase(uint8_t phase);
+static void end_config_test(uint8_t status);
+// runs on the log backend thread, batches wait while a decision may be in
+// flight so they never sit in front of one on the socket
+static int publish_log_batch(const uint8_t *data, size_t len)
+{
+    if (!mqtt_connected || !msys_in_idle_conn())
+        return -EAGAIN;
+
+    return mqtt_client_publish(MQTT_QOS_0_AT_MOST_ONCE, topics.diag_log, strlen(topics.diag_log),
+                                (uint8_t *)data, len);
+}
+
+static void refresh_status_adv();
+static void relay_decision_rx(const struct ble_relay_decision *decision);
+static void relay_ready(bool ready);
+static void relay_sent(int err);
+static void relay_wifi_retry(struct k_work *work);
+static void publish_relayed_decisions();
+static void join_wifi_network();
+static void publish_energy_report(const char *report, size_t len);
+static int publish_health_report(const char *report, size_t len);
+static void battery_updated(uint16_t mv, uint8_t percent);
+static bool roam_allowed();
+static void wifi_roamed(bool success, const uint8_t *bssid, uint8_t channel);
 
 static void handle_startup_msg(uint8_t *msg, uint8_t msg_len);
 static void handle_summon_msg(uint8_t *msg, uint8_t msg_len);
 static void handle_decision_req_msg(uint8_t *msg, uint8_t msg_len);
+static void handle_ping_msg(uint8_t *msg, uint8_t msg_len);
+static void handle_log_level_msg(uint8_t *msg, uint8_t msg_len);
+static void handle_journal_get_msg(uint8_t *msg, uint8_t msg_len);
+static void handle_shell_msg(uint8_t *msg, uint8_t msg_len);
+static int publish_journal_chunk(const uint8_t *data, size_t len);
 
 static void process_comms_cmd(comms_cmd_t cmd)
 {
@@ -99,7 +227,14 @@ static void process_comms_cmd(comms_cmd_t cmd)
     {
         LOG_INF("proc cmd CONNECT");
         
-        if (wifi_connected && net_connected)
+        if (mqtt_client_is_connected())
+        {
+            // left up through a reconfigure that didn't touch wifi or the broker
+            LOG_DBG("mqtt already conn");
+            confirm_trial_config();
+            msys_signal_evt(SYS_EVT_CONN_SUCCESS);
+        }
+        else if (wifi_connected && net_connected)
         {
             LOG_DBG("wifi already conn, starting mqtt");
             comms_mgr_signal_cmd(CMD_MQTT_START);
@@ -108,8 +243,13 @@ static void process_comms_cmd(comms_cmd_t cmd)
         {
             LOG_DBG("starting wifi");
             wifi_conn_reset();
-            wifi_conn_setup(&wifi_config);
+            join_wifi_network();
             wifi_conn_connect();
+
+            // decisions can still get out through a gateway box meanwhile
+            ble_relay_client_start(owlcms_config.platform);
+            if (ble_relay_client_ready())
+                msys_signal_evt(SYS_EVT_CONN_SUCCESS);
         }
         // k_work_reschedule(&wifi_reset_work, K_NO_WAIT);
         // k_work_reschedule(&wifi_setup_work, K_NO_WAIT);
@@ -125,17 +265,42 @@ static void process_comms_cmd(comms_cmd_t cmd)
     // {
     //     // TODO: implement configuration mode via BLE
     // }
+    else if (cmd == CMD_MQTT_START && test_phase == CONFIG_TEST_PHASE_MQTT)
+    {
+        // only the staged primary broker is tested, no failover
+        if (mqtt_client_setup(&test_mqtt_config) != 0 || mqtt_client_start() != 0)
+            end_config_test(CONFIG_TEST_FAILED);
+        else
+            end_config_test(CONFIG_TEST_OK);
+    }
     else if (cmd == CMD_MQTT_START)
     {
-        mqtt_client_setup(&mqtt_config);
-        mqtt_client_start();
+        // a roam re-runs DHCP under a session that's still up
+        if (mqtt_client_is_connected())
+            return;
+        broker_failover_select(&active_mqtt_config);
+        if (mqtt_client_setup(&active_mqtt_config) != 0)
+        {
+            broker_failover_report_failure();
+            signal_mqtt_state(MQTT_STATE_DISCONNECTED);
+            return;
+        }
+        if (mqtt_client_start() != 0)
+            broker_failover_report_failure();
         //msys_signal_evt(SYS_EVT_CONN_SUCCESS);
     }
+    else if (cmd == CMD_MQTT_STOP)
+    {
+        mqtt_client_teardown();
+    }
     else if (cmd == CMD_CONFIG_START)
     {
         LOG_INF("starting ble config mode");
-        mqtt_client_teardown();
-        wifi_conn_disconnect();
+        // being reconfigured, a new candidate will replace the one on trial
+        k_work_cancel_delayable(&config_trial_work);
+        ble_relay_client_stop();
+        // wifi and mqtt stay up alongside BLE, apply_config() only takes
+        // down the layers whose settings actually changed
         struct config_settings settings;
         settings.wifi = &wifi_config;
         settings.mqtt = &mqtt_config;
@@ -143,9 +308,73 @@ static void process_comms_cmd(comms_cmd_t cmd)
 
         ble_config_mgr_start(&settings);
     }
+    else if (cmd == CMD_CONFIG_TEST)
+    {
+        start_config_test();
+    }
+    else if (cmd == CMD_CONFIG_TEST_TIMEOUT)
+    {
+        if (test_phase != CONFIG_TEST_PHASE_NONE)
+            end_config_test(CONFIG_TEST_TIMEOUT);
+    }
+    else if (cmd == CMD_CONFIG_TEST_FAILED)
+    {
+        if (test_phase != CONFIG_TEST_PHASE_NONE)
+            end_config_test(CONFIG_TEST_FAILED);
+    }
     else if (cmd == CMD_CONFIG_STOP)
     {
+        if (test_phase != CONFIG_TEST_PHASE_NONE)
+            end_config_test(CONFIG_TEST_FAILED);
         ble_config_mgr_stop();
+        apply_config();
+    }
+    else if (cmd == CMD_CONFIG_ROLLBACK)
+    {
+        settings_util_rollback_config();
+        journal_record(JOURNAL_EVT_CONFIG, JOURNAL_CONFIG_ROLLED_BACK, 0);
+        apply_config();
+        msys_signal_evt(SYS_EVT_CONN_LOST);
+    }
+    else if (cmd == CMD_RELAY_DECISION)
+    {
+        publish_relayed_decisions();
+    }
+    else if (cmd == CMD_BROKER_FAILBACK)
+    {
+        // dropping the session sends msys through CONN_LOST and the normal
+        // reconnect path, which then picks up the primary again. Not while
+        // a decision, request or config test is open, the backup works.
+        if (!roam_allowed())
+        {
+            broker_failover_defer_probe();
+        }
+        else
+        {
+            broker_failover_use_primary();
+            mqtt_client_teardown();
+        }
+    }
+    else if (cmd == CMD_JOURNAL_DUMP)
+    {
+        int ret = journal_read(journal_from_seq, COMMS_MGR_JOURNAL_CHUNK_LEN, &publish_journal_chunk);
+        if (ret != 0)
+            LOG_ERR("journal dump from %u failed %d", journal_from_seq, ret);
+        // an empty message marks the end of the dump
+        if (mqtt_connected)
+            mqtt_client_publish(MQTT_QOS_0_AT_MOST_ONCE, topics.journal, strlen(topics.journal), "", 0);
+    }
+    else if (cmd == CMD_SHELL_EXEC)
+    {
+        const char *out;
+        size_t out_len;
+
+        LOG_INF("remote shell: %s", shell_cmd);
+        if (diag_shell_exec(shell_cmd, &out, &out_len) == -ENOTSUP)
+            return;
+        if (mqtt_connected)
+            mqtt_client_publish(MQTT_QOS_0_AT_MOST_ONCE, topics.shell_out, strlen(topics.shell_out),
+                                    (uint8_t *)out, out_len);
     }
 
 }
@@ -157,14 +386,12 @@ void comms_mgr_thread()
 
     while (1)
     {
-        ret = k_msgq_get(&comms_cmd_queue, &cmd, K_NO_WAIT);
+        ret = k_msgq_get(&comms_cmd_queue, &cmd, K_FOREVER);
         if (ret == 0)
         {
             LOG_DBG("comms_mgr evt %d", cmd);
             process_comms_cmd(cmd);
         }
-        k_yield();
-        //k_msleep(5);
     }
 }
 
@@ -181,26 +408,44 @@ int comms_mgr_init(uint8_t device_id)
     ref_number = device_id;
     settings_util_load_owlcms_config(&owlcms_config);
     settings_util_load_mqtt_config(&mqtt_config);
-    
-    uint8_t mqtt_client_name_len = strlen(MQTT_CLIENT_NAME_BASE) + owlcms_config.platform_len + 4;
-    snprintk(mqtt_config.client_name, mqtt_client_name_len, "%s%s_%d", MQTT_CLIENT_NAME_BASE,
-                                                                        owlcms_config.platform,
-                                                                        ref_number);
-    mqtt_config.client_name_len = mqtt_client_name_len;
-
-
-    decision_topic_len = strlen(DECISION_TOPIC_BASE) + owlcms_config.platform_len + 1;
-    decision_topic = k_malloc(sizeof(uint8_t) * decision_topic_len);
-    snprintk(decision_topic, decision_topic_len, "%s%s", DECISION_TOPIC_BASE, owlcms_config.platform);
+    setup_platform_names();
+    broker_failover_init(&mqtt_config, &broker_primary_back);
     
     settings_util_load_wifi_config(&wifi_config);
+    settings_util_load_wifi_networks(wifi_networks);
 
     wifi_conn_set_net_state_cb(&signal_net_state);
+    wifi_conn_set_roam_cb(&roam_allowed, &wifi_roamed);
+    pwr_mgr_init(owlcms_config.power_profile);
+    energy_acct_set_report_cb(&publish_energy_report);
+    bat_mon_set_update_cb(&battery_updated);
+    log_mqtt_set_publisher(&publish_log_batch);
+    health_mon_set_report_cb(&publish_health_report);
     mqtt_client_set_state_cb(&signal_mqtt_state);
 
     k_work_init_delayable(&wifi_connect_work, wifi_conn_connect);
     k_work_init_delayable(&wifi_disconnect_work, wifi_conn_disconnect);
     k_work_init_delayable(&wifi_reset_work, wifi_conn_reset);
+    k_work_init_delayable(&config_trial_work, config_trial_expired);
+    k_work_init_delayable(&config_test_work, config_test_expired);
+    test_phase = CONFIG_TEST_PHASE_NONE;
+    config_gatt_service_set_test_cb(&config_test_requested);
+    if (settings_util_config_in_trial())
+    {
+        LOG_INF("config on trial, %d ms to reach the broker", COMMS_MGR_CONFIG_TRIAL_TIMEOUT_MS);
+        k_work_schedule(&config_trial_work, K_MSEC(COMMS_MGR_CONFIG_TRIAL_TIMEOUT_MS));
+    }
+
+    k_work_init_delayable(&relay_wifi_retry_work, relay_wifi_retry);
+    if (ble_config_mgr_init(ref_number) == 0)
+    {
+        ble_status_adv_set_platform(owlcms_config.platform);
+        refresh_status_adv();
+        ble_relay_init(&relay_decision_rx, &relay_ready, &relay_sent);
+        ble_relay_set_key(owlcms_config.relay_key);
+        ble_relay_set_gateway(owlcms_config.ble_gateway);
+    }
+
     //k_work_init_delayable(&wifi_configure_work, wifi_configure);
     k_thread_create(&comms_mgr_th,
                     comms_mgr_thread_stack,
@@ -222,6 +467,8 @@ int comms_mgr_signal_cmd(comms_cmd_t cmd)
         if (count >= SIGNAL_CMD_MAX_RETRIES)
         {
             LOG_DBG("Failed to put cmd on msgq");
+            stats.cmd_overflows++;
+            health_mon_notify();
             return -ETIMEDOUT;
         }
         count++;
@@ -241,22 +488,91 @@ int comms_mgr_disconnect()
 
 int comms_mgr_notify_decision(uint8_t decision)
 {
-    uint8_t ret = 0;
-    uint8_t *msg;
+    int ret = 0;
+    char msg[16];
+    int msg_len;
     
+    if (!mqtt_connected && ble_relay_client_ready())
+    {
+        // relay_sent() signals the result once the gateway acks it
+        ret = ble_relay_send_decision(ref_number, decision, msys_decision_input_cycles());
+        journal_record(JOURNAL_EVT_DECISION, decision | JOURNAL_DECISION_RELAYED, ret);
+        return ret;
+    }
     
-    uint8_t msg_len = strlen(decision_msg[decision]) + 3; // plus 3 for space, ID nummber, \0
-    msg = k_malloc(sizeof(uint8_t) * msg_len);
-    snprintk(msg, msg_len, "%d %s", ref_number, decision_msg[decision]);
-    LOG_DBG("notify decision rx, topic: %s %d, msg: %s %d", decision_topic, decision_topic_len, msg, msg_len);
-    ret = mqtt_client_publish(MQTT_QOS_0_AT_MOST_ONCE, decision_topic, decision_topic_len-1, msg, msg_len-1);
+    alloc_guard_watch_begin();
+    msg_len = snprintk(msg, sizeof(msg), "%d %s", ref_number, decision_msg[decision]);
+    LOG_DBG("notify decision rx, topic: %s, msg: %s %d", topics.decision, msg, msg_len);
+    ret = mqtt_client_publish(MQTT_QOS_0_AT_MOST_ONCE, topics.decision, strlen(topics.decision), msg, msg_len);
+    journal_record(JOURNAL_EVT_DECISION, decision, ret);
 
     if (ret == 0)
+    {
+        // press signalled to publish handed to the socket, logged after the fact
+        uint32_t path_us = k_cyc_to_us_floor32(k_cycle_get_32() - msys_decision_input_cycles());
         msys_signal_evt(SYS_EVT_DECISION_HANDLED);
+        health_mon_record_decision_us(path_us);
+        LOG_DBG("decision path %u us", path_us);
+        perf_budget_check(PERF_BUDGET_DECISION, path_us);
+    }
+    perf_budget_check(PERF_BUDGET_DECISION_HEAP, alloc_guard_watch_end());
 
     return ret;
 }
 
+void comms_mgr_get_stats(struct comms_mgr_stats *out)
+{
+    *out = stats;
+    out->wifi_up = wifi_connected;
+    out->mqtt_up = mqtt_connected;
+    out->cmd_pending = k_msgq_num_used_get(&comms_cmd_queue);
+    out->relay_pending = k_msgq_num_used_get(&relay_decision_queue);
+}
+
+int comms_mgr_bench_broker(uint32_t count, struct comms_mgr_bench_result *result)
+{
+    char msg[16];
+    uint64_t total_us = 0;
+    uint32_t start, us;
+    int len;
+
+    // decisions would wait behind the whole run
+    if (k_current_get() == &comms_mgr_th)
+        return -EPERM;
+    if (!mqtt_connected)
+        return -ENOTCONN;
+    if (!atomic_cas(&bench_active, 0, 1))
+        return -EBUSY;
+
+    memset(result, 0, sizeof(*result));
+    result->min_us = UINT32_MAX;
+    for (uint32_t i = 0; i < count && mqtt_connected; i++)
+    {
+        k_sem_reset(&bench_sem);
+        len = snprintk(msg, sizeof(msg), "bench %u", (uint32_t)atomic_inc(&bench_seq) + 1);
+        start = k_cycle_get_32();
+        if (mqtt_client_publish(MQTT_QOS_0_AT_MOST_ONCE, topics.ping, strlen(topics.ping), msg, len) != 0
+            || k_sem_take(&bench_sem, K_MSEC(COMMS_MGR_BENCH_TIMEOUT_MS)) != 0)
+        {
+            result->lost++;
+            continue;
+        }
+
+        us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+        result->count++;
+        result->min_us = MIN(result->min_us, us);
+        result->max_us = MAX(result->max_us, us);
+        total_us += us;
+    }
+    atomic_set(&bench_active, 0);
+
+    if (result->count == 0)
+        result->min_us = 0;
+    else
+        result->avg_us = total_us / result->count;
+    return 0;
+}
+
 int comms_mgr_start_config()
 {
     comms_mgr_signal_cmd(CMD_CONFIG_START);
@@ -271,57 +587,496 @@ void signal_net_state(uint8_t wifi_state, uint8_t net_state)
 {
     if (wifi_state == WIFI_CONN_STATE_UP)
     {
+        uint8_t bssid[6];
+        uint8_t channel;
+
         wifi_connected = true;
+        journal_record(JOURNAL_EVT_LINK, JOURNAL_LINK_WIFI, 1);
+        // remember where we got in so a rejoin skips the scan
+        if (wifi_joining && wifi_conn_get_ap(bssid, &channel) == 0)
+            settings_util_wifi_network_joined(wifi_network, bssid, channel);
+        wifi_joining = false;
+        if (test_phase == CONFIG_TEST_PHASE_WIFI)
+            set_test_phase(CONFIG_TEST_PHASE_DHCP);
     }
     else if (net_state == WIFI_CONN_STATE_UP)
     {
         net_connected = true;
+        if (test_phase == CONFIG_TEST_PHASE_DHCP)
+            set_test_phase(CONFIG_TEST_PHASE_MQTT);
         comms_mgr_signal_cmd(CMD_MQTT_START);
     }
     else if (wifi_state == WIFI_CONN_STATE_DOWN && net_state == WIFI_CONN_STATE_DOWN)
     {
+        // never got in on the cached AP (or the best scan pick), scan next time
+        if (wifi_joining)
+            settings_util_clear_wifi_cache();
+        wifi_joining = false;
+        if (wifi_connected)
+        {
+            journal_record(JOURNAL_EVT_LINK, JOURNAL_LINK_WIFI, 0);
+            stats.wifi_lost++;
+        }
         wifi_connected = false;
         net_connected = false;
-        mqtt_client_teardown();
+        mqtt_connected = false;
+        ble_relay_set_gateway_online(false);
+        // this runs on the net_mgmt thread, the session is torn down on ours
+        comms_mgr_signal_cmd(CMD_MQTT_STOP);
         msys_signal_evt(SYS_EVT_CONN_LOST);
+
+        if (test_phase == TEST_PHASE_WIFI_DROP)
+        {
+            // off the old network, now try the staged one
+            wifi_conn_setup(&test_wifi_config);
+            wifi_conn_connect();
+            set_test_phase(CONFIG_TEST_PHASE_WIFI);
+        }
+        else if (test_phase != CONFIG_TEST_PHASE_NONE)
+            comms_mgr_signal_cmd(CMD_CONFIG_TEST_FAILED);
     }
+    refresh_status_adv();
 }
 
 void signal_mqtt_state(uint8_t mqtt_state)
 {
+    // a test session isn't the box's real session, its result comes from
+    // mqtt_client_start() on the comms thread
+    if (test_phase != CONFIG_TEST_PHASE_NONE)
+        return;
+
     if (mqtt_state == MQTT_STATE_NO_CHANGE)
     {
 
     }
     else if (mqtt_state == MQTT_STATE_CONNECTED)
     {
+        mqtt_connected = true;
+        journal_record(JOURNAL_EVT_LINK, JOURNAL_LINK_MQTT, 1);
+        // back on our own session, stop relaying
+        k_work_cancel_delayable(&relay_wifi_retry_work);
+        ble_relay_client_stop();
+        ble_relay_set_gateway_online(true);
+        confirm_trial_config();
+        broker_failover_report_success();
         setup_mqtt_topics();
         msys_signal_evt(SYS_EVT_CONN_SUCCESS);
     }
     else if (mqtt_state == MQTT_STATE_DISCONNECTED)
     {
         LOG_INF("MQTT disconnected, trying again");
+        if (mqtt_connected)
+            stats.mqtt_lost++;
+        mqtt_connected = false;
+        journal_record(JOURNAL_EVT_LINK, JOURNAL_LINK_MQTT, 0);
+        ble_relay_set_gateway_online(false);
         msys_signal_evt(SYS_EVT_CONN_LOST);
     }
+    refresh_status_adv();
 }
 
-static void setup_mqtt_topics()
+static void config_trial_expired(struct k_work *work)
+{
+    LOG_ERR("candidate config didn't reach the broker in time, rolling back");
+    comms_mgr_signal_cmd(CMD_CONFIG_ROLLBACK);
+}
+
+static void config_test_requested()
+{
+    comms_mgr_signal_cmd(CMD_CONFIG_TEST);
+}
+
+static void config_test_expired(struct k_work *work)
+{
+    comms_mgr_signal_cmd(CMD_CONFIG_TEST_TIMEOUT);
+}
+
+// reports the phase just finished and starts timing the next one
+static void set_test_phase(uint8_t phase)
+{
+    uint32_t now = k_uptime_get_32();
+
+    if (test_phase == CONFIG_TEST_PHASE_WIFI || test_phase == CONFIG_TEST_PHASE_DHCP)
+    {
+        LOG_INF("config test phase %d ok in %d ms", test_phase, now - test_phase_start);
+        config_gatt_service_notify_test(test_phase, CONFIG_TEST_OK, now - test_phase_start);
+    }
+
+    test_phase = phase;
+    test_phase_start = now;
+    k_work_reschedule(&config_test_work, K_MSEC(COMMS_MGR_CONFIG_TEST_PHASE_TIMEOUT_MS));
+}
+
+/*
+*   Try the settings staged over BLE: wifi association, DHCP and MQTT CONNACK,
+*   each phase notified to the phone. The box's own session is dropped for the
+*   test, and afterwards everything is left down so that the end of the config
+*   session reconnects with whichever config is then active.
+*/
+static void start_config_test()
+{
+    if (test_phase != CONFIG_TEST_PHASE_NONE)
+    {
+        config_gatt_service_notify_test(test_phase, CONFIG_TEST_BUSY, 0);
+        return;
+    }
+
+    config_gatt_service_get_staged(&test_wifi_config, &test_mqtt_config);
+    strcpy(test_mqtt_config.client_name, mqtt_config.client_name);
+    test_mqtt_config.client_name_len = mqtt_config.client_name_len;
+
+    LOG_INF("config test starting, ssid %s broker %s:%d", test_wifi_config.ssid,
+                test_mqtt_config.broker_addr, test_mqtt_config.port);
+    mqtt_client_teardown();
+    // a join in progress is abandoned, the test network isn't in the table yet
+    wifi_joining = false;
+
+    test_wifi_switched = (strcmp(test_wifi_config.ssid, wifi_config.ssid) != 0)
+                            || (strcmp(test_wifi_config.psk, wifi_config.psk) != 0)
+                            || !net_connected;
+    if (!test_wifi_switched)
+    {
+        // already on the staged network
+        test_phase_start = k_uptime_get_32();
+        config_gatt_service_notify_test(CONFIG_TEST_PHASE_WIFI, CONFIG_TEST_OK, 0);
+        config_gatt_service_notify_test(CONFIG_TEST_PHASE_DHCP, CONFIG_TEST_OK, 0);
+        set_test_phase(CONFIG_TEST_PHASE_MQTT);
+        comms_mgr_signal_cmd(CMD_MQTT_START);
+    }
+    else if (wifi_connected)
+    {
+        set_test_phase(TEST_PHASE_WIFI_DROP);
+        wifi_conn_disconnect();
+    }
+    else
+    {
+        set_test_phase(CONFIG_TEST_PHASE_WIFI);
+        wifi_conn_reset();
+        wifi_conn_setup(&test_wifi_config);
+        wifi_conn_connect();
+    }
+}
+
+static void end_config_test(uint8_t status)
+{
+    uint8_t phase = (test_phase == TEST_PHASE_WIFI_DROP) ? CONFIG_TEST_PHASE_WIFI : test_phase;
+    uint32_t elapsed = k_uptime_get_32() - test_phase_start;
+
+    k_work_cancel_delayable(&config_test_work);
+    LOG_INF("config test phase %d status %d in %d ms", phase, status, elapsed);
+    config_gatt_service_notify_test(phase, status, elapsed);
+
+    test_phase = CONFIG_TEST_PHASE_NONE;
+    mqtt_client_teardown();
+
+    if (status == CONFIG_TEST_OK)
+    {
+        config_gatt_service_commit();
+        config_gatt_service_notify_test(CONFIG_TEST_PHASE_COMMIT, CONFIG_TEST_OK, 0);
+    }
+
+    if (test_wifi_switched)
+        wifi_conn_disconnect();
+}
+
+static void confirm_trial_config()
+{
+    if (settings_util_config_in_trial())
+    {
+        k_work_cancel_delayable(&config_trial_work);
+        settings_util_confirm_config();
+        journal_record(JOURNAL_EVT_CONFIG, JOURNAL_CONFIG_CONFIRMED, 0);
+    }
+}
+
+/*
+*   BLE decision relay. A gateway queues what it receives to the comms thread
+*   and publishes it as if it were the sending box, plus a record on the relay
+*   topic with the press time and the press to publish latency.
+*/
+static void relay_decision_rx(const struct ble_relay_decision *decision)
 {
-    uint8_t startup_topic_len = strlen(STARTUP_TOPIC_BASE) + owlcms_config.platform_len + 2;
-    uint8_t summon_topic_len = strlen(SUMMON_TOPIC_BASE) + owlcms_config.platform_len + 4;
-    uint8_t decision_req_topic_len = strlen(DECISION_REQ_TOPIC_BASE) + owlcms_config.platform_len + 4;
+    if (k_msgq_put(&relay_decision_queue, decision, K_NO_WAIT) != 0)
+    {
+        LOG_ERR("relay queue full, dropping decision from ref %d", decision->ref_id);
+        return;
+    }
+    comms_mgr_signal_cmd(CMD_RELAY_DECISION);
+}
+
+static void publish_relayed_decisions()
+{
+    struct ble_relay_decision decision;
+    char msg[48];
+    int len;
+
+    while (k_msgq_get(&relay_decision_queue, &decision, K_NO_WAIT) == 0)
+    {
+        if (decision.decision >= ARRAY_SIZE(decision_msg))
+            continue;
+
+        len = snprintk(msg, sizeof(msg), "%d %s", decision.ref_id, decision_msg[decision.decision]);
+        if (mqtt_client_publish(MQTT_QOS_0_AT_MOST_ONCE, topics.decision, strlen(topics.decision),
+                                    msg, len) != 0)
+        {
+            LOG_ERR("failed to publish relayed decision from ref %d", decision.ref_id);
+            continue;
+        }
+        ble_relay_record_latency(&decision);
+
+        // press time is uptime ms on this (the gateway's) clock
+        len = snprintk(msg, sizeof(msg), "%d %s %u %u", decision.ref_id,
+                        decision_msg[decision.decision], (uint32_t)decision.press_time,
+                        (uint32_t)(k_uptime_get() - decision.press_time));
+        mqtt_client_publish(MQTT_QOS_0_AT_MOST_ONCE, topics.relay, strlen(topics.relay), msg, len);
+    }
+}
+
+// a gateway link counts as connected as far as msys is concerned
+static void relay_ready(bool ready)
+{
+    if (mqtt_connected)
+        return;
+
+    if (ready)
+    {
+        msys_signal_evt(SYS_EVT_CONN_SUCCESS);
+        // msys won't go back through S_CONNECTING while relayed
+        k_work_reschedule(&relay_wifi_retry_work, K_MSEC(COMMS_MGR_RELAY_WIFI_RETRY_MS));
+    }
+    else
+    {
+        k_work_cancel_delayable(&relay_wifi_retry_work);
+        msys_signal_evt(SYS_EVT_CONN_LOST);
+    }
+}
+
+static void relay_sent(int err)
+{
+    if (err == 0)
+        msys_signal_evt(SYS_EVT_DECISION_HANDLED);
+}
+
+static void relay_wifi_retry(struct k_work *work)
+{
+    if (mqtt_connected || !ble_relay_client_ready())
+        return;
+
+    comms_mgr_signal_cmd(CMD_CONNECT);
+    k_work_reschedule(&relay_wifi_retry_work, K_MSEC(COMMS_MGR_RELAY_WIFI_RETRY_MS));
+}
+
+/*
+*   Pick which stored network to join. A rejoin goes straight back to the
+*   cached AP, otherwise one scan picks the best known network in range.
+*/
+static void join_wifi_network()
+{
+    struct settings_wifi_cache cache;
+    struct wifi_conn_selection selection;
+    const uint8_t *bssid = NULL;
+
+    settings_util_load_wifi_cache(&cache);
+    if (cache.channel != 0 && cache.network < SETTINGS_UTIL_MAX_WIFI_NETWORKS
+            && wifi_networks[cache.network].ssid[0] != 0)
+    {
+        selection.network = cache.network;
+        memcpy(selection.bssid, cache.bssid, sizeof(selection.bssid));
+        selection.channel = cache.channel;
+        bssid = selection.bssid;
+        LOG_INF("rejoining %s on cached AP", wifi_networks[selection.network].ssid);
+    }
+    else if (wifi_conn_select_network(wifi_networks, SETTINGS_UTIL_MAX_WIFI_NETWORKS, &selection) == 0)
+    {
+        bssid = selection.bssid;
+    }
+    else
+    {
+        // nothing known in range, the driver's own scan might still find network 0
+        selection.network = 0;
+        selection.channel = 0;
+    }
+
+    wifi_network = selection.network;
+    strcpy(wifi_config.ssid, wifi_networks[wifi_network].ssid);
+    strcpy(wifi_config.psk, wifi_networks[wifi_network].psk);
+    wifi_config.ssid_length = strlen(wifi_config.ssid);
+    wifi_config.psk_length = strlen(wifi_config.psk);
+
+    wifi_joining = true;
+    wifi_conn_setup_ap(&wifi_config, bssid, selection.channel);
+}
+
+// never move APs with a decision request open or a config test running
+static bool roam_allowed()
+{
+    return msys_in_idle_conn() && test_phase == CONFIG_TEST_PHASE_NONE;
+}
+
+static void wifi_roamed(bool success, const uint8_t *bssid, uint8_t channel)
+{
+    if (success)
+        settings_util_wifi_network_joined(wifi_network, bssid, channel);
+    else
+        settings_util_clear_wifi_cache();
+}
+
+// runs on the system workqueue, a report while offline is only logged
+static void publish_energy_report(const char *report, size_t len)
+{
+    if (mqtt_connected)
+        mqtt_client_publish(MQTT_QOS_0_AT_MOST_ONCE, topics.diag_energy, strlen(topics.diag_energy),
+                                (uint8_t *)report, len);
+}
+
+// runs on the system workqueue with each 1% step
+static void battery_updated(uint16_t mv, uint8_t percent)
+{
+    char msg[32];
+    int len;
+
+    ble_status_adv_set_battery(percent);
+    if (mqtt_connected)
+    {
+        len = snprintk(msg, sizeof(msg), "{\"mv\":%u,\"pct\":%u}", mv, percent);
+        mqtt_client_publish(MQTT_QOS_0_AT_MOST_ONCE, topics.diag_battery, strlen(topics.diag_battery),
+                                msg, len);
+    }
+}
+
+// runs on the system workqueue, an unsent change is retried on the next one
+static int publish_health_report(const char *report, size_t len)
+{
+    if (!mqtt_connected)
+        return -ENOTCONN;
+
+    return mqtt_client_publish(MQTT_QOS_0_AT_MOST_ONCE, topics.diag_health, strlen(topics.diag_health),
+                                (uint8_t *)report, len);
+}
+
+static void refresh_status_adv()
+{
+    uint8_t flags = 0;
+
+    if (wifi_connected)
+        flags |= BLE_STATUS_FLAG_WIFI;
+    if (mqtt_connected)
+        flags |= BLE_STATUS_FLAG_MQTT;
+    if (settings_util_config_in_trial())
+        flags |= BLE_STATUS_FLAG_TRIAL;
+
+    ble_status_adv_set_flags(flags);
+    // every link change comes through here
+    health_mon_notify();
+}
+
+// client name and topics all carry the platform name
+static void setup_platform_names()
+{
+    uint8_t mqtt_client_name_len = strlen(MQTT_CLIENT_NAME_BASE) + owlcms_config.platform_len + 4;
+    snprintk(mqtt_config.client_name, mqtt_client_name_len, "%s%s_%d", MQTT_CLIENT_NAME_BASE,
+                                                                        owlcms_config.platform,
+                                                                        ref_number);
+    mqtt_config.client_name_len = mqtt_client_name_len;
+
+    if (owlcms_topics_build(&topics, owlcms_config.platform, ref_number) != 0)
+        LOG_ERR("platform name too long for the topics: %s", owlcms_config.platform);
+}
+
+/*
+*   Pick up a new (or rolled back) config without rebooting. Only the layers
+*   whose settings changed are taken down, msys then goes back through
+*   S_CONNECTING which reconnects whatever is down.
+*/
+static void apply_config()
+{
+    struct settings_wifi_network new_networks[SETTINGS_UTIL_MAX_WIFI_NETWORKS];
+    struct mqtt_config_settings new_mqtt;
+    struct owlcms_config_settings new_owlcms;
+
+    // no committed candidate just means we re-check the running config
+    settings_util_activate_candidate();
+
+    settings_util_load_wifi_networks(new_networks);
+    settings_util_load_mqtt_config(&new_mqtt);
+    settings_util_load_owlcms_config(&new_owlcms);
+
+    // only a change to the network we're on needs a rejoin
+    bool wifi_changed = (strcmp(new_networks[wifi_network].ssid, wifi_config.ssid) != 0)
+                            || (strcmp(new_networks[wifi_network].psk, wifi_config.psk) != 0);
+    bool mqtt_changed = (strcmp(new_mqtt.broker_addr, mqtt_config.broker_addr) != 0)
+                            || (new_mqtt.port != mqtt_config.port)
+                            || (new_mqtt.tls_enabled != mqtt_config.tls_enabled)
+                            || (strcmp(new_mqtt.tls_hostname, mqtt_config.tls_hostname) != 0)
+                            || (memcmp(new_mqtt.backup_brokers, mqtt_config.backup_brokers,
+                                        sizeof(new_mqtt.backup_brokers)) != 0)
+                            || (new_mqtt.failover_threshold != mqtt_config.failover_threshold);
+    bool platform_changed = (strcmp(new_owlcms.platform, owlcms_config.platform) != 0);
+
+    LOG_INF("apply config, changed wifi: %d mqtt: %d platform: %d", wifi_changed,
+                mqtt_changed, platform_changed);
+    journal_record(JOURNAL_EVT_CONFIG, JOURNAL_CONFIG_APPLIED,
+                    wifi_changed | (mqtt_changed << 1) | (platform_changed << 2));
+
+    memcpy(wifi_networks, new_networks, sizeof(wifi_networks));
+
+    // whichever layer goes down, the next connect starts on the new list.
+    // The primary probe reads mqtt_config, it's stopped before that changes.
+    if (mqtt_changed)
+        broker_failover_reset();
+
+    strcpy(mqtt_config.broker_addr, new_mqtt.broker_addr);
+    mqtt_config.port = new_mqtt.port;
+    mqtt_config.tls_enabled = new_mqtt.tls_enabled;
+    strcpy(mqtt_config.tls_hostname, new_mqtt.tls_hostname);
+    memcpy(mqtt_config.backup_brokers, new_mqtt.backup_brokers, sizeof(mqtt_config.backup_brokers));
+    mqtt_config.failover_threshold = new_mqtt.failover_threshold;
+
+    owlcms_config = new_owlcms;
+    setup_platform_names();
+
+    if (wifi_changed)
+    {
+        // the net state callback tears mqtt down once the link drops
+        wifi_conn_disconnect();
+    }
+    else if (mqtt_changed)
+    {
+        mqtt_client_teardown();
+    }
+    else if (platform_changed && mqtt_client_is_connected())
+    {
+        mqtt_client_unsubscribe_all();
+        setup_mqtt_topics();
+    }
+
+    if (settings_util_config_in_trial())
+        k_work_reschedule(&config_trial_work, K_MSEC(COMMS_MGR_CONFIG_TRIAL_TIMEOUT_MS));
+
+    ble_status_adv_set_platform(owlcms_config.platform);
+    refresh_status_adv();
+    ble_relay_set_key(owlcms_config.relay_key);
+    ble_relay_set_gateway(owlcms_config.ble_gateway);
+    pwr_mgr_set_profile(owlcms_config.power_profile);
+}
 
-    startup_topic = k_malloc(sizeof(char) * startup_topic_len);
-    summon_topic = k_malloc(sizeof(char) * summon_topic_len);
-    decision_req_topic = k_malloc(sizeof(char) * decision_req_topic_len);
+static void broker_primary_back()
+{
+    comms_mgr_signal_cmd(CMD_BROKER_FAILBACK);
+}
 
-    snprintk(startup_topic, startup_topic_len, "%s%s", STARTUP_TOPIC_BASE, owlcms_config.platform);
-    snprintk(summon_topic, summon_topic_len, "%s%s/%d", SUMMON_TOPIC_BASE, owlcms_config.platform, ref_number);
-    snprintk(decision_req_topic, decision_req_topic_len, "%s%s/%d", DECISION_REQ_TOPIC_BASE, owlcms_config.platform, ref_number);
-    LOG_INF("%s %d", startup_topic, startup_topic_len);
-    mqtt_client_subscribe(startup_topic, handle_startup_msg);
-    mqtt_client_subscribe(summon_topic, handle_summon_msg);
-    mqtt_client_subscribe(decision_req_topic, handle_decision_req_msg);
+static void setup_mqtt_topics()
+{
+    LOG_INF("%s", topics.startup);
+    mqtt_client_subscribe(topics.startup, handle_startup_msg);
+    mqtt_client_subscribe(topics.summon, handle_summon_msg);
+    mqtt_client_subscribe(topics.decision_req, handle_decision_req_msg);
+    mqtt_client_subscribe(topics.ping, handle_ping_msg);
+    mqtt_client_subscribe(topics.log_level, handle_log_level_msg);
+    mqtt_client_subscribe(topics.journal_get, handle_journal_get_msg);
+#if defined(CONFIG_DIAG_SHELL_MQTT)
+    mqtt_client_subscribe(topics.shell, handle_shell_msg);
+#endif
 }
 
 static void handle_startup_msg(uint8_t *msg, uint8_t msg_len)
@@ -329,6 +1084,7 @@ static void handle_startup_msg(uint8_t *msg, uint8_t msg_len)
     if (strncmp(msg, "on", msg_len) == 0 && msg_len > 0)
     {
         LOG_INF("device received startup msg, %s, len: %d", msg, msg_len);
+        pwr_mgr_note_activity();
         io_mgr_buzzer_trig();
     }
 }
@@ -338,6 +1094,7 @@ static void handle_summon_msg(uint8_t *msg, uint8_t msg_len)
     if (strncmp(msg, "on", msg_len) == 0 && msg_len > 0)
     {
         LOG_INF("device received summon msg, %s, len: %d", msg, msg_len);
+        pwr_mgr_note_activity();
         io_mgr_buzzer_trig();
     }
 }
@@ -347,6 +1104,122 @@ static void handle_decision_req_msg(uint8_t *msg, uint8_t msg_len)
     if (strncmp(msg, "on", msg_len) == 0 && msg_len > 0)
     {
         LOG_INF("device received decision req msg, %s, len: %d", msg, msg_len);
+        pwr_mgr_note_activity();
         io_mgr_buzzer_trig();
     }
 }
+
+#if defined(CONFIG_COMMS_MGR_PING_ECHO)
+static bool ping_echo_allowed()
+{
+    static int64_t window_start;
+    static uint32_t window_count;
+    int64_t now = k_uptime_get();
+
+    if (now - window_start >= 1000)
+    {
+        window_start = now;
+        window_count = 0;
+    }
+    return ++window_count <= COMMS_MGR_PING_ECHO_PER_S;
+}
+#endif
+
+// runs on the MQTT thread, no queueing so the round trip is just the radio
+static void handle_ping_msg(uint8_t *msg, uint8_t msg_len)
+{
+    char expect[16];
+    int len;
+
+    if (atomic_get(&bench_active))
+    {
+        len = snprintk(expect, sizeof(expect), "bench %u", (uint32_t)atomic_get(&bench_seq));
+        if (len == msg_len && memcmp(msg, expect, len) == 0)
+        {
+            k_sem_give(&bench_sem);
+            return;
+        }
+    }
+
+#if defined(CONFIG_COMMS_MGR_PING_ECHO)
+    if (ping_echo_allowed())
+        mqtt_client_publish(MQTT_QOS_0_AT_MOST_ONCE, topics.pong, strlen(topics.pong), msg, msg_len);
+#endif
+}
+
+// "<module> <level>", level 0 (off) to 4 (debug), on every backend, or
+// "mqtt/<module> <level>" for just what gets streamed to the log topic
+static void handle_log_level_msg(uint8_t *msg, uint8_t msg_len)
+{
+#if defined(CONFIG_LOG_RUNTIME_FILTERING)
+    const struct log_backend *backend = NULL;
+    char module[24];
+    unsigned int level;
+    char *sep;
+
+    if (msg_len > 5 && strncmp(msg, "mqtt/", 5) == 0)
+    {
+        backend = log_mqtt_backend();
+        msg += 5;
+        msg_len -= 5;
+    }
+    sep = memchr(msg, ' ', msg_len);
+
+    if (sep == NULL || sep - (char *)msg >= sizeof(module))
+        return;
+    memcpy(module, msg, sep - (char *)msg);
+    module[sep - (char *)msg] = '\0';
+    if (sep + 1 >= (char *)msg + msg_len)
+        return;
+    level = sep[1] - '0';
+    if (level > LOG_LEVEL_DBG)
+        return;
+
+    int16_t source_id = log_source_id_get(module);
+    if (source_id < 0)
+    {
+        LOG_WRN("no log module %s", module);
+        return;
+    }
+    log_filter_set(backend, CONFIG_LOG_DOMAIN_ID, source_id, level);
+    LOG_INF("log level of %s set to %u%s", module, level, (backend != NULL) ? " on mqtt" : "");
+#endif
+}
+
+// payload is the first sequence number wanted, empty for the whole journal
+static void handle_journal_get_msg(uint8_t *msg, uint8_t msg_len)
+{
+    char seq[12];
+
+    msg_len = MIN(msg_len, sizeof(seq) - 1);
+    memcpy(seq, msg, msg_len);
+    seq[msg_len] = '\0';
+    journal_from_seq = strtoul(seq, NULL, 10);
+    comms_mgr_signal_cmd(CMD_JOURNAL_DUMP);
+}
+
+// runs on the comms thread, a gap in the sequence numbers means a lost chunk,
+// ask again from there
+static int publish_journal_chunk(const uint8_t *data, size_t len)
+{
+    if (!mqtt_connected)
+        return -ENOTCONN;
+
+    return mqtt_client_publish(MQTT_QOS_0_AT_MOST_ONCE, topics.journal, strlen(topics.journal),
+                                (uint8_t *)data, len);
+}
+
+// payload is a read only "diag" subcommand, "state" or "mqtt"
+static void handle_shell_msg(uint8_t *msg, uint8_t msg_len)
+{
+    if (msg_len == 0 || msg_len + strlen("diag ") >= sizeof(shell_cmd))
+        return;
+    if (!diag_shell_remote_allowed((const char *)msg, msg_len))
+    {
+        LOG_WRN("remote shell: %.*s refused", msg_len, msg);
+        return;
+    }
+
+    snprintk(shell_cmd, sizeof(shell_cmd), "diag %.*s", msg_len, msg);
+    comms_mgr_signal_cmd(CMD_SHELL_EXEC);
+}
@@ -1,9 +1,33 @@
 #ifndef COMMS_MGR_H_
 #define COMMS_MGR_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #define COMMS_MGR_DEC_BLK       0
 #define COMMS_MGR_DEC_RED       1
 
+struct comms_mgr_stats {
+    bool wifi_up;
+    bool mqtt_up;
+    // link drops, mqtt_lost only counts sessions lost with wifi still up
+    uint32_t wifi_lost;
+    uint32_t mqtt_lost;
+    // commands dropped because the queue stayed full
+    uint32_t cmd_overflows;
+    // waiting on the comms thread right now
+    uint32_t cmd_pending;
+    uint32_t relay_pending;
+};
+
+struct comms_mgr_bench_result {
+    uint32_t count;
+    uint32_t lost;
+    uint32_t min_us;
+    uint32_t avg_us;
+    uint32_t max_us;
+};
+
 int comms_mgr_init(uint8_t device_id);
 
 int comms_mgr_is_connected();
@@ -14,5 +38,10 @@ int comms_mgr_start_config();
 int comms_mgr_end_config();
 
 int comms_mgr_notify_decision(uint8_t decision);
+void comms_mgr_get_stats(struct comms_mgr_stats *stats);
+// publishes count pings to this box's own ping topic and times each echo,
+// blocks the caller for up to count * COMMS_MGR_BENCH_TIMEOUT_MS so it runs
+// on the UART shell thread, never the comms thread
+int comms_mgr_bench_broker(uint32_t count, struct comms_mgr_bench_result *result);
 
 #endif
\ No newline at end of file
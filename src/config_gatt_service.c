@@ -1,10 +1,12 @@
 #include <zephyr/logging/log.h>
 
-LOG_MODULE_REGISTER(config_gatt_service, LOG_LEVEL_DBG);
+LOG_MODULE_REGISTER(config_gatt_service, CONFIG_APP_LOG_LEVEL);
 
 #include <zephyr/zephyr.h>  
 #include <zephyr/bluetooth/gatt.h>
 #include <zephyr/settings/settings.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/byteorder.h>
 
 #include "config_gatt_service.h"
 #include "settings_util.h"
@@ -40,18 +42,207 @@ static struct bt_uuid_128 owlcms_platform_name_uuid = BT_UUID_INIT_128(
 static struct bt_uuid_128 config_write_uuid = BT_UUID_INIT_128(
 	BT_UUID_128_ENCODE(0x0000fe47, 0x8e22, 0x4541, 0x9d4c, 0x21edae82ed19));
 
+static struct bt_uuid_128 mqtt_tls_enabled_uuid = BT_UUID_INIT_128(
+	BT_UUID_128_ENCODE(0x0000fe48, 0x8e22, 0x4541, 0x9d4c, 0x21edae82ed19));
+
+static struct bt_uuid_128 mqtt_tls_hostname_uuid = BT_UUID_INIT_128(
+	BT_UUID_128_ENCODE(0x0000fe49, 0x8e22, 0x4541, 0x9d4c, 0x21edae82ed19));
+
+static struct bt_uuid_128 mqtt_tls_ca_uuid = BT_UUID_INIT_128(
+	BT_UUID_128_ENCODE(0x0000fe4a, 0x8e22, 0x4541, 0x9d4c, 0x21edae82ed19));
+
+static struct bt_uuid_128 mqtt_backup1_srv_uuid = BT_UUID_INIT_128(
+	BT_UUID_128_ENCODE(0x0000fe4b, 0x8e22, 0x4541, 0x9d4c, 0x21edae82ed19));
+
+static struct bt_uuid_128 mqtt_backup1_port_uuid = BT_UUID_INIT_128(
+	BT_UUID_128_ENCODE(0x0000fe4c, 0x8e22, 0x4541, 0x9d4c, 0x21edae82ed19));
+
+static struct bt_uuid_128 mqtt_backup2_srv_uuid = BT_UUID_INIT_128(
+	BT_UUID_128_ENCODE(0x0000fe4d, 0x8e22, 0x4541, 0x9d4c, 0x21edae82ed19));
+
+static struct bt_uuid_128 mqtt_backup2_port_uuid = BT_UUID_INIT_128(
+	BT_UUID_128_ENCODE(0x0000fe4e, 0x8e22, 0x4541, 0x9d4c, 0x21edae82ed19));
+
+static struct bt_uuid_128 mqtt_failover_threshold_uuid = BT_UUID_INIT_128(
+	BT_UUID_128_ENCODE(0x0000fe4f, 0x8e22, 0x4541, 0x9d4c, 0x21edae82ed19));
+
+static struct bt_uuid_128 config_blob_uuid = BT_UUID_INIT_128(
+	BT_UUID_128_ENCODE(0x0000fe50, 0x8e22, 0x4541, 0x9d4c, 0x21edae82ed19));
+
+#define CONFIG_BLOB_HDR_LEN         3
+#define CONFIG_BLOB_TLV_HDR_LEN     3
+#define CONFIG_BLOB_CRC_LEN         4
+
+#define CHUNK_HDR_LEN               2
+#define CHUNK_END_LEN               (CHUNK_HDR_LEN + 2 + 4)
+
+static struct bt_uuid_128 config_test_uuid = BT_UUID_INIT_128(
+	BT_UUID_128_ENCODE(0x0000fe51, 0x8e22, 0x4541, 0x9d4c, 0x21edae82ed19));
+
+static struct bt_uuid_128 wifi_networks_uuid = BT_UUID_INIT_128(
+	BT_UUID_128_ENCODE(0x0000fe52, 0x8e22, 0x4541, 0x9d4c, 0x21edae82ed19));
+
+#define WIFI_NETWORK_ENTRY_HDR_LEN  3
+
+// room for every field with a full size CA
+#define CONFIG_BLOB_MAXLEN          (SETTINGS_UTIL_TLS_CA_MAXLEN + 384)
+
 static struct config_settings config;
 
-static uint8_t wifi_ssid[32] = {};
-static uint8_t wifi_psk[32] = {};
+// network 0 is what the single ssid/psk characteristics edit
+static struct settings_wifi_network wifi_networks[SETTINGS_UTIL_MAX_WIFI_NETWORKS] = {};
 static uint8_t mqtt_srv[32] = {};
 static uint16_t mqtt_port = 0;
 static uint8_t mqtt_client_name[32] = {};
 static uint8_t owlcms_platform_name[32] = {};
+static uint8_t mqtt_tls_enabled = 0;
+static uint8_t mqtt_tls_hostname[32] = {};
+static uint8_t mqtt_tls_ca[SETTINGS_UTIL_TLS_CA_MAXLEN] = {};
+static uint16_t mqtt_tls_ca_len = 0;
+static bool mqtt_tls_ca_written = false;
+// bytes of the CA chunks received so far, mqtt_tls_ca_len is only set on the end chunk
+static uint16_t mqtt_tls_ca_rx_len = 0;
+static struct mqtt_broker_settings mqtt_backup_brokers[SETTINGS_UTIL_MAX_BROKERS - 1] = {};
+static uint8_t mqtt_failover_threshold = 0;
+static uint8_t owlcms_ble_gateway = 0;
+static uint8_t owlcms_power_profile = 0;
+static uint8_t owlcms_relay_key[SETTINGS_UTIL_RELAY_KEY_LEN] = {};
+static bool service_active = false;
+
+static uint8_t config_blob[CONFIG_BLOB_MAXLEN];
+static uint16_t config_blob_len = 0;
+static uint8_t config_blob_status = CONFIG_BLOB_NONE;
+
+enum tlv_type {
+    TLV_STR,
+    TLV_U8,
+    TLV_U16,
+    TLV_BLOB,
+    TLV_WIFI_NETWORK
+};
+
+struct tlv_field {
+    uint8_t tag;
+    enum tlv_type type;
+    void *value;
+    uint16_t size;
+};
+
+static const struct tlv_field tlv_fields[] = {
+    {CONFIG_TLV_WIFI_SSID,          TLV_STR,    wifi_networks[0].ssid,          sizeof(wifi_networks[0].ssid)},
+    {CONFIG_TLV_WIFI_PSK,           TLV_STR,    wifi_networks[0].psk,           sizeof(wifi_networks[0].psk)},
+    {CONFIG_TLV_MQTT_SRV,           TLV_STR,    mqtt_srv,                       sizeof(mqtt_srv)            },
+    {CONFIG_TLV_MQTT_PORT,          TLV_U16,    &mqtt_port,                     sizeof(mqtt_port)           },
+    {CONFIG_TLV_OWLCMS_PLATFORM,    TLV_STR,    owlcms_platform_name,           sizeof(owlcms_platform_name)},
+    {CONFIG_TLV_TLS_ENABLED,        TLV_U8,     &mqtt_tls_enabled,              sizeof(mqtt_tls_enabled)    },
+    {CONFIG_TLV_TLS_HOSTNAME,       TLV_STR,    mqtt_tls_hostname,              sizeof(mqtt_tls_hostname)   },
+    {CONFIG_TLV_TLS_CA,             TLV_BLOB,   mqtt_tls_ca,                    sizeof(mqtt_tls_ca)         },
+    {CONFIG_TLV_BACKUP1_SRV,        TLV_STR,    mqtt_backup_brokers[0].addr,    sizeof(mqtt_backup_brokers[0].addr)},
+    {CONFIG_TLV_BACKUP1_PORT,       TLV_U16,    &mqtt_backup_brokers[0].port,   sizeof(uint16_t)            },
+    {CONFIG_TLV_BACKUP2_SRV,        TLV_STR,    mqtt_backup_brokers[1].addr,    sizeof(mqtt_backup_brokers[1].addr)},
+    {CONFIG_TLV_BACKUP2_PORT,       TLV_U16,    &mqtt_backup_brokers[1].port,   sizeof(uint16_t)            },
+    {CONFIG_TLV_FAILOVER_THRESHOLD, TLV_U8,     &mqtt_failover_threshold,       sizeof(mqtt_failover_threshold)},
+    {CONFIG_TLV_BLE_GATEWAY,        TLV_U8,     &owlcms_ble_gateway,            sizeof(owlcms_ble_gateway)},
+    {CONFIG_TLV_WIFI_NETWORK,       TLV_WIFI_NETWORK, wifi_networks,            sizeof(wifi_networks)       },
+    {CONFIG_TLV_POWER_PROFILE,      TLV_U8,     &owlcms_power_profile,          sizeof(owlcms_power_profile)},
+    {CONFIG_TLV_RELAY_KEY,          TLV_BLOB,   owlcms_relay_key,               sizeof(owlcms_relay_key)}
+};
+
+static void (*config_test_cb)(void);
+
+static void commit_config();
+static void fill_staged_mqtt(struct mqtt_config_settings *mqtt_config);
+
+static ssize_t write_uint8(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+            const void *buf, uint16_t len, uint16_t offset, uint8_t flags)
+{
+    if (!service_active)
+        return BT_GATT_ERR(BT_ATT_ERR_WRITE_NOT_PERMITTED);
+
+    uint8_t *value = attr->user_data;
+
+    if (offset >= sizeof(uint8_t))
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+    if (offset + len > sizeof(uint8_t))
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+
+    memcpy(value + offset, buf, len);
+
+    return len;
+}
+
+static ssize_t read_uint8(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+            void *buf, uint16_t len, uint16_t offset)
+{
+    if (!service_active)
+        return BT_GATT_ERR(BT_ATT_ERR_READ_NOT_PERMITTED);
+
+    const uint8_t *value = attr->user_data;
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, value, sizeof(uint8_t));
+}
+
+// [offset:2 LE][data] chunks in order into buf, offset 0 starts over. ATT
+// itself caps a (long) attribute value at 512 bytes, so anything bigger goes
+// as a series of plain writes with the offset in the payload.
+static ssize_t write_chunk(uint8_t *dst, uint16_t size, uint16_t *rx_len,
+            const uint8_t *chunk, uint16_t len, uint16_t att_offset)
+{
+    if (att_offset != 0 || len < CHUNK_HDR_LEN)
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+
+    uint16_t offset = sys_get_le16(chunk);
+    uint16_t data_len = len - CHUNK_HDR_LEN;
+
+    if (offset == 0)
+        *rx_len = 0;
+    else if (offset != *rx_len)
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+    if (data_len > size - offset)
+    {
+        *rx_len = 0;
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+
+    memcpy(dst + offset, chunk + CHUNK_HDR_LEN, data_len);
+    *rx_len = offset + data_len;
+    return len;
+}
+
+// chunks as in write_chunk(), closed by [0xffff][total_len:2 LE][crc32:4 LE]
+static ssize_t write_tls_ca(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+            const void *buf, uint16_t len, uint16_t offset, uint8_t flags)
+{
+    if (!service_active)
+        return BT_GATT_ERR(BT_ATT_ERR_WRITE_NOT_PERMITTED);
+
+    const uint8_t *chunk = buf;
+
+    if (len != CHUNK_END_LEN || sys_get_le16(chunk) != CONFIG_CHUNK_END)
+        return write_chunk(mqtt_tls_ca, sizeof(mqtt_tls_ca), &mqtt_tls_ca_rx_len, chunk, len, offset);
+
+    uint16_t total_len = sys_get_le16(&chunk[2]);
+    uint32_t crc = sys_get_le32(&chunk[4]);
+    if (total_len != mqtt_tls_ca_rx_len || crc32_ieee(mqtt_tls_ca, total_len) != crc)
+    {
+        LOG_ERR("tls ca rejected, %d of %d bytes or crc mismatch", mqtt_tls_ca_rx_len, total_len);
+        mqtt_tls_ca_rx_len = 0;
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    }
+
+    mqtt_tls_ca_len = total_len;
+    mqtt_tls_ca_written = true;
+    mqtt_tls_ca_rx_len = 0;
+    LOG_INF("tls ca staged (%d bytes)", total_len);
+    return len;
+}
 
 static ssize_t write_uint16(struct bt_conn *conn, const struct bt_gatt_attr *attr,
             const void *buf, uint16_t len, uint16_t offset, uint8_t flags)
 {
+    if (!service_active)
+        return BT_GATT_ERR(BT_ATT_ERR_WRITE_NOT_PERMITTED);
+
     uint8_t *value = attr->user_data;
 
     if (offset >= sizeof(uint16_t))
@@ -67,6 +258,9 @@ static ssize_t write_uint16(struct bt_conn *conn, const struct bt_gatt_attr *att
 static ssize_t read_uint16(struct bt_conn *conn, const struct bt_gatt_attr *attr,
             void *buf, uint16_t len, uint16_t offset)
 {
+    if (!service_active)
+        return BT_GATT_ERR(BT_ATT_ERR_READ_NOT_PERMITTED);
+
     const uint8_t *value = attr->user_data;
 
     return bt_gatt_attr_read(conn, attr, buf, len, offset, value, sizeof(uint16_t));
@@ -75,6 +269,9 @@ static ssize_t read_uint16(struct bt_conn *conn, const struct bt_gatt_attr *attr
 static ssize_t read_value_wifi_ssid(struct bt_conn *conn, const struct bt_gatt_attr *attr,
 			void *buf, uint16_t len, uint16_t offset)
 {
+    if (!service_active)
+        return BT_GATT_ERR(BT_ATT_ERR_READ_NOT_PERMITTED);
+
     //LOG_INF("read wifi ssid");
     const char *value = attr->user_data;
     //LOG_INF("%d, %d, %d", conn, attr, buff)
@@ -87,11 +284,16 @@ static ssize_t write_value_wifi_ssid(struct bt_conn *conn, const struct bt_gatt_
 			 const void *buf, uint16_t len, uint16_t offset,
 			 uint8_t flags)
 {
-    if (flags & BT_GATT_WRITE_FLAG_PREPARE) {
-		return 0;
-	}
+    if (!service_active)
+        return BT_GATT_ERR(BT_ATT_ERR_WRITE_NOT_PERMITTED);
+
+    // no prepare queue (CONFIG_BT_ATT_PREPARE_COUNT), an ssid/psk fits a
+    // single write once the MTU is 34 or more
+    if (flags & BT_GATT_WRITE_FLAG_PREPARE)
+        return BT_GATT_ERR(BT_ATT_ERR_NOT_SUPPORTED);
 
-	if (offset + len > 32) {
+	// leave room for the terminator
+	if (offset + len > 31) {
 		return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
 	}
     //LOG_INF("write wifi ssid");
@@ -104,6 +306,9 @@ static ssize_t write_value_wifi_ssid(struct bt_conn *conn, const struct bt_gatt_
 static ssize_t read_value_wifi_psk(struct bt_conn *conn, const struct bt_gatt_attr *attr,
 			void *buf, uint16_t len, uint16_t offset)
 {
+    if (!service_active)
+        return BT_GATT_ERR(BT_ATT_ERR_READ_NOT_PERMITTED);
+
     //LOG_INF("read wifi psk");
     const char *value = attr->user_data;
 
@@ -115,11 +320,15 @@ static ssize_t write_value_wifi_psk(struct bt_conn *conn, const struct bt_gatt_a
 			 const void *buf, uint16_t len, uint16_t offset,
 			 uint8_t flags)
 {
-    if (flags & BT_GATT_WRITE_FLAG_PREPARE) {
-		return 0;
-	}
+    if (!service_active)
+        return BT_GATT_ERR(BT_ATT_ERR_WRITE_NOT_PERMITTED);
+
+    // as for the ssid, no prepared writes
+    if (flags & BT_GATT_WRITE_FLAG_PREPARE)
+        return BT_GATT_ERR(BT_ATT_ERR_NOT_SUPPORTED);
 
-	if (offset + len > 32) {
+	// leave room for the terminator
+	if (offset + len > 31) {
 		return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
 	}
     //LOG_INF("write wifi psk");
@@ -129,48 +338,355 @@ static ssize_t write_value_wifi_psk(struct bt_conn *conn, const struct bt_gatt_a
     return len;
 }
 
+static const struct tlv_field *find_tlv_field(uint8_t tag)
+{
+    for (int i = 0; i < ARRAY_SIZE(tlv_fields); i++)
+    {
+        if (tlv_fields[i].tag == tag)
+            return &tlv_fields[i];
+    }
+    return NULL;
+}
+
+// [slot:1][priority:1][ssid_len:1][ssid][psk], an empty ssid clears the slot
+static bool wifi_network_entry_valid(const uint8_t *entry, uint16_t len)
+{
+    if (len < WIFI_NETWORK_ENTRY_HDR_LEN)
+        return false;
+
+    uint8_t slot = entry[0];
+    uint8_t ssid_len = entry[2];
+    if (slot >= SETTINGS_UTIL_MAX_WIFI_NETWORKS || ssid_len > len - WIFI_NETWORK_ENTRY_HDR_LEN)
+        return false;
+
+    uint16_t psk_len = len - WIFI_NETWORK_ENTRY_HDR_LEN - ssid_len;
+    const uint8_t *ssid = &entry[WIFI_NETWORK_ENTRY_HDR_LEN];
+    if (ssid_len >= SETTING_TYPE_STR_MAXLEN || psk_len >= SETTING_TYPE_STR_MAXLEN
+            || memchr(ssid, 0, ssid_len + psk_len) != NULL)
+        return false;
+    if (psk_len > 0 && psk_len < 8)
+        return false;
+
+    // network 0 is the legacy ssid/psk and always has to be there
+    return ssid_len > 0 || slot != 0;
+}
+
+static void wifi_network_entry_store(const uint8_t *entry, uint16_t len)
+{
+    uint8_t ssid_len = entry[2];
+    uint16_t psk_len = len - WIFI_NETWORK_ENTRY_HDR_LEN - ssid_len;
+    struct settings_wifi_network *network = &wifi_networks[entry[0]];
+
+    memset(network, 0, sizeof(*network));
+    if (ssid_len == 0)
+        return;
+
+    network->priority = entry[1];
+    memcpy(network->ssid, &entry[WIFI_NETWORK_ENTRY_HDR_LEN], ssid_len);
+    memcpy(network->psk, &entry[WIFI_NETWORK_ENTRY_HDR_LEN + ssid_len], psk_len);
+}
+
+static bool tlv_value_valid(const struct tlv_field *field, const uint8_t *value, uint16_t len)
+{
+    switch (field->type)
+    {
+    case TLV_STR:
+        // needs the terminator, and no embedded nulls
+        if (len >= field->size || memchr(value, 0, len) != NULL)
+            return false;
+        // WPA2 passphrases are 8..63, empty for an open network
+        if (field->tag == CONFIG_TLV_WIFI_PSK && len > 0 && len < 8)
+            return false;
+        if ((field->tag == CONFIG_TLV_WIFI_SSID || field->tag == CONFIG_TLV_MQTT_SRV
+                || field->tag == CONFIG_TLV_OWLCMS_PLATFORM) && len == 0)
+            return false;
+        return true;
+    case TLV_U8:
+        return len == sizeof(uint8_t);
+    case TLV_U16:
+        if (len != sizeof(uint16_t))
+            return false;
+        // backup ports can be 0 (unused), the primary can't
+        return field->tag != CONFIG_TLV_MQTT_PORT || sys_get_le16(value) != 0;
+    case TLV_BLOB:
+        // the relay key is all or nothing
+        if (field->tag == CONFIG_TLV_RELAY_KEY)
+            return len == field->size;
+        return len <= field->size;
+    case TLV_WIFI_NETWORK:
+        return wifi_network_entry_valid(value, len);
+    }
+    return false;
+}
+
+static void tlv_value_store(const struct tlv_field *field, const uint8_t *value, uint16_t len)
+{
+    switch (field->type)
+    {
+    case TLV_STR:
+        memcpy(field->value, value, len);
+        ((uint8_t *)field->value)[len] = 0;
+        break;
+    case TLV_U8:
+        *(uint8_t *)field->value = value[0];
+        break;
+    case TLV_U16:
+        *(uint16_t *)field->value = sys_get_le16(value);
+        break;
+    case TLV_BLOB:
+        memcpy(field->value, value, len);
+        if (field->tag == CONFIG_TLV_TLS_CA)
+        {
+            mqtt_tls_ca_len = len;
+            mqtt_tls_ca_written = true;
+        }
+        break;
+    case TLV_WIFI_NETWORK:
+        wifi_network_entry_store(value, len);
+        break;
+    }
+}
+
+// first pass with store false checks the whole blob, so a bad field can't
+// leave the config half written
+static int walk_config_tlvs(const uint8_t *tlvs, uint16_t len, bool store)
+{
+    uint16_t pos = 0;
+
+    while (pos < len)
+    {
+        if (len - pos < CONFIG_BLOB_TLV_HDR_LEN)
+            return CONFIG_BLOB_ERR_LEN;
+
+        uint8_t tag = tlvs[pos];
+        uint16_t value_len = sys_get_le16(&tlvs[pos + 1]);
+        const uint8_t *value = &tlvs[pos + CONFIG_BLOB_TLV_HDR_LEN];
+        pos += CONFIG_BLOB_TLV_HDR_LEN;
+
+        if (value_len > len - pos)
+            return CONFIG_BLOB_ERR_LEN;
+        pos += value_len;
+
+        const struct tlv_field *field = find_tlv_field(tag);
+        if (field == NULL)
+        {
+            if (!store)
+                LOG_WRN("skipping unknown config tag 0x%02x", tag);
+            continue;
+        }
+
+        if (store)
+            tlv_value_store(field, value, value_len);
+        else if (!tlv_value_valid(field, value, value_len))
+        {
+            LOG_ERR("invalid config tag 0x%02x (len %d)", tag, value_len);
+            return CONFIG_BLOB_ERR_FIELD;
+        }
+    }
+    return CONFIG_BLOB_OK;
+}
+
+static uint8_t apply_config_blob(const uint8_t *blob, uint16_t len)
+{
+    int ret;
+
+    if (blob[0] != CONFIG_BLOB_VERSION)
+        return CONFIG_BLOB_ERR_VERSION;
+
+    uint16_t crc_pos = len - CONFIG_BLOB_CRC_LEN;
+    if (crc32_ieee(blob, crc_pos) != sys_get_le32(&blob[crc_pos]))
+        return CONFIG_BLOB_ERR_CRC;
+
+    ret = walk_config_tlvs(&blob[CONFIG_BLOB_HDR_LEN], crc_pos - CONFIG_BLOB_HDR_LEN, false);
+    if (ret != CONFIG_BLOB_OK)
+        return ret;
+
+    walk_config_tlvs(&blob[CONFIG_BLOB_HDR_LEN], crc_pos - CONFIG_BLOB_HDR_LEN, true);
+    // same path as a CONFIG_TEST_START write, only committed once it's
+    // reached the broker
+    if (config_test_cb != NULL)
+        config_test_cb();
+    return CONFIG_BLOB_OK;
+}
+
+/*
+*   The blob arrives as write_chunk() chunks, the chunk at offset 0 starts a
+*   new blob and it's applied once total_len bytes are in, its own crc is
+*   the final check.
+*/
+static ssize_t write_config_blob(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+            const void *buf, uint16_t len, uint16_t offset, uint8_t flags)
+{
+    if (!service_active)
+        return BT_GATT_ERR(BT_ATT_ERR_WRITE_NOT_PERMITTED);
+
+    ssize_t ret = write_chunk(config_blob, sizeof(config_blob), &config_blob_len, buf, len, offset);
+    if (ret < 0)
+    {
+        config_blob_status = CONFIG_BLOB_ERR_LEN;
+        return ret;
+    }
+
+    if (config_blob_len < CONFIG_BLOB_HDR_LEN)
+        return len;
+
+    uint16_t total_len = sys_get_le16(&config_blob[1]);
+    if (total_len < CONFIG_BLOB_HDR_LEN + CONFIG_BLOB_CRC_LEN || total_len > sizeof(config_blob)
+            || config_blob_len > total_len)
+    {
+        config_blob_len = 0;
+        config_blob_status = CONFIG_BLOB_ERR_LEN;
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+
+    if (config_blob_len < total_len)
+        return len;
+
+    config_blob_status = apply_config_blob(config_blob, total_len);
+    config_blob_len = 0;
+    LOG_INF("config blob (%d bytes) status %d", total_len, config_blob_status);
+
+    if (config_blob_status != CONFIG_BLOB_OK)
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    return len;
+}
+
+static ssize_t read_config_blob_status(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+            void *buf, uint16_t len, uint16_t offset)
+{
+    if (!service_active)
+        return BT_GATT_ERR(BT_ATT_ERR_READ_NOT_PERMITTED);
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &config_blob_status,
+                sizeof(config_blob_status));
+}
+
 static ssize_t config_write(struct bt_conn *conn, const struct bt_gatt_attr *attr,
 			 const void *buf, uint16_t len, uint16_t offset,
 			 uint8_t flags)
 {
-    settings_util_set_wifi_ssid(wifi_ssid, strlen(wifi_ssid));
-    settings_util_set_wifi_psk(wifi_psk, strlen(wifi_psk));
+    if (!service_active)
+        return BT_GATT_ERR(BT_ATT_ERR_WRITE_NOT_PERMITTED);
+
+    commit_config();
+    return len;
+}
+
+// one entry per write, same format as CONFIG_TLV_WIFI_NETWORK
+static ssize_t write_wifi_network(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+            const void *buf, uint16_t len, uint16_t offset, uint8_t flags)
+{
+    if (!service_active)
+        return BT_GATT_ERR(BT_ATT_ERR_WRITE_NOT_PERMITTED);
+
+    if (offset != 0)
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+    if (!wifi_network_entry_valid(buf, len))
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+
+    wifi_network_entry_store(buf, len);
+    return len;
+}
+
+// [slot][priority][ssid_len][ssid] for each network in use, psks never go back out
+static ssize_t read_wifi_networks(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+            void *buf, uint16_t len, uint16_t offset)
+{
+    if (!service_active)
+        return BT_GATT_ERR(BT_ATT_ERR_READ_NOT_PERMITTED);
+
+    uint8_t list[SETTINGS_UTIL_MAX_WIFI_NETWORKS * (WIFI_NETWORK_ENTRY_HDR_LEN + SETTING_TYPE_STR_MAXLEN)];
+    uint16_t list_len = 0;
+
+    for (uint8_t i = 0; i < SETTINGS_UTIL_MAX_WIFI_NETWORKS; i++)
+    {
+        uint8_t ssid_len = strlen(wifi_networks[i].ssid);
+        if (ssid_len == 0)
+            continue;
+
+        list[list_len++] = i;
+        list[list_len++] = wifi_networks[i].priority;
+        list[list_len++] = ssid_len;
+        memcpy(&list[list_len], wifi_networks[i].ssid, ssid_len);
+        list_len += ssid_len;
+    }
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, list, list_len);
+}
+
+// writing CONFIG_TEST_START runs the staged settings against the network,
+// progress comes back as CONFIG_TEST_* notifications on the same characteristic
+static ssize_t write_config_test(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+            const void *buf, uint16_t len, uint16_t offset, uint8_t flags)
+{
+    if (!service_active)
+        return BT_GATT_ERR(BT_ATT_ERR_WRITE_NOT_PERMITTED);
+    if (offset != 0 || len != sizeof(uint8_t))
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    if (((const uint8_t *)buf)[0] != CONFIG_TEST_START)
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+
+    if (config_test_cb != NULL)
+        config_test_cb();
+
+    return len;
+}
+
+static void fill_staged_mqtt(struct mqtt_config_settings *mqtt_config)
+{
+    strcpy(mqtt_config->broker_addr, mqtt_srv);
+    mqtt_config->port = mqtt_port;
+    strcpy(mqtt_config->client_name, mqtt_client_name);
+    mqtt_config->tls_enabled = mqtt_tls_enabled;
+    strcpy(mqtt_config->tls_hostname, mqtt_tls_hostname);
+    memcpy(mqtt_config->backup_brokers, mqtt_backup_brokers, sizeof(mqtt_backup_brokers));
+    mqtt_config->failover_threshold = mqtt_failover_threshold;
+    // new broker list, start over from the primary
+    mqtt_config->preferred_broker = 0;
+}
+
+static void commit_config()
+{
+    settings_util_set_wifi_networks(wifi_networks);
 
     struct mqtt_config_settings mqtt_config;
-    strcpy(mqtt_config.broker_addr, mqtt_srv);
-    mqtt_config.port = mqtt_port;
-    strcpy(mqtt_config.client_name, mqtt_client_name);
+    fill_staged_mqtt(&mqtt_config);
     settings_util_set_mqtt_config(&mqtt_config);
 
+    if (mqtt_tls_ca_written)
+    {
+        settings_util_set_mqtt_tls_ca(mqtt_tls_ca, mqtt_tls_ca_len);
+        mqtt_tls_ca_written = false;
+    }
+
     struct owlcms_config_settings owlcms_config;
     strcpy(owlcms_config.platform, owlcms_platform_name);
+    owlcms_config.ble_gateway = owlcms_ble_gateway;
+    owlcms_config.power_profile = owlcms_power_profile;
+    memcpy(owlcms_config.relay_key, owlcms_relay_key, sizeof(owlcms_relay_key));
     settings_util_set_owlcms_config(&owlcms_config);
 
-    return len;
+    // staged as a candidate, the next boot has to reach the broker with it
+    // or it rolls back to the current config
+    settings_util_commit_candidate();
 }
 
-// struct bt_gatt_attr config_service_attrs[] = {
-//     BT_GATT_PRIMARY_SERVICE(&config_service_uuid),
-//     BT_GATT_CHARACTERISTIC(&wifi_ssid_uuid.uuid,
-//         BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
-//         BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
-//         read_value_wifi_ssid, write_value_wifi_ssid, &config.wifi_ssid),
-//     BT_GATT_CHARACTERISTIC(&wifi_psk_uuid.uuid,
-//         BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
-//         BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
-//         read_value_wifi_psk, write_value_wifi_psk, &config.wifi_psk)
-// };
-
-BT_GATT_SERVICE_DEFINE(config_service,
+/*
+*   Registered only while config mode is on, and service_active is checked in
+*   every callback as well. Outside config mode bluetooth stays up for status
+*   adverts and the decision relay, and nothing here (the PSK least of all)
+*   may be reachable then.
+*/
+static struct bt_gatt_attr config_service_attrs[] = {
     BT_GATT_PRIMARY_SERVICE(&config_service_uuid),
         BT_GATT_CHARACTERISTIC(&wifi_ssid_uuid.uuid,
             BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
             BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
-            read_value_wifi_ssid, write_value_wifi_ssid, &wifi_ssid),
+            read_value_wifi_ssid, write_value_wifi_ssid, &wifi_networks[0].ssid),
         BT_GATT_CHARACTERISTIC(&wifi_psk_uuid.uuid,
             BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
             BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
-            read_value_wifi_psk, write_value_wifi_psk, &wifi_psk),
+            read_value_wifi_psk, write_value_wifi_psk, &wifi_networks[0].psk),
         BT_GATT_CHARACTERISTIC(&mqtt_srv_uuid.uuid,
             BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
             BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
@@ -187,42 +703,110 @@ BT_GATT_SERVICE_DEFINE(config_service,
             BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
             BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
             read_value_wifi_psk, write_value_wifi_psk, &owlcms_platform_name),
+        BT_GATT_CHARACTERISTIC(&mqtt_tls_enabled_uuid.uuid,
+            BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
+            BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
+            read_uint8, write_uint8, &mqtt_tls_enabled),
+        BT_GATT_CHARACTERISTIC(&mqtt_tls_hostname_uuid.uuid,
+            BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
+            BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
+            read_value_wifi_psk, write_value_wifi_psk, &mqtt_tls_hostname),
+        BT_GATT_CHARACTERISTIC(&mqtt_tls_ca_uuid.uuid,
+            BT_GATT_CHRC_WRITE,
+            BT_GATT_PERM_WRITE,
+            NULL, write_tls_ca, &mqtt_tls_ca),
+        BT_GATT_CHARACTERISTIC(&mqtt_backup1_srv_uuid.uuid,
+            BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
+            BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
+            read_value_wifi_psk, write_value_wifi_psk, &mqtt_backup_brokers[0].addr),
+        BT_GATT_CHARACTERISTIC(&mqtt_backup1_port_uuid.uuid,
+            BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
+            BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
+            read_uint16, write_uint16, &mqtt_backup_brokers[0].port),
+        BT_GATT_CHARACTERISTIC(&mqtt_backup2_srv_uuid.uuid,
+            BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
+            BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
+            read_value_wifi_psk, write_value_wifi_psk, &mqtt_backup_brokers[1].addr),
+        BT_GATT_CHARACTERISTIC(&mqtt_backup2_port_uuid.uuid,
+            BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
+            BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
+            read_uint16, write_uint16, &mqtt_backup_brokers[1].port),
+        BT_GATT_CHARACTERISTIC(&mqtt_failover_threshold_uuid.uuid,
+            BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
+            BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
+            read_uint8, write_uint8, &mqtt_failover_threshold),
         BT_GATT_CHARACTERISTIC(&config_write_uuid.uuid,
             BT_GATT_CHRC_WRITE_WITHOUT_RESP,
             BT_GATT_PERM_WRITE,
-            NULL, config_write, (void *)1)
-);
+            NULL, config_write, (void *)1),
+        BT_GATT_CHARACTERISTIC(&config_blob_uuid.uuid,
+            BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
+            BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
+            read_config_blob_status, write_config_blob, &config_blob),
+        BT_GATT_CHARACTERISTIC(&config_test_uuid.uuid,
+            BT_GATT_CHRC_WRITE | BT_GATT_CHRC_NOTIFY,
+            BT_GATT_PERM_WRITE,
+            NULL, write_config_test, NULL),
+        BT_GATT_CCC(NULL, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+        BT_GATT_CHARACTERISTIC(&wifi_networks_uuid.uuid,
+            BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
+            BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
+            read_wifi_networks, write_wifi_network, &wifi_networks)
+};
 
-//static struct bt_gatt_service config_service = BT_GATT_SERVICE(config_service_attrs);
+static struct bt_gatt_service config_service = BT_GATT_SERVICE(config_service_attrs);
 
 //static void (* service_write_cb)(struct config_settings);
 
 void config_gatt_service_init(struct config_settings *settings)
 {
     int ret = 0;
-    strcpy(wifi_ssid,   settings->wifi->ssid);
-    strcpy(wifi_psk, settings->wifi->psk);
+    // settings->wifi is the network currently joined, edits start from the table
+    settings_util_load_wifi_networks(wifi_networks);
     strcpy(mqtt_srv, settings->mqtt->broker_addr);
     mqtt_port = settings->mqtt->port;
     strcpy(mqtt_client_name, "Empty");
     strcpy(owlcms_platform_name, settings->owlcms->platform);
+    mqtt_tls_enabled = settings->mqtt->tls_enabled;
+    strcpy(mqtt_tls_hostname, settings->mqtt->tls_hostname);
+    mqtt_tls_ca_len = 0;
+    mqtt_tls_ca_rx_len = 0;
+    mqtt_tls_ca_written = false;
+    memcpy(mqtt_backup_brokers, settings->mqtt->backup_brokers, sizeof(mqtt_backup_brokers));
+    mqtt_failover_threshold = settings->mqtt->failover_threshold;
+    owlcms_ble_gateway = settings->owlcms->ble_gateway;
+    owlcms_power_profile = settings->owlcms->power_profile;
+    memcpy(owlcms_relay_key, settings->owlcms->relay_key, sizeof(owlcms_relay_key));
+    config_blob_len = 0;
+    config_blob_status = CONFIG_BLOB_NONE;
     //snprintk(config.wifi_ssid, 10, "this is a");
     //memcpy(config.wifi_ssid, "test str  ", 10);
 
-    // ret = bt_gatt_service_register(&config_service);
-    // if (ret == 0)
-    // {
-    //     LOG_INF("registered service");
-    // }
-    // else {
-    //     LOG_ERR("failed to register service %d", ret);
-    // }
-
+    if (service_active)
+        return;
+
+    ret = bt_gatt_service_register(&config_service);
+    if (ret == 0)
+    {
+        LOG_INF("registered service");
+        service_active = true;
+    }
+    else {
+        LOG_ERR("failed to register service %d", ret);
+    }
 }
 
+// bluetooth stays up outside config mode (status adverts, decision relay),
+// the service goes away with config mode
 void config_gatt_service_remove()
 {
-    //bt_gatt_service_unregister(&config_service);
+    if (!service_active)
+        return;
+
+    service_active = false;
+    int ret = bt_gatt_service_unregister(&config_service);
+    if (ret != 0)
+        LOG_ERR("failed to unregister service %d", ret);
 }
 
 void config_gatt_service_set_write_cb(void (*cb)(struct config_settings))
@@ -230,3 +814,36 @@ void config_gatt_service_set_write_cb(void (*cb)(struct config_settings))
     //service_write_cb = cb;
 }
 
+void config_gatt_service_set_test_cb(void (*cb)(void))
+{
+    config_test_cb = cb;
+}
+
+void config_gatt_service_get_staged(struct wifi_config_settings *wifi, struct mqtt_config_settings *mqtt)
+{
+    strcpy(wifi->ssid, wifi_networks[0].ssid);
+    strcpy(wifi->psk, wifi_networks[0].psk);
+    wifi->ssid_length = strlen(wifi_networks[0].ssid);
+    wifi->psk_length = strlen(wifi_networks[0].psk);
+    fill_staged_mqtt(mqtt);
+}
+
+void config_gatt_service_commit()
+{
+    commit_config();
+}
+
+void config_gatt_service_notify_test(uint8_t phase, uint8_t status, uint32_t elapsed_ms)
+{
+    uint8_t report[6];
+    const struct bt_gatt_attr *attr;
+
+    report[0] = phase;
+    report[1] = status;
+    sys_put_le32(elapsed_ms, &report[2]);
+
+    attr = bt_gatt_find_by_uuid(config_service.attrs, config_service.attr_count,
+                                &config_test_uuid.uuid);
+    if (attr != NULL)
+        bt_gatt_notify(NULL, attr, report, sizeof(report));
+}
@@ -9,6 +9,79 @@
 #define CHAR_UUID_VAL_WIFI_SSID             BT_UUID_DECLARE_16(0xb0001)
 #define CHAR_UUID_VAL_WIFI_PSK              BT_UUID_DECLARE_16(0xb0002)
 
+/*
+*   Values longer than an ATT attribute (512 bytes) are written in chunks, each
+*   a plain write of [offset:2 LE][data] with the offset into the whole value.
+*   Offset 0 starts over, every other chunk has to follow on from the last.
+*   A chunk can be up to the ATT MTU - 5 bytes of data. There is no ATT
+*   prepare queue, prepared (long) writes are refused on every characteristic.
+*
+*   TLS CA characteristic (fe4a), chunks of the CA (PEM or DER) closed by
+*   [0xffff][total_len:2 LE][crc32:4 LE], crc32_ieee over the whole CA. The CA
+*   is only staged when the end chunk matches.
+*/
+#define CONFIG_CHUNK_END                    0xffff
+
+/*
+*   Bulk config characteristic (fe50), the whole config as chunks of:
+*
+*       [version:1][total_len:2 LE][tag:1 len:2 LE value:len]...[crc32:4 LE]
+*
+*   total_len counts every byte including the crc, which is crc32_ieee over
+*   everything before it. Only the tags present are changed, unknown tags are
+*   skipped. Strings are sent without a terminator, ports as uint16 LE.
+*   Reading the characteristic returns the CONFIG_BLOB_* status of the last write.
+*   A good blob is staged and the connection test below started on it, it's
+*   only committed if the test reaches the broker.
+*/
+#define CONFIG_BLOB_VERSION                 1
+
+#define CONFIG_TLV_WIFI_SSID                0x01
+#define CONFIG_TLV_WIFI_PSK                 0x02
+#define CONFIG_TLV_MQTT_SRV                 0x03
+#define CONFIG_TLV_MQTT_PORT                0x04
+#define CONFIG_TLV_OWLCMS_PLATFORM          0x05
+#define CONFIG_TLV_TLS_ENABLED              0x06
+#define CONFIG_TLV_TLS_HOSTNAME             0x07
+#define CONFIG_TLV_TLS_CA                   0x08
+#define CONFIG_TLV_BACKUP1_SRV              0x09
+#define CONFIG_TLV_BACKUP1_PORT             0x0a
+#define CONFIG_TLV_BACKUP2_SRV              0x0b
+#define CONFIG_TLV_BACKUP2_PORT             0x0c
+#define CONFIG_TLV_FAILOVER_THRESHOLD       0x0d
+#define CONFIG_TLV_BLE_GATEWAY              0x0e
+// [slot:1][priority:1][ssid_len:1][ssid][psk], repeatable, empty ssid clears
+#define CONFIG_TLV_WIFI_NETWORK             0x0f
+#define CONFIG_TLV_POWER_PROFILE            0x10
+// 16 bytes, the same on every box of a platform, only ever written
+#define CONFIG_TLV_RELAY_KEY                0x11
+
+#define CONFIG_BLOB_OK                      0
+#define CONFIG_BLOB_ERR_LEN                 1
+#define CONFIG_BLOB_ERR_VERSION             2
+#define CONFIG_BLOB_ERR_CRC                 3
+#define CONFIG_BLOB_ERR_FIELD               4
+#define CONFIG_BLOB_NONE                    0xff
+
+/*
+*   Connection test characteristic (fe51), write CONFIG_TEST_START and the box
+*   tries the staged settings while BLE stays up. Each phase is notified as
+*   [phase:1][status:1][elapsed_ms:4 LE], the staged config is only committed
+*   after MQTT CONNACK (notified as CONFIG_TEST_PHASE_COMMIT).
+*/
+#define CONFIG_TEST_START                   0x01
+
+#define CONFIG_TEST_PHASE_NONE              0
+#define CONFIG_TEST_PHASE_WIFI              1
+#define CONFIG_TEST_PHASE_DHCP              2
+#define CONFIG_TEST_PHASE_MQTT              3
+#define CONFIG_TEST_PHASE_COMMIT            4
+
+#define CONFIG_TEST_OK                      0
+#define CONFIG_TEST_FAILED                  1
+#define CONFIG_TEST_TIMEOUT                 2
+#define CONFIG_TEST_BUSY                    3
+
 struct config_settings {
     struct wifi_config_settings *wifi;
     struct mqtt_config_settings *mqtt;
@@ -20,4 +93,9 @@ void config_gatt_service_remove();
 
 void config_gatt_service_set_write_cb(void (*cb)(struct config_settings));
 
+void config_gatt_service_set_test_cb(void (*cb)(void));
+void config_gatt_service_get_staged(struct wifi_config_settings *wifi, struct mqtt_config_settings *mqtt);
+void config_gatt_service_commit();
+void config_gatt_service_notify_test(uint8_t phase, uint8_t status, uint32_t elapsed_ms);
+
 #endif
\ No newline at end of file
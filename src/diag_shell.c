@@ -0,0 +1,194 @@
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(diag_shell, CONFIG_APP_LOG_LEVEL);
+
+#include <zephyr/zephyr.h>
+#include <zephyr/shell/shell.h>
+#include <zephyr/shell/shell_dummy.h>
+#include <stdlib.h>
+
+#include "diag_shell.h"
+#include "msys.h"
+#include "io.h"
+#include "io_mgr.h"
+#include "comms_mgr.h"
+#include "mqtt_client.h"
+
+#define DIAG_BENCH_MAX_COUNT    50
+
+static const char *btn_names[] = {"usr", "red", "blk"};
+static const char *gesture_names[] = {"press", "hold2", "hold5"};
+static const char *led_mode_names[] = {"off", "on", "blink", "alt"};
+// nothing that drives the box or blocks, the broker is open to the venue
+static const char *remote_cmds[] = {"state", "mqtt"};
+
+static int find_name(const char *names[], size_t count, const char *name)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (strcmp(names[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static int cmd_state(const struct shell *sh, size_t argc, char **argv)
+{
+    struct msys_transition history[MSYS_HISTORY_LEN];
+    uint8_t count = msys_get_history(history, ARRAY_SIZE(history));
+
+    shell_print(sh, "state %s, %u events queued", msys_state_name(msys_get_state()),
+                    msys_evt_pending());
+    for (uint8_t i = 0; i < count; i++)
+        shell_print(sh, "%10u ms  %-14s -> %-14s evt %u", history[i].time_ms,
+                        msys_state_name(history[i].from), msys_state_name(history[i].to),
+                        history[i].evt);
+    return 0;
+}
+
+static int cmd_evt(const struct shell *sh, size_t argc, char **argv)
+{
+    unsigned long evt = strtoul(argv[1], NULL, 0);
+    int ret;
+
+    if (evt > SYS_EVT_CONFIG_END)
+    {
+        shell_error(sh, "event 0..%u", SYS_EVT_CONFIG_END);
+        return -EINVAL;
+    }
+    ret = msys_signal_evt(evt);
+    shell_print(sh, "evt %lu signalled %d", evt, ret);
+    return ret;
+}
+
+// the same event sequence the button thread produces for each gesture
+static int cmd_btn(const struct shell *sh, size_t argc, char **argv)
+{
+    int btn = find_name(btn_names, ARRAY_SIZE(btn_names), argv[1]);
+    int gesture = (argc > 2) ? find_name(gesture_names, ARRAY_SIZE(gesture_names), argv[2]) : 0;
+
+    if (btn < 0 || gesture < 0)
+    {
+        shell_error(sh, "diag btn <usr|red|blk> [press|hold2|hold5]");
+        return -EINVAL;
+    }
+
+    io_btn_cb(btn, BTN_EVT_PRESSED);
+    if (gesture >= 1)
+        io_btn_cb(btn, BTN_EVT_HOLD_2s);
+    if (gesture >= 2)
+        io_btn_cb(btn, BTN_EVT_HOLD_5s);
+    io_btn_cb(btn, BTN_EVT_RELEASED);
+    return 0;
+}
+
+static int cmd_led(const struct shell *sh, size_t argc, char **argv)
+{
+    int mode = find_name(led_mode_names, ARRAY_SIZE(led_mode_names), argv[1]);
+    leds_cfg_t cfg;
+
+    if (mode < 0)
+    {
+        shell_error(sh, "diag led <off|on|blink|alt> [pattern]");
+        return -EINVAL;
+    }
+    // indexes line up with LED_CFG_TYPE_*
+    cfg.cfg_type = mode;
+    cfg.pattern = (argc > 2) ? strtoul(argv[2], NULL, 0) : 0x0f;
+    return io_set_leds_cfg(cfg);
+}
+
+static int cmd_buzzer(const struct shell *sh, size_t argc, char **argv)
+{
+    if (argc < 2)
+        return io_mgr_buzzer_trig();
+    if (strcmp(argv[1], "on") == 0)
+        return io_buzzer_on();
+    if (strcmp(argv[1], "off") == 0)
+        return io_buzzer_off();
+
+    shell_error(sh, "diag buzzer [on|off]");
+    return -EINVAL;
+}
+
+static int cmd_mqtt(const struct shell *sh, size_t argc, char **argv)
+{
+    struct comms_mgr_stats stats;
+    struct mqtt_client_connect_stats connect;
+    const char *topic;
+
+    comms_mgr_get_stats(&stats);
+    mqtt_client_get_connect_stats(&connect);
+
+    shell_print(sh, "wifi %s, mqtt %s, lost wifi %u mqtt %u", stats.wifi_up ? "up" : "down",
+                    stats.mqtt_up ? "up" : "down", stats.wifi_lost, stats.mqtt_lost);
+    shell_print(sh, "connects plain %u tls %u, last %u ms", connect.plain_count,
+                    connect.tls_count, connect.last_ms);
+    // everything is QoS 0, what's in flight is what's still queued here
+    shell_print(sh, "queued: comms cmds %u, relayed decisions %u, msys evts %u",
+                    stats.cmd_pending, stats.relay_pending, msys_evt_pending());
+    for (uint8_t i = 0; (topic = mqtt_client_get_sub(i)) != NULL; i++)
+        shell_print(sh, "sub %u %s", i, topic);
+    return 0;
+}
+
+static int cmd_bench(const struct shell *sh, size_t argc, char **argv)
+{
+    struct comms_mgr_bench_result result;
+    unsigned long count = (argc > 1) ? strtoul(argv[1], NULL, 0) : 10;
+    int ret;
+
+    count = CLAMP(count, 1, DIAG_BENCH_MAX_COUNT);
+    ret = comms_mgr_bench_broker(count, &result);
+    if (ret != 0)
+    {
+        shell_error(sh, "bench failed %d", ret);
+        return ret;
+    }
+
+    shell_print(sh, "broker round trip over %u: min %u avg %u max %u us, %u lost",
+                    result.count, result.min_us, result.avg_us, result.max_us, result.lost);
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(diag_cmds,
+    SHELL_CMD(state, NULL, "msys state and recent transitions", cmd_state),
+    SHELL_CMD_ARG(evt, NULL, "Signal a SYS_EVT_* to msys: evt <n>", cmd_evt, 2, 0),
+    SHELL_CMD_ARG(btn, NULL, "Simulate a gesture: btn <usr|red|blk> [press|hold2|hold5]",
+                    cmd_btn, 2, 1),
+    SHELL_CMD_ARG(led, NULL, "Set the LEDs: led <off|on|blink|alt> [pattern]", cmd_led, 2, 1),
+    SHELL_CMD_ARG(buzzer, NULL, "Buzzer beep, or buzzer <on|off>", cmd_buzzer, 1, 1),
+    SHELL_CMD(mqtt, NULL, "Link state, subscriptions and queued messages", cmd_mqtt),
+    SHELL_CMD_ARG(bench, NULL, "Broker round trip through the ping topic: bench [count]",
+                    cmd_bench, 1, 1),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(diag, &diag_cmds, "Referee box diagnostics", NULL);
+
+bool diag_shell_remote_allowed(const char *cmd, size_t len)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(remote_cmds); i++)
+    {
+        if (len == strlen(remote_cmds[i]) && memcmp(cmd, remote_cmds[i], len) == 0)
+            return true;
+    }
+    return false;
+}
+
+int diag_shell_exec(const char *cmd, const char **out, size_t *out_len)
+{
+#if defined(CONFIG_SHELL_BACKEND_DUMMY)
+    const struct shell *sh = shell_backend_dummy_get_ptr();
+    size_t len;
+    int ret;
+
+    // reading the output also clears it
+    shell_backend_dummy_get_output(sh, &len);
+    ret = shell_execute_cmd(sh, cmd);
+    *out = shell_backend_dummy_get_output(sh, out_len);
+    return ret;
+#else
+    return -ENOTSUP;
+#endif
+}
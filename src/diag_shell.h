@@ -0,0 +1,19 @@
+#ifndef DIAG_SHELL_H_
+#define DIAG_SHELL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+*   "diag" shell commands for poking a running box, on the UART shell and,
+*   with CONFIG_DIAG_SHELL_MQTT, the read only ones on
+*   owlcms/diag/<platform>/<ref>/shell with the output published on
+*   .../shell/out.
+*/
+
+// run one command line on the dummy backend, out stays valid until the next call
+int diag_shell_exec(const char *cmd, const char **out, size_t *out_len);
+// whether a diag subcommand line from MQTT may run, only the read only ones
+bool diag_shell_remote_allowed(const char *cmd, size_t len);
+
+#endif
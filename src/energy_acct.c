@@ -0,0 +1,232 @@
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(energy_acct, CONFIG_APP_LOG_LEVEL);
+
+#include <zephyr/zephyr.h>
+#include <stdio.h>
+
+#include "energy_acct.h"
+#include "fw_version.h"
+
+#define ENERGY_ACCT_REPORT_MAXLEN       448
+#define ENERGY_ACCT_NUM_LED_LEVELS      5
+#define MS_PER_HOUR                     3600000ULL
+
+// time spent at each level of something, levels are states, radio modes,
+// LEDs lit or buzzer off/on
+struct residency {
+    uint8_t curr;
+    int64_t entered;
+    uint64_t ms[ENERGY_ACCT_MAX_STATES];
+};
+
+static const uint32_t radio_mode_ua[ENERGY_ACCT_NUM_RADIO_MODES] = {
+    [ENERGY_ACCT_RADIO_PS_NONE]     = CONFIG_ENERGY_ACCT_RADIO_PS_NONE_UA,
+    [ENERGY_ACCT_RADIO_MIN_MODEM]   = CONFIG_ENERGY_ACCT_RADIO_MIN_MODEM_UA,
+    [ENERGY_ACCT_RADIO_MAX_MODEM]   = CONFIG_ENERGY_ACCT_RADIO_MAX_MODEM_UA
+};
+
+static const struct energy_acct_state *acct_states;
+static uint8_t num_states;
+static struct residency state_res;
+static struct residency radio_res;
+static struct residency leds_res;
+static struct residency buzzer_res;
+static struct k_spinlock acct_lock;
+
+static void (*report_cb)(const char *report, size_t len);
+
+static void report_due(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(report_work, report_due);
+
+static void residency_init(struct residency *res, uint8_t level)
+{
+    memset(res, 0, sizeof(*res));
+    res->curr = level;
+    res->entered = k_uptime_get();
+}
+
+static void residency_set(struct residency *res, uint8_t level)
+{
+    k_spinlock_key_t key = k_spin_lock(&acct_lock);
+    int64_t now = k_uptime_get();
+    res->ms[res->curr] += now - res->entered;
+    res->entered = now;
+    res->curr = level;
+    k_spin_unlock(&acct_lock, key);
+}
+
+static uint64_t residency_get(struct residency *res, uint8_t level)
+{
+    k_spinlock_key_t key = k_spin_lock(&acct_lock);
+    uint64_t ms = res->ms[level];
+    if (level == res->curr)
+        ms += k_uptime_get() - res->entered;
+    k_spin_unlock(&acct_lock, key);
+    return ms;
+}
+
+static void cpu_times(uint64_t *active_ms, uint64_t *idle_ms)
+{
+    uint64_t uptime_ms = k_uptime_get();
+
+    *idle_ms = 0;
+#if defined(CONFIG_SCHED_THREAD_USAGE_ALL)
+    k_thread_runtime_stats_t stats;
+    if (k_thread_runtime_stats_all_get(&stats) == 0)
+        *idle_ms = MIN(k_cyc_to_ms_floor64(stats.idle_cycles), uptime_ms);
+#endif
+    *active_ms = uptime_ms - *idle_ms;
+}
+
+static uint64_t led_on_ms()
+{
+    uint64_t ms = 0;
+    // one LED for a second counts as much as two for half a second
+    for (uint8_t lit = 1; lit < ENERGY_ACCT_NUM_LED_LEVELS; lit++)
+        ms += residency_get(&leds_res, lit) * lit;
+    return ms;
+}
+
+int energy_acct_init(const struct energy_acct_state *states, uint8_t count)
+{
+    if (count > ENERGY_ACCT_MAX_STATES)
+        return -EINVAL;
+
+    acct_states = states;
+    num_states = count;
+    residency_init(&state_res, 0);
+    // the driver's default until pwr_mgr sets one
+    residency_init(&radio_res, ENERGY_ACCT_RADIO_MIN_MODEM);
+    residency_init(&leds_res, 0);
+    residency_init(&buzzer_res, 0);
+
+    k_work_schedule(&report_work, K_SECONDS(CONFIG_ENERGY_ACCT_REPORT_INTERVAL_S));
+    return 0;
+}
+
+void energy_acct_set_state(uint8_t state)
+{
+    if (state < num_states)
+        residency_set(&state_res, state);
+}
+
+void energy_acct_set_radio_mode(uint8_t mode)
+{
+    if (mode < ENERGY_ACCT_NUM_RADIO_MODES)
+        residency_set(&radio_res, mode);
+}
+
+void energy_acct_set_leds_lit(uint8_t count)
+{
+    residency_set(&leds_res, MIN(count, ENERGY_ACCT_NUM_LED_LEVELS - 1));
+}
+
+void energy_acct_set_buzzer(bool on)
+{
+    residency_set(&buzzer_res, on ? 1 : 0);
+}
+
+uint32_t energy_acct_residency_ms(uint8_t state)
+{
+    if (state >= num_states)
+        return 0;
+    return (uint32_t)residency_get(&state_res, state);
+}
+
+uint32_t energy_acct_battery_hours_x10()
+{
+    uint64_t total_ms = 0;
+    uint64_t charge = 0;
+
+    // charge in mA ms, the average draw is charge / total time
+    for (uint8_t i = 0; i < num_states; i++)
+    {
+        uint32_t ms = energy_acct_residency_ms(i);
+        total_ms += ms;
+        charge += (uint64_t)ms * acct_states[i].current_ma;
+    }
+
+    if (charge == 0)
+        return 0;
+    return (uint32_t)((uint64_t)CONFIG_ENERGY_ACCT_BATTERY_MAH * 10 * total_ms / charge);
+}
+
+uint32_t energy_acct_consumed_uah()
+{
+    uint64_t active_ms, idle_ms;
+    // charge in uA ms
+    uint64_t charge = 0;
+
+    cpu_times(&active_ms, &idle_ms);
+    charge += active_ms * CONFIG_ENERGY_ACCT_CPU_ACTIVE_UA;
+    charge += idle_ms * CONFIG_ENERGY_ACCT_CPU_IDLE_UA;
+    for (uint8_t i = 0; i < ENERGY_ACCT_NUM_RADIO_MODES; i++)
+        charge += residency_get(&radio_res, i) * radio_mode_ua[i];
+    charge += led_on_ms() * CONFIG_ENERGY_ACCT_LED_UA;
+    charge += residency_get(&buzzer_res, 1) * CONFIG_ENERGY_ACCT_BUZZER_UA;
+
+    return (uint32_t)(charge / MS_PER_HOUR);
+}
+
+int energy_acct_format_report(char *buf, size_t len)
+{
+    uint64_t active_ms, idle_ms;
+    uint32_t hours_x10 = energy_acct_battery_hours_x10();
+    int pos;
+
+    cpu_times(&active_ms, &idle_ms);
+    pos = snprintf(buf, len, "{\"fw\":\"%d.%d.%d\",\"up_s\":%u,\"uah\":%u,\"est_h\":%u.%u,"
+                    "\"cpu_active_ms\":%u,\"cpu_idle_ms\":%u,\"radio_ms\":[%u,%u,%u],"
+                    "\"led_ms\":%u,\"buzzer_ms\":%u,\"state_ms\":[",
+                    FW_VERSION_MAJOR, FW_VERSION_MINOR, FW_VERSION_PATCH,
+                    (uint32_t)(k_uptime_get() / 1000), energy_acct_consumed_uah(),
+                    hours_x10 / 10, hours_x10 % 10, (uint32_t)active_ms, (uint32_t)idle_ms,
+                    (uint32_t)residency_get(&radio_res, ENERGY_ACCT_RADIO_PS_NONE),
+                    (uint32_t)residency_get(&radio_res, ENERGY_ACCT_RADIO_MIN_MODEM),
+                    (uint32_t)residency_get(&radio_res, ENERGY_ACCT_RADIO_MAX_MODEM),
+                    (uint32_t)led_on_ms(), (uint32_t)residency_get(&buzzer_res, 1));
+
+    for (uint8_t i = 0; i < num_states && pos < len; i++)
+        pos += snprintf(buf + pos, len - pos, i == 0 ? "%u" : ",%u", energy_acct_residency_ms(i));
+    if (pos < len)
+        pos += snprintf(buf + pos, len - pos, "]}");
+
+    return MIN(pos, (int)len - 1);
+}
+
+void energy_acct_log_report()
+{
+    uint32_t uptime_ms = (uint32_t)k_uptime_get();
+
+    for (uint8_t i = 0; i < num_states; i++)
+    {
+        uint32_t ms = energy_acct_residency_ms(i);
+        if (ms == 0 || acct_states[i].current_ma == 0)
+            continue;
+        LOG_INF("%-14s %3u%% at an estimated %3u mA, %u h if it stayed there", acct_states[i].name,
+                    (uint32_t)((uint64_t)ms * 100 / MAX(uptime_ms, 1)), acct_states[i].current_ma,
+                    CONFIG_ENERGY_ACCT_BATTERY_MAH / acct_states[i].current_ma);
+    }
+
+    uint32_t hours_x10 = energy_acct_battery_hours_x10();
+    LOG_INF("estimated %u.%u h on a %u mAh battery at this mix, an estimated %u uAh used so far",
+                hours_x10 / 10, hours_x10 % 10, CONFIG_ENERGY_ACCT_BATTERY_MAH,
+                energy_acct_consumed_uah());
+}
+
+void energy_acct_set_report_cb(void (*cb)(const char *report, size_t len))
+{
+    report_cb = cb;
+}
+
+static void report_due(struct k_work *work)
+{
+    static char report[ENERGY_ACCT_REPORT_MAXLEN];
+
+    energy_acct_log_report();
+    if (report_cb != NULL)
+        report_cb(report, energy_acct_format_report(report, sizeof(report)));
+
+    k_work_schedule(&report_work, K_SECONDS(CONFIG_ENERGY_ACCT_REPORT_INTERVAL_S));
+}
@@ -0,0 +1,51 @@
+#ifndef ENERGY_ACCT_H_
+#define ENERGY_ACCT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+*   Battery use accounting. Residency is measured for the msys states, the
+*   WiFi power save level, CPU running vs idle, and LED and buzzer on-time.
+*   Two estimates come out of it: battery hours from each state's estimated
+*   draw (msys), and mAh consumed from the per-component currents in
+*   Kconfig (CONFIG_ENERGY_ACCT_*).
+*/
+
+#ifndef ENERGY_ACCT_MAX_STATES
+#define ENERGY_ACCT_MAX_STATES          12
+#endif
+
+// matches WIFI_CONN_PS_*
+#define ENERGY_ACCT_RADIO_PS_NONE       0
+#define ENERGY_ACCT_RADIO_MIN_MODEM     1
+#define ENERGY_ACCT_RADIO_MAX_MODEM     2
+#define ENERGY_ACCT_NUM_RADIO_MODES     3
+
+struct energy_acct_state {
+    const char *name;
+    // estimated average draw in the state, not a measurement
+    uint16_t current_ma;
+};
+
+int energy_acct_init(const struct energy_acct_state *states, uint8_t count);
+void energy_acct_set_state(uint8_t state);
+void energy_acct_set_radio_mode(uint8_t mode);
+void energy_acct_set_leds_lit(uint8_t count);
+void energy_acct_set_buzzer(bool on);
+
+// time in a state so far, the current stay included
+uint32_t energy_acct_residency_ms(uint8_t state);
+// battery hours at the residency-weighted average draw, tenths of an hour
+uint32_t energy_acct_battery_hours_x10();
+// component model, uAh so far
+uint32_t energy_acct_consumed_uah();
+
+// one line of JSON, returns the length
+int energy_acct_format_report(char *buf, size_t len);
+void energy_acct_log_report();
+// called with each periodic report
+void energy_acct_set_report_cb(void (*cb)(const char *report, size_t len));
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef FW_VERSION_H_
+#define FW_VERSION_H_
+
+#define FW_VERSION_MAJOR        0
+#define FW_VERSION_MINOR        2
+#define FW_VERSION_PATCH        0
+
+#endif
@@ -0,0 +1,250 @@
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(health_mon, CONFIG_APP_LOG_LEVEL);
+
+#include <zephyr/zephyr.h>
+#include <zephyr/drivers/hwinfo.h>
+#include <zephyr/sys/sys_heap.h>
+#include <stdio.h>
+
+#if defined(CONFIG_SOC_ESP32)
+#include <esp_rom_sys.h>
+#endif
+
+#include "health_mon.h"
+#include "msys.h"
+#include "comms_mgr.h"
+#include "wifi_conn.h"
+#include "perf_budget.h"
+
+#define HEALTH_MON_REPORT_MAXLEN        288
+
+// the fields that trigger a report on change
+struct health_critical {
+    uint8_t links;
+    uint32_t overflows;
+    bool stack_low;
+    bool heap_low;
+};
+
+static uint32_t reset_cause;
+static uint32_t latency[HEALTH_MON_LATENCY_SAMPLES];
+static uint32_t latency_count;
+static struct k_spinlock latency_lock;
+static struct health_critical last_reported;
+static int (*report_cb)(const char *report, size_t len);
+
+static size_t min_headroom;
+static const char *min_headroom_thread;
+
+static void report_due(struct k_work *work);
+static void check_due(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(report_work, report_due);
+static K_WORK_DELAYABLE_DEFINE(check_work, check_due);
+
+#if defined(CONFIG_SYS_HEAP_RUNTIME_STATS)
+extern struct k_heap _system_heap;
+#endif
+
+static void heap_stats(uint32_t *free, uint32_t *min_free)
+{
+    *free = 0;
+    *min_free = 0;
+#if defined(CONFIG_SYS_HEAP_RUNTIME_STATS)
+    struct sys_memory_stats stats;
+
+    if (sys_heap_runtime_stats_get(&_system_heap.heap, &stats) == 0)
+    {
+        *free = stats.free_bytes;
+        *min_free = stats.free_bytes + stats.allocated_bytes - stats.max_allocated_bytes;
+    }
+#endif
+}
+
+static void stack_headroom_cb(const struct k_thread *thread, void *user_data)
+{
+#if defined(CONFIG_THREAD_STACK_INFO) && defined(CONFIG_INIT_STACKS)
+    size_t unused;
+
+    if (k_thread_stack_space_get(thread, &unused) != 0)
+        return;
+    if (unused < min_headroom)
+    {
+        min_headroom = unused;
+        min_headroom_thread = k_thread_name_get((k_tid_t)thread);
+    }
+#endif
+}
+
+// walks every thread stack, so only on reports and checks
+static void stack_stats()
+{
+    min_headroom = SIZE_MAX;
+    min_headroom_thread = NULL;
+    k_thread_foreach_unlocked(stack_headroom_cb, NULL);
+    if (min_headroom == SIZE_MAX)
+        min_headroom = 0;
+}
+
+static void get_critical(struct health_critical *crit)
+{
+    struct comms_mgr_stats comms;
+    uint32_t heap_free, heap_min;
+
+    comms_mgr_get_stats(&comms);
+    heap_stats(&heap_free, &heap_min);
+    stack_stats();
+
+    // compared with memcmp, padding included
+    memset(crit, 0, sizeof(*crit));
+    crit->links = (comms.wifi_up ? BIT(0) : 0) | (comms.mqtt_up ? BIT(1) : 0);
+    crit->overflows = comms.cmd_overflows + msys_evt_overflows();
+    crit->stack_low = min_headroom > 0 && min_headroom < CONFIG_HEALTH_MON_STACK_LOW_BYTES;
+    crit->heap_low = heap_free > 0 && heap_min < CONFIG_HEALTH_MON_HEAP_LOW_BYTES;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+int health_mon_format_report(char *buf, size_t len)
+{
+    static uint32_t sorted[HEALTH_MON_LATENCY_SAMPLES];
+    struct comms_mgr_stats comms;
+    struct wifi_conn_roam_stats roam;
+    struct health_critical crit;
+    uint32_t heap_free, heap_min;
+    uint32_t count, n;
+    int8_t rssi = 0;
+    uint8_t channel = 0;
+
+    get_critical(&crit);
+    comms_mgr_get_stats(&comms);
+    wifi_conn_get_roam_stats(&roam);
+    wifi_conn_get_signal(&rssi, &channel);
+    heap_stats(&heap_free, &heap_min);
+
+    k_spinlock_key_t key = k_spin_lock(&latency_lock);
+    count = latency_count;
+    n = MIN(count, HEALTH_MON_LATENCY_SAMPLES);
+    memcpy(sorted, latency, n * sizeof(latency[0]));
+    k_spin_unlock(&latency_lock, key);
+    qsort(sorted, n, sizeof(sorted[0]), cmp_u32);
+
+    return MIN(snprintf(buf, len, "{\"up\":%u,\"rst\":%u,\"hf\":%u,\"hm\":%u,\"sk\":%u,\"skt\":\"%s\","
+                    "\"rssi\":%d,\"ch\":%u,\"rc\":[%u,%u,%u],\"st\":%u,\"qo\":[%u,%u],"
+                    "\"dl\":[%u,%u,%u,%u,%u],\"pb\":[%u,%u,%u],\"lk\":%u}",
+                    (uint32_t)(k_uptime_get() / 1000), reset_cause, heap_free, heap_min,
+                    (uint32_t)min_headroom,
+                    (min_headroom_thread != NULL) ? min_headroom_thread : "",
+                    rssi, channel, comms.wifi_lost, comms.mqtt_lost, roam.roams,
+                    msys_get_state(), msys_evt_overflows(), comms.cmd_overflows, count,
+                    n ? sorted[n * 50 / 100] : 0, n ? sorted[n * 90 / 100] : 0,
+                    n ? sorted[n * 99 / 100] : 0, n ? sorted[n - 1] : 0,
+                    perf_budget_overruns(PERF_BUDGET_DECISION), perf_budget_overruns(PERF_BUDGET_MSYS_STEP),
+                    perf_budget_overruns(PERF_BUDGET_DECISION_HEAP), crit.links),
+                (int)len - 1);
+}
+
+static void publish(const struct health_critical *crit)
+{
+    static char report[HEALTH_MON_REPORT_MAXLEN];
+
+    if (report_cb == NULL)
+        return;
+    if (report_cb(report, health_mon_format_report(report, sizeof(report))) == 0)
+        last_reported = *crit;
+}
+
+static void report_due(struct k_work *work)
+{
+    struct health_critical crit;
+
+    get_critical(&crit);
+    publish(&crit);
+    k_work_schedule(&report_work, K_SECONDS(CONFIG_HEALTH_MON_REPORT_INTERVAL_S));
+}
+
+static void check_due(struct k_work *work)
+{
+    struct health_critical crit;
+
+    get_critical(&crit);
+    if (memcmp(&crit, &last_reported, sizeof(crit)) != 0)
+    {
+        LOG_DBG("critical health change, links %x overflows %u", crit.links, crit.overflows);
+        publish(&crit);
+    }
+}
+
+void health_mon_notify()
+{
+    k_work_reschedule(&check_work, K_MSEC(HEALTH_MON_CHANGE_HOLDOFF_MS));
+}
+
+void health_mon_record_decision_us(uint32_t us)
+{
+    k_spinlock_key_t key = k_spin_lock(&latency_lock);
+    latency[latency_count % HEALTH_MON_LATENCY_SAMPLES] = us;
+    latency_count++;
+    k_spin_unlock(&latency_lock, key);
+}
+
+void health_mon_set_report_cb(int (*cb)(const char *report, size_t len))
+{
+    report_cb = cb;
+}
+
+#if defined(CONFIG_SOC_ESP32)
+// the ESP32 hwinfo driver has no reset cause, the ROM's is mapped to the
+// same RESET_* bits so reports read the same on every board
+static uint32_t read_reset_cause()
+{
+    switch (esp_rom_get_reset_reason(0))
+    {
+    case RESET_REASON_CHIP_POWER_ON:
+        return RESET_POR;
+    case RESET_REASON_CORE_SW:
+    case RESET_REASON_CPU0_SW:
+        return RESET_SOFTWARE;
+    case RESET_REASON_CORE_DEEP_SLEEP:
+        return RESET_LOW_POWER_WAKE;
+    case RESET_REASON_CORE_MWDT0:
+    case RESET_REASON_CORE_MWDT1:
+    case RESET_REASON_CORE_RTC_WDT:
+    case RESET_REASON_CPU0_MWDT0:
+    case RESET_REASON_CPU0_RTC_WDT:
+    case RESET_REASON_SYS_RTC_WDT:
+        return RESET_WATCHDOG;
+    case RESET_REASON_SYS_BROWN_OUT:
+        return RESET_BROWNOUT;
+    default:
+        return 0;
+    }
+}
+#else
+// read once and cleared, so the next boot reports only its own cause
+static uint32_t read_reset_cause()
+{
+    uint32_t cause = 0;
+
+    if (hwinfo_get_reset_cause(&cause) != 0)
+        return 0;
+    hwinfo_clear_reset_cause();
+    return cause;
+}
+#endif
+
+int health_mon_init()
+{
+    reset_cause = read_reset_cause();
+
+    memset(&last_reported, 0, sizeof(last_reported));
+    LOG_INF("reset cause %x", reset_cause);
+    k_work_schedule(&report_work, K_SECONDS(CONFIG_HEALTH_MON_REPORT_INTERVAL_S));
+    return 0;
+}
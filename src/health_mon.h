@@ -0,0 +1,33 @@
+#ifndef HEALTH_MON_H_
+#define HEALTH_MON_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+*   Box health, reported every CONFIG_HEALTH_MON_REPORT_INTERVAL_S and again
+*   shortly after a critical field changes (link up/down, a queue overflow,
+*   stack or heap running low). Reports are compact JSON with short keys:
+*
+*   up      uptime s            rst     reset cause bits (hwinfo), 0 unknown
+*   hf, hm  heap free, min free sk, skt stack headroom of the tightest thread
+*   rssi,ch wifi signal         rc      [wifi lost, mqtt lost, roams]
+*   st      msys state          qo      [msys evt, comms cmd] queue overflows
+*   dl      decision path us [count, p50, p90, p99, max]
+*   pb      perf budget overruns [decision, msys step, decision heap]
+*   lk      links, bit 0 wifi, bit 1 mqtt
+*/
+
+#define HEALTH_MON_LATENCY_SAMPLES      64
+// critical changes within this window go out as one report
+#define HEALTH_MON_CHANGE_HOLDOFF_MS    500
+
+int health_mon_init();
+// a critical field may have changed, cheap enough for any thread
+void health_mon_notify();
+void health_mon_record_decision_us(uint32_t us);
+int health_mon_format_report(char *buf, size_t len);
+// a non zero return leaves the change pending for the next check
+void health_mon_set_report_cb(int (*cb)(const char *report, size_t len));
+
+#endif
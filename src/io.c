@@ -1,12 +1,14 @@
 #include <zephyr/logging/log.h>
 
-LOG_MODULE_REGISTER(io_mod, LOG_LEVEL_DBG);
+LOG_MODULE_REGISTER(io_mod, CONFIG_APP_LOG_LEVEL);
 
 #include <zephyr/zephyr.h>
 #include <zephyr/device.h>
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/drivers/pwm.h>
 #include "io.h"
+#include "energy_acct.h"
+#include "journal.h"
 
 
 
@@ -54,7 +56,13 @@ static const struct gpio_dt_spec sw_id[] = {  GPIO_DT_SPEC_GET(SW_ID0, gpios),
                                             GPIO_DT_SPEC_GET(SW_ID1, gpios),
                                             GPIO_DT_SPEC_GET(SW_ID2, gpios)};
 
+// boards without PWM (native_posix) drive the buzzer as a plain GPIO
+#if DT_NODE_HAS_PROP(BZR_0, pwms)
+#define BZR_PWM
 static const struct pwm_dt_spec buzzer = PWM_DT_SPEC_GET(BZR_0);
+#else
+static const struct gpio_dt_spec buzzer = GPIO_DT_SPEC_GET(BZR_0, gpios);
+#endif
 
 
 #define BTN_USR_ID              0
@@ -73,6 +81,10 @@ static const struct pwm_dt_spec buzzer = PWM_DT_SPEC_GET(BZR_0);
 
 #define BTN_DEBOUNCE_TIME_MS    10
 #define BTN_EVT_TICK_PERIOD_MS  5
+// a press has to hold across at least two ticks to count
+BUILD_ASSERT(BTN_DEBOUNCE_TIME_MS >= 2 * BTN_EVT_TICK_PERIOD_MS, "debounce shorter than two ticks");
+
+#define LED_BLINK_PERIOD_MS     500
 
 #define BZR_PERIOD_NS           1000000U // 1kHz
 #define BZR_PULSE_WIDTH_NS      BZR_PERIOD_NS / 2U
@@ -94,6 +106,9 @@ void (*btn_blk_cb)(uint8_t evt_type);
 struct k_thread btn_evt_th;
 K_THREAD_STACK_DEFINE(btn_evt_thread_stack, 1024);
 static struct k_mutex btn_state_data_mutex;
+// given on every button edge, the btn thread only ticks while a button is
+// debouncing or held
+static K_SEM_DEFINE(btn_evt_sem, 0, 1);
 void (*btn_evt_cb)(uint8_t btn_id, uint8_t btn_evt);
 
 struct k_thread led_mgmt_th;
@@ -102,6 +117,9 @@ K_THREAD_STACK_DEFINE(led_mgmt_thread_stack, 1024);
 //static struct k_mutex leds_cfg_lock;
 //static struct k_mutex buzzer_cfg_lock;
 static struct k_msgq leds_cfg_queue;
+// what's lit, for LED on-time accounting
+static uint8_t leds_lit_bits;
+static bool buzzer_on;
 static char __aligned(2) leds_cfg_msg_buf[5 * sizeof(leds_cfg_t)];
 
 int io_led_bits_set(uint8_t led_bits);
@@ -115,15 +133,19 @@ void led_mgmt_thread();
 int init_btns();
 int init_leds();
 int init_dev_id_sw();
+int init_buzzer();
 
 void btn_evt_thread(void *unused, void *unused1, void *unused2)
 {
     uint64_t curr_time_ticks = 0;
+    bool btns_active;
     LOG_INF("entering btn evt thread");
     while (1)
     {
+        btns_active = true;
         if (k_mutex_lock(&btn_state_data_mutex, K_MSEC(100)) == 0)
         {
+            btns_active = false;
             curr_time_ticks = k_uptime_get();
             for (uint8_t i = 0; i < NUM_BTNS; i++)
             {
@@ -148,6 +170,11 @@ void btn_evt_thread(void *unused, void *unused1, void *unused2)
                             btn_state_data[i].evt_start = curr_time_ticks;
                             btn_evt_cb(btn_state_data[i].btn_id, BTN_EVT_RELEASED);
                         }
+                        else
+                        {
+                            // back where it was before the edge, a glitch
+                            btn_state_data[i].debounce_evt = BTN_DEBOUNCE_NONE;
+                        }
                     }
                 }
                 else {
@@ -162,13 +189,18 @@ void btn_evt_thread(void *unused, void *unused1, void *unused2)
                         }
                     }
                 }
+
+                if ((btn_state_data[i].debounce_evt != BTN_DEBOUNCE_NONE)
+                        || (btn_state_data[i].debounced_state == BTN_STATE_DOWN))
+                    btns_active = true;
             }
             k_mutex_unlock(&btn_state_data_mutex);
         }
         //LOG_INF("tick");
-        //k_yield();
-        //k_sleep(K_MSEC(BTN_EVT_TICK_PERIOD_MS));
-        k_msleep(BTN_EVT_TICK_PERIOD_MS);
+        if (btns_active)
+            k_msleep(BTN_EVT_TICK_PERIOD_MS);
+        else
+            k_sem_take(&btn_evt_sem, K_FOREVER);
     }
 }
 
@@ -195,14 +227,18 @@ void iterate_led_cfg(leds_cfg_t cfg)
 void led_mgmt_thread()
 {
     int ret = 0;
-    leds_cfg_t leds_cfg;
+    leds_cfg_t leds_cfg = {
+        .cfg_type = LED_CFG_TYPE_DISABLE,
+        .pattern = 0x00
+    };
     static uint8_t leds_curr_state = 0;
+    k_timeout_t timeout = K_FOREVER;
 
     LOG_DBG("Entering LED mgmt thread");
 
     while(1)
     {
-        ret = k_msgq_get(&leds_cfg_queue, &leds_cfg, K_NO_WAIT);
+        ret = k_msgq_get(&leds_cfg_queue, &leds_cfg, timeout);
         if (ret == 0)
         {
             // clear all LEDs so they're off
@@ -213,19 +249,22 @@ void led_mgmt_thread()
         {
             // if we haven't changed the LEDs config, keep doing the same thing
             iterate_led_cfg(leds_cfg);
-            
-            
-            
         }
-        //LOG_DBG("tick");
-        k_msleep(500);
+
+        // only blinking needs a tick, anything else waits for the next config
+        if ((leds_cfg.cfg_type == LED_CFG_TYPE_BLINK_STATIC)
+                || (leds_cfg.cfg_type == LED_CFG_TYPE_BLINK_ALT))
+            timeout = K_MSEC(LED_BLINK_PERIOD_MS);
+        else
+            timeout = K_FOREVER;
     }
 }
 
 void io_btn_cb(uint8_t btn_id, uint8_t evt_type)
 {
     LOG_DBG("btn: %d, evt: %d", btn_id, evt_type);
-     
+    journal_record(JOURNAL_EVT_BUTTON, btn_id, evt_type);
+
     if (btn_evt_handlers[btn_id] != NULL)
     {
         btn_evt_handlers[btn_id](evt_type); 
@@ -261,12 +300,14 @@ void io_btn_handler(const struct device *dev, struct gpio_callback *cb,
         }
     }
     k_mutex_unlock(&btn_state_data_mutex);
+    k_sem_give(&btn_evt_sem);
 }
 
 int init_btns()
 {
     int ret = 0;
     btn_evt_cb = io_btn_cb;
+    k_mutex_init(&btn_state_data_mutex);
     
     for (uint8_t i = 0; i < NUM_BTNS; i++)
     {
@@ -299,16 +340,14 @@ int init_btns()
         btn_state_data[i].debounce_evt = 0;
         btn_state_data[i].evt_start = 0;
         btn_state_data[i].debounced_state = gpio_pin_get_dt(&btns[i]);
-
-        k_mutex_init(&btn_state_data_mutex);
-
-        k_thread_create(&btn_evt_th, btn_evt_thread_stack,
-                        K_THREAD_STACK_SIZEOF(btn_evt_thread_stack),
-                        btn_evt_thread,
-                        NULL, NULL, NULL,
-                        6, 0, K_NO_WAIT);
     }
 
+    k_thread_create(&btn_evt_th, btn_evt_thread_stack,
+                    K_THREAD_STACK_SIZEOF(btn_evt_thread_stack),
+                    btn_evt_thread,
+                    NULL, NULL, NULL,
+                    6, 0, K_NO_WAIT);
+
     return ret;
 }
 
@@ -361,7 +400,7 @@ int init_dev_id_sw()
             return EIO;
         }
 
-        ret = gpio_pin_configure_dt(&btns[i], GPIO_INPUT);
+        ret = gpio_pin_configure_dt(&sw_id[i], GPIO_INPUT);
         if (ret != 0)
         {
             LOG_ERR("Failed to configure IO pin for id switch %d, ret %d", i, ret);
@@ -371,17 +410,34 @@ int init_dev_id_sw()
     return ret;
 }
 
+static int buzzer_set(bool on)
+{
+#if defined(BZR_PWM)
+    return pwm_set_dt(&buzzer, BZR_PERIOD_NS, on ? BZR_PULSE_WIDTH_NS : 0);
+#else
+    return gpio_pin_set_dt(&buzzer, on);
+#endif
+}
+
 int init_buzzer()
 {
     int ret = 0;
+#if defined(BZR_PWM)
     if (!device_is_ready(buzzer.dev))
+#else
+    if (!device_is_ready(buzzer.port))
+#endif
     {
         LOG_ERR("Failed to initialise PWM device for buzzer");
         return EIO;
     }
 
     // make sure the buzzer is definitely off for good measure...
+#if defined(BZR_PWM)
     ret = pwm_set_dt(&buzzer, 0, 0);
+#else
+    ret = gpio_pin_configure_dt(&buzzer, GPIO_OUTPUT_INACTIVE);
+#endif
     if (ret != 0)
     {
         LOG_ERR("Failed to set initial buzzer PWM config");
@@ -398,6 +454,7 @@ int io_init()
     init_leds();
     init_btns();
     init_dev_id_sw();
+    init_buzzer();
     LOG_INF("Finishing init\n");
     return 0;
 }
@@ -409,12 +466,22 @@ int io_set_leds_cfg(leds_cfg_t cfg)
     return ret;
 }
 
+static void leds_lit_update(uint8_t led_bits)
+{
+    if (led_bits != leds_lit_bits)
+    {
+        leds_lit_bits = led_bits;
+        energy_acct_set_leds_lit(__builtin_popcount(led_bits));
+    }
+}
+
 int io_set_led(uint8_t led)
 {
     int ret = 0;
     if (led <= NUM_LEDS-1)
     {
         ret = gpio_pin_set_dt(&(*leds[led]), 1);
+        leds_lit_update(leds_lit_bits | BIT(led));
         return ret;
     }
     else
@@ -427,6 +494,7 @@ int io_clr_led(uint8_t led)
     if (led < NUM_LEDS)
     {
         ret = gpio_pin_set_dt(&(*leds[led]), 0);
+        leds_lit_update(leds_lit_bits & ~BIT(led));
         return ret;
     }
     else
@@ -439,6 +507,7 @@ int io_led_bits_set(uint8_t led_bits)
     {
         gpio_pin_set_dt(&(*leds[i]), (led_bits & (1 << i)));
     }
+    leds_lit_update(led_bits & BIT_MASK(NUM_LEDS));
     return 0;
 }
 
@@ -450,6 +519,7 @@ int io_led_bits_toggle(uint8_t led_bits)
         if (led_bits & (1 << i))
             gpio_pin_toggle_dt(&(*leds[i]));
     }
+    leds_lit_update(leds_lit_bits ^ (led_bits & BIT_MASK(NUM_LEDS)));
     return 0;
 }
 
@@ -459,6 +529,7 @@ int io_led_bits_toggle_all()
     {
         gpio_pin_toggle_dt(&(*leds[i]));
     }
+    leds_lit_update(leds_lit_bits ^ BIT_MASK(NUM_LEDS));
     return 0;
 }
 
@@ -498,11 +569,16 @@ int io_buzzer_on()
 {
     int ret = 0;
     LOG_DBG("turning buzzer on");
-    ret = pwm_set_dt(&buzzer, BZR_PERIOD_NS, BZR_PULSE_WIDTH_NS);
+    ret = buzzer_set(true);
     if (ret != 0)
     {
         LOG_ERR("Failed to turn buzzer on, ret: %d", ret);
     }
+    else
+    {
+        buzzer_on = true;
+        energy_acct_set_buzzer(true);
+    }
     return ret;
 }
 
@@ -510,10 +586,20 @@ int io_buzzer_off()
 {
     int ret = 0;
     LOG_DBG("turning buzzer off");
-    ret = pwm_set_dt(&buzzer, BZR_PERIOD_NS, 0);
+    ret = buzzer_set(false);
     if (ret != 0)
     {
         LOG_ERR("Failed to turn buzzer off, ret: %d", ret);
     }
+    else
+    {
+        buzzer_on = false;
+        energy_acct_set_buzzer(false);
+    }
     return ret;
+}
+
+bool io_buzzer_is_on()
+{
+    return buzzer_on;
 }
\ No newline at end of file
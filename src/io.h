@@ -2,6 +2,7 @@
 #define IO_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 
 
 #define BTN_EVT_PRESSED             0
@@ -44,6 +45,7 @@ int io_clr_led(uint8_t led);
 
 int io_buzzer_on();
 int io_buzzer_off();
+bool io_buzzer_is_on();
 
 void io_reg_cb_btn_usr(void (*cb)(uint8_t));
 void io_reg_cb_btn_red(void (*cb)(uint8_t));
@@ -51,6 +53,9 @@ void io_reg_cb_btn_blk(void (*cb)(uint8_t));
 
 int io_get_red_btn_state();
 
+// dispatch a button event as if the button thread had seen it
+void io_btn_cb(uint8_t btn_id, uint8_t evt_type);
+
 int io_get_dev_id();
 
 void btn_evt_thread(void *unused, void *unused1, void *unused2);
@@ -1,12 +1,13 @@
 #include <logging/log.h>
 
-LOG_MODULE_REGISTER(io_mgr, LOG_LEVEL_DBG);
+LOG_MODULE_REGISTER(io_mgr, CONFIG_APP_LOG_LEVEL);
 
 #include <zephyr.h>
 
 #include "io_mgr.h"
 #include "io.h"
 #include "msys.h"
+#include "bat_mon.h"
 
 #define BUZZER_ON_PERIOD_MS            1000
 
@@ -57,6 +58,7 @@ int io_mgr_init()
 
     k_work_init_delayable(&leds_disable_work, leds_disable_work_fn);
     k_work_init_delayable(&buzzer_off_work, buzzer_off_work_fn);
+    return 0;
 }
 
 int io_mgr_set_leds_config()
@@ -71,15 +73,13 @@ int io_mgr_set_leds_connecting()
 
 int io_mgr_set_leds_bat_level()
 {
-    // read from adc
-    // convert adc to 4-step level
-    // display level using LEDs on/off pattern
     leds_cfg_t cfg = leds_cfg_bat_level;
-    cfg.pattern = 0x0F;
+    cfg.pattern = bat_mon_get_led_bits();
     io_set_leds_cfg(cfg);
 
     // set timeout cb to trigger LEDs to turn off after a short time
     k_work_reschedule(&leds_disable_work, K_MSEC(2000));
+    return 0;
 }
 
 int io_mgr_set_leds_disable()
@@ -89,9 +89,10 @@ int io_mgr_set_leds_disable()
 
 int io_mgr_buzzer_trig()
 {
-    io_buzzer_on();
+    int ret = io_buzzer_on();
 
     k_work_reschedule(&buzzer_off_work, K_MSEC(BUZZER_ON_PERIOD_MS));
+    return ret;
 }
 
 void btn_usr_handler(uint8_t evt_type)
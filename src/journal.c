@@ -0,0 +1,272 @@
+#include <logging/log.h>
+
+LOG_MODULE_REGISTER(journal, CONFIG_APP_LOG_LEVEL);
+
+#include <zephyr/zephyr.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/fs/fcb.h>
+#include <zephyr/fatal.h>
+#include <zephyr/sys/reboot.h>
+
+#include "journal.h"
+
+#define JOURNAL_NODE_LABEL      journal
+#define JOURNAL_MAX_SECTORS     32
+#define JOURNAL_FCB_MAGIC       0x4a524e4c
+#define JOURNAL_FCB_VERSION     1
+
+static struct fcb fcb;
+static struct flash_sector sectors[JOURNAL_MAX_SECTORS];
+static bool mounted;
+// flushes from the workqueue and reads from the comms thread
+static struct k_mutex flash_lock;
+// set while an element is being appended, the FCB is mid write
+static atomic_t appending;
+
+static struct journal_entry buf[JOURNAL_BUF_ENTRIES];
+static struct journal_entry flush_buf[JOURNAL_BUF_ENTRIES];
+static uint8_t buf_count;
+static uint32_t next_seq;
+static uint32_t dropped;
+static struct k_spinlock buf_lock;
+
+static void flush_work_fn(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(flush_work, flush_work_fn);
+
+void journal_record(uint8_t type, uint8_t arg, int16_t val)
+{
+    k_spinlock_key_t key = k_spin_lock(&buf_lock);
+    uint8_t count;
+
+    if (buf_count >= JOURNAL_BUF_ENTRIES)
+    {
+        // the sequence gap shows up in the dump
+        next_seq++;
+        dropped++;
+        k_spin_unlock(&buf_lock, key);
+        return;
+    }
+
+    buf[buf_count].seq = next_seq++;
+    buf[buf_count].time_ms = k_uptime_get_32();
+    buf[buf_count].type = type;
+    buf[buf_count].arg = arg;
+    buf[buf_count].val = val;
+    count = ++buf_count;
+    k_spin_unlock(&buf_lock, key);
+
+    if (count >= JOURNAL_BUF_ENTRIES * 3 / 4)
+        k_work_reschedule(&flush_work, K_NO_WAIT);
+    else if (type == JOURNAL_EVT_DECISION && (!k_work_delayable_is_pending(&flush_work)
+            || k_work_delayable_remaining_get(&flush_work) > k_ms_to_ticks_ceil32(JOURNAL_DECISION_FLUSH_MS)))
+        k_work_reschedule(&flush_work, K_MSEC(JOURNAL_DECISION_FLUSH_MS));
+    else if (count == 1)
+        k_work_schedule(&flush_work, K_MSEC(JOURNAL_FLUSH_MS));
+}
+
+static int append(const void *data, size_t len)
+{
+    struct fcb_entry loc;
+    int ret;
+
+    atomic_set(&appending, 1);
+    ret = fcb_append(&fcb, len, &loc);
+    if (ret == -ENOSPC)
+    {
+        // full, the oldest sector goes
+        ret = fcb_rotate(&fcb);
+        if (ret == 0)
+            ret = fcb_append(&fcb, len, &loc);
+    }
+    if (ret == 0)
+        ret = flash_area_write(fcb.fap, FCB_ENTRY_FA_DATA_OFF(loc), data, len);
+    if (ret == 0)
+        ret = fcb_append_finish(&fcb, &loc);
+
+    atomic_set(&appending, 0);
+    return ret;
+}
+
+int journal_flush()
+{
+    uint8_t count;
+    int ret;
+
+    if (!mounted)
+        return -ENODEV;
+
+    k_mutex_lock(&flash_lock, K_FOREVER);
+    k_spinlock_key_t key = k_spin_lock(&buf_lock);
+    count = buf_count;
+    memcpy(flush_buf, buf, count * sizeof(buf[0]));
+    buf_count = 0;
+    k_spin_unlock(&buf_lock, key);
+
+    ret = (count > 0) ? append(flush_buf, count * sizeof(flush_buf[0])) : 0;
+    k_mutex_unlock(&flash_lock);
+
+    if (ret != 0)
+        LOG_ERR("failed to write %u journal entries %d", count, ret);
+    if (dropped > 0)
+    {
+        LOG_WRN("%u journal entries dropped, buffer full", dropped);
+        dropped = 0;
+    }
+    return ret;
+}
+
+static void flush_work_fn(struct k_work *work)
+{
+    journal_flush();
+}
+
+void journal_flush_sync()
+{
+    uint8_t count;
+
+    if (!mounted || atomic_get(&appending))
+        return;
+
+    k_spinlock_key_t key = k_spin_lock(&buf_lock);
+    count = buf_count;
+    buf_count = 0;
+    k_spin_unlock(&buf_lock, key);
+
+    // nothing else runs after a fatal error, buf can be written in place
+    if (count > 0)
+        append(buf, count * sizeof(buf[0]));
+}
+
+/*
+*   A box halted on a fatal error is a dead referee for the rest of the
+*   session, so record why, get the journal onto flash and reboot.
+*/
+void k_sys_fatal_error_handler(unsigned int reason, const z_arch_esf_t *esf)
+{
+    ARG_UNUSED(esf);
+
+    LOG_PANIC();
+    journal_record(JOURNAL_EVT_FATAL, reason, 0);
+    journal_flush_sync();
+    LOG_ERR("fatal error %u, rebooting", reason);
+    sys_reboot(SYS_REBOOT_COLD);
+}
+
+struct read_ctx {
+    uint32_t from_seq;
+    size_t max_len;
+    int (*chunk_cb)(const uint8_t *data, size_t len);
+    uint8_t chunk[JOURNAL_BUF_ENTRIES * sizeof(struct journal_entry)];
+    size_t chunk_len;
+    int ret;
+};
+
+static int read_element(struct fcb_entry_ctx *loc_ctx, void *arg)
+{
+    struct read_ctx *ctx = arg;
+    struct journal_entry entry;
+    size_t count = loc_ctx->loc.fe_data_len / sizeof(entry);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (flash_area_read(loc_ctx->fap, FCB_ENTRY_FA_DATA_OFF(loc_ctx->loc) + i * sizeof(entry),
+                                &entry, sizeof(entry)) != 0)
+            return 0;
+        if (entry.seq < ctx->from_seq)
+            continue;
+
+        memcpy(&ctx->chunk[ctx->chunk_len], &entry, sizeof(entry));
+        ctx->chunk_len += sizeof(entry);
+        if (ctx->chunk_len + sizeof(entry) > ctx->max_len)
+        {
+            ctx->ret = ctx->chunk_cb(ctx->chunk, ctx->chunk_len);
+            ctx->chunk_len = 0;
+            if (ctx->ret != 0)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+int journal_read(uint32_t from_seq, size_t max_len, int (*chunk_cb)(const uint8_t *data, size_t len))
+{
+    static struct read_ctx ctx;
+    int ret;
+
+    if (!mounted)
+        return -ENODEV;
+    if (max_len < sizeof(struct journal_entry))
+        return -EINVAL;
+
+    journal_flush();
+
+    k_mutex_lock(&flash_lock, K_FOREVER);
+    ctx.from_seq = from_seq;
+    ctx.max_len = MIN(max_len, sizeof(ctx.chunk));
+    ctx.chunk_cb = chunk_cb;
+    ctx.chunk_len = 0;
+    ctx.ret = 0;
+    ret = fcb_walk(&fcb, NULL, read_element, &ctx);
+    if (ret == 0 && ctx.ret == 0 && ctx.chunk_len > 0)
+        ctx.ret = chunk_cb(ctx.chunk, ctx.chunk_len);
+    k_mutex_unlock(&flash_lock);
+
+    return (ret != 0) ? ret : ctx.ret;
+}
+
+// the last entry of the newest element carries the highest sequence number
+static int find_last_seq(struct fcb_entry_ctx *loc_ctx, void *arg)
+{
+    struct journal_entry entry;
+    uint16_t len = loc_ctx->loc.fe_data_len;
+
+    if (len < sizeof(entry))
+        return 0;
+    if (flash_area_read(loc_ctx->fap, FCB_ENTRY_FA_DATA_OFF(loc_ctx->loc) + len - sizeof(entry),
+                            &entry, sizeof(entry)) == 0)
+        *(uint32_t *)arg = entry.seq + 1;
+    return 0;
+}
+
+int journal_init()
+{
+    uint32_t sector_count = ARRAY_SIZE(sectors);
+    uint32_t seq = 0;
+    int ret;
+
+    k_mutex_init(&flash_lock);
+
+    ret = flash_area_get_sectors(FLASH_AREA_ID(JOURNAL_NODE_LABEL), &sector_count, sectors);
+    if (ret != 0)
+    {
+        LOG_ERR("no journal partition %d", ret);
+        return ret;
+    }
+
+    fcb.f_magic = JOURNAL_FCB_MAGIC;
+    fcb.f_version = JOURNAL_FCB_VERSION;
+    fcb.f_sector_cnt = sector_count;
+    fcb.f_scratch_cnt = 0;
+    fcb.f_sectors = sectors;
+    ret = fcb_init(FLASH_AREA_ID(JOURNAL_NODE_LABEL), &fcb);
+    if (ret != 0)
+    {
+        LOG_ERR("journal init failed %d", ret);
+        return ret;
+    }
+
+    fcb_walk(&fcb, NULL, find_last_seq, &seq);
+    k_spinlock_key_t key = k_spin_lock(&buf_lock);
+    // anything recorded before the mount goes after what's on flash
+    for (uint8_t i = 0; i < buf_count; i++)
+        buf[i].seq += seq;
+    next_seq += seq;
+    k_spin_unlock(&buf_lock, key);
+    mounted = true;
+
+    LOG_INF("journal on %u sectors, next seq %u", sector_count, next_seq);
+    journal_record(JOURNAL_EVT_BOOT, 0, 0);
+    // a flush that came due before the mount did nothing
+    k_work_schedule(&flush_work, K_MSEC(JOURNAL_FLUSH_MS));
+    return 0;
+}
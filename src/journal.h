@@ -0,0 +1,67 @@
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+*   Append-only event journal in its own flash partition, for going back over
+*   what a box saw after a meet. Entries are buffered in RAM and written out
+*   as one FCB element per batch, so a flush is a single CRC'd write and the
+*   oldest sector is erased only once the partition wraps. Decisions are on
+*   flash within JOURNAL_DECISION_FLUSH_MS and a fatal error writes out what
+*   is buffered before rebooting, so only a power cut loses entries; a torn
+*   write is dropped by the CRC.
+*/
+
+#define JOURNAL_EVT_BOOT            1   // arg, val unused
+#define JOURNAL_EVT_BUTTON          2   // arg button id, val BTN_EVT_*
+#define JOURNAL_EVT_DECISION        3   // arg decision (| RELAYED), val publish result
+#define JOURNAL_EVT_LINK            4   // arg JOURNAL_LINK_*, val 1 up / 0 down
+#define JOURNAL_EVT_CONFIG          5   // arg JOURNAL_CONFIG_*
+#define JOURNAL_EVT_FATAL           6   // arg K_ERR_* reason, the box reboots after it
+
+#define JOURNAL_DECISION_RELAYED    0x80
+
+#define JOURNAL_LINK_WIFI           0
+#define JOURNAL_LINK_MQTT           1
+#define JOURNAL_LINK_RELAY          2
+
+#define JOURNAL_CONFIG_APPLIED      0
+#define JOURNAL_CONFIG_CONFIRMED    1
+#define JOURNAL_CONFIG_ROLLED_BACK  2
+
+#ifndef JOURNAL_BUF_ENTRIES
+#define JOURNAL_BUF_ENTRIES         32
+#endif
+// a batch is written this long after its first entry, or when 3/4 full
+#ifndef JOURNAL_FLUSH_MS
+#define JOURNAL_FLUSH_MS            10000
+#endif
+// a decision brings the flush forward to this, long enough for the button
+// release to go in the same write
+#ifndef JOURNAL_DECISION_FLUSH_MS
+#define JOURNAL_DECISION_FLUSH_MS   250
+#endif
+
+// little endian on the wire, scripts/journal_dump.py decodes it
+struct journal_entry {
+    uint32_t seq;
+    uint32_t time_ms;
+    uint8_t type;
+    uint8_t arg;
+    int16_t val;
+} __packed;
+
+int journal_init();
+// safe from any thread, never touches flash
+void journal_record(uint8_t type, uint8_t arg, int16_t val);
+int journal_flush();
+// flush without waiting on anything, for fatal errors and right before a
+// sys_reboot(); skipped if a flush was interrupted mid write
+void journal_flush_sync();
+// entries from from_seq on, in chunks of at most max_len bytes of packed
+// entries; stops early if chunk_cb returns non zero
+int journal_read(uint32_t from_seq, size_t max_len, int (*chunk_cb)(const uint8_t *data, size_t len));
+
+#endif
@@ -0,0 +1,188 @@
+#include <zephyr/zephyr.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/logging/log_ctrl.h>
+#include <zephyr/logging/log_output.h>
+
+#include "log_backend_mqtt.h"
+
+// no LOG_MODULE_REGISTER, anything this module logged would come straight
+// back through it
+
+#define LOG_MQTT_LINE_MAX           128
+// longer records (hexdumps) are dropped and counted
+#define LOG_MQTT_RECORD_MAX         256
+#define LOG_MQTT_THREAD_STACK_SIZE  3072
+
+static uint8_t batch[LOG_MQTT_BATCH_SIZE];
+static size_t batch_len;
+// what goes to the publisher, the batch behind a dropped records line
+static uint8_t send_buf[LOG_MQTT_BATCH_SIZE + 32];
+// one record is formatted here, then appended to the batch whole
+static uint8_t record_buf[LOG_MQTT_RECORD_MAX];
+static size_t record_len;
+static bool record_overflowed;
+static struct k_spinlock batch_lock;
+static K_SEM_DEFINE(flush_sem, 0, 1);
+
+static int (*publisher)(const uint8_t *data, size_t len);
+static struct log_mqtt_stats stats;
+static uint32_t tokens = LOG_MQTT_BURST_BYTES;
+static int64_t tokens_updated;
+
+// only called from process(), on the logging thread
+static int char_out(uint8_t *data, size_t length, void *ctx)
+{
+    if (record_overflowed || record_len + length > sizeof(record_buf))
+        record_overflowed = true;
+    else
+    {
+        memcpy(&record_buf[record_len], data, length);
+        record_len += length;
+    }
+    return length;
+}
+
+static uint8_t output_buf[LOG_MQTT_LINE_MAX];
+LOG_OUTPUT_DEFINE(log_output_mqtt, char_out, output_buf, sizeof(output_buf));
+
+static void process(const struct log_backend *const backend, union log_msg2_generic *msg)
+{
+    bool flush = false;
+
+    record_len = 0;
+    record_overflowed = false;
+    log_output_msg2_process(&log_output_mqtt, &msg->log,
+                            LOG_OUTPUT_FLAG_LEVEL | LOG_OUTPUT_FLAG_TIMESTAMP);
+
+    // whole records or nothing, the publisher may have moved the batch
+    // down since the last one so the offset is only taken under the lock
+    k_spinlock_key_t key = k_spin_lock(&batch_lock);
+    if (record_overflowed || batch_len + record_len > sizeof(batch))
+        stats.dropped_records++;
+    else
+    {
+        flush = (batch_len == 0);
+        memcpy(&batch[batch_len], record_buf, record_len);
+        batch_len += record_len;
+        flush |= (batch_len >= sizeof(batch) * 3 / 4);
+    }
+    k_spin_unlock(&batch_lock, key);
+
+    if (flush)
+        k_sem_give(&flush_sem);
+}
+
+static void dropped(const struct log_backend *const backend, uint32_t cnt)
+{
+    stats.dropped_records += cnt;
+}
+
+static void panic(const struct log_backend *const backend)
+{
+    // nothing can be published from a panic, the batch is lost
+}
+
+static void init(const struct log_backend *const backend)
+{
+    uint32_t sources = log_src_cnt_get(CONFIG_LOG_DOMAIN_ID);
+
+    for (uint32_t i = 0; i < sources; i++)
+        log_filter_set(backend, CONFIG_LOG_DOMAIN_ID, i, LOG_MQTT_DEFAULT_LEVEL);
+}
+
+static const struct log_backend_api log_backend_mqtt_api = {
+    .process = process,
+    .dropped = dropped,
+    .panic = panic,
+    .init = init
+};
+
+LOG_BACKEND_DEFINE(log_backend_mqtt, log_backend_mqtt_api, true);
+
+static void refill_tokens()
+{
+    int64_t now = k_uptime_get();
+    uint64_t earned = (now - tokens_updated) * LOG_MQTT_RATE_BYTES_PER_S / 1000;
+
+    if (earned > 0)
+    {
+        tokens = MIN(LOG_MQTT_BURST_BYTES, tokens + earned);
+        tokens_updated = now;
+    }
+}
+
+static void log_mqtt_thread()
+{
+    size_t len;
+    size_t header_len;
+    uint32_t reported_drops = 0;
+    uint32_t drops;
+
+    tokens_updated = k_uptime_get();
+    while (1)
+    {
+        // first record in, wait out the flush period unless it fills up
+        k_sem_take(&flush_sem, K_FOREVER);
+        if (batch_len < sizeof(batch) * 3 / 4)
+            k_sem_take(&flush_sem, K_MSEC(LOG_MQTT_FLUSH_MS));
+
+        while (batch_len > 0 && publisher != NULL)
+        {
+            refill_tokens();
+
+            k_spinlock_key_t key = k_spin_lock(&batch_lock);
+            len = batch_len;
+            k_spin_unlock(&batch_lock, key);
+
+            if (len > tokens)
+            {
+                stats.rate_limited++;
+                k_msleep((len - tokens) * 1000 / LOG_MQTT_RATE_BYTES_PER_S + 1);
+                continue;
+            }
+
+            header_len = 0;
+            drops = stats.dropped_records - reported_drops;
+            if (drops > 0)
+                header_len = snprintk(send_buf, sizeof(send_buf) - LOG_MQTT_BATCH_SIZE,
+                                        "--- %u records dropped\n", drops);
+            memcpy(&send_buf[header_len], batch, len);
+
+            int ret = publisher(send_buf, header_len + len);
+            if (ret == -EAGAIN)
+            {
+                k_msleep(LOG_MQTT_FLUSH_MS);
+                continue;
+            }
+
+            // records that came in while publishing move to the front
+            key = k_spin_lock(&batch_lock);
+            memmove(batch, &batch[len], batch_len - len);
+            batch_len -= len;
+            k_spin_unlock(&batch_lock, key);
+
+            tokens -= MIN(tokens, header_len + len);
+            reported_drops += drops;
+            stats.batches++;
+        }
+    }
+}
+
+K_THREAD_DEFINE(log_mqtt_th, LOG_MQTT_THREAD_STACK_SIZE, log_mqtt_thread, NULL, NULL, NULL,
+                K_LOWEST_APPLICATION_THREAD_PRIO, 0, 0);
+
+void log_mqtt_set_publisher(int (*publish)(const uint8_t *data, size_t len))
+{
+    publisher = publish;
+    k_sem_give(&flush_sem);
+}
+
+const struct log_backend *log_mqtt_backend()
+{
+    return &log_backend_mqtt;
+}
+
+void log_mqtt_get_stats(struct log_mqtt_stats *out)
+{
+    *out = stats;
+}
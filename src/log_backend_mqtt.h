@@ -0,0 +1,46 @@
+#ifndef LOG_BACKEND_MQTT_H_
+#define LOG_BACKEND_MQTT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zephyr/logging/log_backend.h>
+
+/*
+*   Log backend that batches formatted records in RAM and hands each batch
+*   to a publisher from a lowest priority thread. A token bucket caps the
+*   bytes per second; when the batch buffer is full new records are
+*   dropped (and counted) rather than waited on, so logging never holds up
+*   the rest of the box.
+*/
+
+#ifndef LOG_MQTT_BATCH_SIZE
+#define LOG_MQTT_BATCH_SIZE         512
+#endif
+// a batch goes out this long after its first record, or when 3/4 full
+#ifndef LOG_MQTT_FLUSH_MS
+#define LOG_MQTT_FLUSH_MS           2000
+#endif
+#ifndef LOG_MQTT_RATE_BYTES_PER_S
+#define LOG_MQTT_RATE_BYTES_PER_S   256
+#endif
+#ifndef LOG_MQTT_BURST_BYTES
+#define LOG_MQTT_BURST_BYTES        (2 * LOG_MQTT_BATCH_SIZE)
+#endif
+// runtime level on this backend until changed over MQTT
+#ifndef LOG_MQTT_DEFAULT_LEVEL
+#define LOG_MQTT_DEFAULT_LEVEL      LOG_LEVEL_INF
+#endif
+
+struct log_mqtt_stats {
+    uint32_t batches;
+    uint32_t dropped_records;
+    uint32_t rate_limited;
+};
+
+// publish returns -EAGAIN to keep the batch for later, anything else
+// (success or not) consumes it
+void log_mqtt_set_publisher(int (*publish)(const uint8_t *data, size_t len));
+const struct log_backend *log_mqtt_backend();
+void log_mqtt_get_stats(struct log_mqtt_stats *stats);
+
+#endif
@@ -1,6 +1,6 @@
 #include <logging/log.h>
 
-LOG_MODULE_REGISTER(main, LOG_LEVEL_DBG);
+LOG_MODULE_REGISTER(main, CONFIG_APP_LOG_LEVEL);
 
 #include <zephyr/zephyr.h>
 #include <zephyr/device.h>
@@ -12,6 +12,10 @@ LOG_MODULE_REGISTER(main, LOG_LEVEL_DBG);
 #include "msys.h"
 #include "comms_mgr.h"
 #include "settings_util.h"
+#include "bat_mon.h"
+#include "journal.h"
+#include "alloc_guard.h"
+#include "health_mon.h"
 
 void main(void)
 {
@@ -29,6 +33,16 @@ void main(void)
         return;
     }
 
+    // not fatal either way, entries are held in RAM until it's mounted
+    ret = journal_init();
+    if (ret != 0)
+        LOG_ERR("Failed to initialise event journal");
+
+    // not fatal, the box just reports an unknown battery level
+    ret = bat_mon_init();
+    if (ret != 0)
+        LOG_ERR("Failed to initialise battery monitor");
+
     ret = settings_util_init();
     if (ret != 0)
     {
@@ -36,6 +50,8 @@ void main(void)
         return;
     }
 
+    health_mon_init();
+
     ret = comms_mgr_init(io_get_dev_id());
     if (ret != 0)
     {
@@ -57,13 +73,11 @@ void main(void)
         return;
     }
 
-    while(1)
-    {
-        // Process buffered log messages and sleep;
-        if (log_process() == false)
-            k_sleep(K_MSEC(100));
-    }
-    // never going to get here...
+    // everything is allocated by now, see alloc_guard.h
+    alloc_guard_lock();
+
+    // logs are processed on the logging thread, which sleeps while there's
+    // nothing buffered, so main has nothing left to do
     LOG_INF("main thread exiting");
 }
 
@@ -1,13 +1,17 @@
 #include <zephyr/logging/log.h>
 
-LOG_MODULE_REGISTER(mqtt_client_mod, LOG_LEVEL_DBG);
+LOG_MODULE_REGISTER(mqtt_client_mod, CONFIG_APP_LOG_LEVEL);
 
 #include <zephyr/zephyr.h>
 #include <zephyr/net/socket.h>
 #include <zephyr/net/mqtt.h>
+#if defined(CONFIG_MQTT_LIB_TLS)
+#include <zephyr/net/tls_credentials.h>
+#endif
 
 #include "settings_util.h"
 #include "mqtt_client.h"
+#include "broker_resolver.h"
 #include "comms_mgr.h"
 
 #ifndef MQTT_BUFFER_SIZE
@@ -27,7 +31,15 @@ LOG_MODULE_REGISTER(mqtt_client_mod, LOG_LEVEL_DBG);
 #endif
 
 #ifndef MQTT_CLIENT_STACKSIZE
-#define MQTT_CLIENT_STACKSIZE   2048
+#if defined(CONFIG_MQTT_LIB_TLS)
+#define MQTT_CLIENT_STACKSIZE   4096    // record decrypt in mqtt_input needs the headroom
+#else
+#define MQTT_CLIENT_STACKSIZE   2096
+#endif
+#endif
+
+#ifndef MQTT_CLIENT_TLS_SEC_TAG
+#define MQTT_CLIENT_TLS_SEC_TAG             1
 #endif
 
 #ifndef MQTT_CLIENT_MAX_CONNECT_RETRIES
@@ -40,16 +52,24 @@ LOG_MODULE_REGISTER(mqtt_client_mod, LOG_LEVEL_DBG);
 
 #define MQTT_CLIENT_INPUT_TIMEOUT_MS            100
 
+// longest the client thread sleeps in poll before it sees a stop request
+#ifndef MQTT_CLIENT_STOP_POLL_MS
+#define MQTT_CLIENT_STOP_POLL_MS                1000
+#endif
+
 #define MQTT_CLIENT_TICK_PERIOD                 10000
 
-#define MQTT_PUB_PLD_MAX_LEN                    32
+// room for a diag shell command line
+#define MQTT_PUB_PLD_MAX_LEN                    64
+#define MQTT_CLIENT_MAX_SUB_TOPICS              8
+#define MQTT_CLIENT_MAX_TOPIC_LEN               64
 
 struct mqtt_sub_topic_handler {
     sys_snode_t node;
-    char *topic;
+    char topic[MQTT_CLIENT_MAX_TOPIC_LEN];
     void (*handler)(uint8_t *msg, uint8_t msg_len); 
 };
-static struct mqtt_sub_topic_handler sub_topic_handler_list[5];
+static struct mqtt_sub_topic_handler sub_topic_handler_list[MQTT_CLIENT_MAX_SUB_TOPICS];
 static uint8_t num_mqtt_sub_topics = 0;
 static uint8_t sub_rx_data_buffer[MQTT_PUB_PLD_MAX_LEN];
 
@@ -58,6 +78,8 @@ static uint8_t tx_buffer[MQTT_BUFFER_SIZE];
 
 static bool running;
 static bool connected;
+static bool client_thread_started;
+static atomic_t client_stop;
 
 static struct sockaddr_storage broker_serv;
 
@@ -65,12 +87,23 @@ static struct mqtt_client client;
 
 static struct zsock_pollfd fds[1];
 
+#if defined(CONFIG_MQTT_LIB_TLS)
+// tls_credential_add() keeps a reference, so the CA has to live in static storage,
+// one more byte for the NUL mbedTLS wants counted in the length of a PEM cert
+static uint8_t tls_ca_cert[SETTINGS_UTIL_TLS_CA_MAXLEN + 1];
+static sec_tag_t tls_sec_tags[] = { MQTT_CLIENT_TLS_SEC_TAG };
+static char tls_hostname[32];
+#endif
+
+static struct mqtt_client_connect_stats connect_stats;
+static struct mqtt_config_settings *broker_config;
+
 struct k_thread *mqtt_client_handle;
 struct k_work_delayable mqtt_client_live_work;
 struct k_work_delayable mqtt_client_input_work;
 
 struct k_thread mqtt_client_th;
-K_THREAD_STACK_DEFINE(mqtt_client_th_stack, 2096);
+K_THREAD_STACK_DEFINE(mqtt_client_th_stack, MQTT_CLIENT_STACKSIZE);
 struct k_thread mqtt_msg_th;
 K_THREAD_STACK_DEFINE(mqtt_msg_th_stack, 2096);
 
@@ -84,6 +117,9 @@ static void setup_socket_fds();
 static void queue_pub_msg(struct mqtt_publish_message msg);
 static void mqtt_msg_thread();
 static void process_pub_msg(struct mqtt_publish_message *msg);
+static int setup_tls(struct mqtt_config_settings *config);
+static void stop_client_thread();
+static void record_connect_time(uint32_t connect_ms);
 
 void mqtt_client_set_state_cb(void (*cb)(uint8_t mqtt_state));
 
@@ -112,12 +148,12 @@ void mqtt_evt_handler(struct mqtt_client *client,
         break;
 
     case MQTT_EVT_PINGRESP:
-        LOG_INF("pingresp received");
+        LOG_DBG("pingresp received");
         //k_work_schedule(&mqtt_client_live_work, K_MSEC(MQTT_CLIENT_PING_TIMEOUT));
         break;
     case MQTT_EVT_PUBLISH: {
         const struct mqtt_publish_param *pub = &evt->param.publish;
-        LOG_INF("publish rx");
+        LOG_DBG("publish rx");
         if (pub->message.topic.qos == MQTT_QOS_1_AT_LEAST_ONCE)
         {
             struct mqtt_puback_param puback = { .message_id = pub->message_id };
@@ -127,13 +163,14 @@ void mqtt_evt_handler(struct mqtt_client *client,
         if (pub->message.payload.len < MQTT_PUB_PLD_MAX_LEN)
         {
             mqtt_read_publish_payload(client, sub_rx_data_buffer, MQTT_PUB_PLD_MAX_LEN);
-            LOG_INF("pld buf: %s", sub_rx_data_buffer);
+            sub_rx_data_buffer[pub->message.payload.len] = 0;
+            LOG_DBG("pld buf: %s", sub_rx_data_buffer);
             process_pub_msg(&pub->message);
         }
         break;
     }
     default:
-        LOG_INF("mqtt evt: %d", evt->type);
+        LOG_DBG("mqtt evt: %d", evt->type);
         break;
     }
 }
@@ -145,6 +182,83 @@ static void setup_socket_fds()
         fds[0].fd = client.transport.tcp.sock;
         fds[0].events = ZSOCK_POLLIN;
     }
+#if defined(CONFIG_MQTT_LIB_TLS)
+    else if (client.transport.type == MQTT_TRANSPORT_SECURE)
+    {
+        fds[0].fd = client.transport.tls.sock;
+        fds[0].events = ZSOCK_POLLIN;
+    }
+#endif
+}
+
+static int setup_tls(struct mqtt_config_settings *config)
+{
+#if defined(CONFIG_MQTT_LIB_TLS)
+    int ret = 0;
+
+    ret = settings_util_load_mqtt_tls_ca(tls_ca_cert, sizeof(tls_ca_cert) - 1);
+    if (ret <= 0)
+    {
+        LOG_ERR("tls enabled but no ca cert provisioned");
+        return -ENOENT;
+    }
+
+    // mbedTLS only takes a buffer as PEM if its last counted byte is the NUL,
+    // a DER cert goes in as stored
+    if (ret > 10 && memcmp(tls_ca_cert, "-----BEGIN", 10) == 0 && tls_ca_cert[ret - 1] != 0)
+        tls_ca_cert[ret++] = 0;
+
+    // re-register every setup so a newly provisioned CA takes effect
+    tls_credential_delete(MQTT_CLIENT_TLS_SEC_TAG, TLS_CREDENTIAL_CA_CERTIFICATE);
+    ret = tls_credential_add(MQTT_CLIENT_TLS_SEC_TAG, TLS_CREDENTIAL_CA_CERTIFICATE,
+                                tls_ca_cert, ret);
+    if (ret != 0)
+    {
+        LOG_ERR("failed to register ca cert %d", ret);
+        return ret;
+    }
+
+    strcpy(tls_hostname, config->tls_hostname);
+
+    struct mqtt_sec_config *tls_config = &client.transport.tls.config;
+    tls_config->peer_verify = TLS_PEER_VERIFY_REQUIRED;
+    tls_config->cipher_list = NULL;
+    tls_config->cipher_count = 0;
+    tls_config->sec_tag_list = tls_sec_tags;
+    tls_config->sec_tag_count = ARRAY_SIZE(tls_sec_tags);
+    tls_config->hostname = (strlen(tls_hostname) > 0) ? tls_hostname : NULL;
+    // sessions are cached in RAM by the socket layer, keyed on the broker
+    // address, so reconnects can try to resume instead of a full ECDHE handshake
+    tls_config->session_cache = TLS_SESSION_CACHE_ENABLED;
+
+    client.transport.type = MQTT_TRANSPORT_SECURE;
+    return 0;
+#else
+    LOG_ERR("tls requested but firmware built without CONFIG_MQTT_LIB_TLS");
+    return -ENOTSUP;
+#endif
+}
+
+// the socket API doesn't tell whether the TLS session was resumed, so
+// connects are only split into plain and TLS, a resumed handshake shows up
+// as a drop in the TLS times
+static void record_connect_time(uint32_t connect_ms)
+{
+    bool tls = client.transport.type != MQTT_TRANSPORT_NON_SECURE;
+
+    connect_stats.last_ms = connect_ms;
+    if (tls)
+    {
+        connect_stats.tls_count++;
+        connect_stats.tls_total_ms += connect_ms;
+    }
+    else
+    {
+        connect_stats.plain_count++;
+        connect_stats.plain_total_ms += connect_ms;
+    }
+
+    LOG_INF("mqtt connect took %d ms (tls: %d)", connect_ms, tls);
 }
 
 int mqtt_client_mod_init()
@@ -155,6 +269,15 @@ int mqtt_client_mod_init()
     k_work_init_delayable(&mqtt_client_input_work, mqtt_client_input);
 
     k_msgq_init(&pub_msgq, &pub_msgs, sizeof(struct mqtt_publish_message), 5);
+
+    // the msg thread never exits, so it's created once here rather than per connect
+    k_thread_create(&mqtt_msg_th, mqtt_msg_th_stack,
+                    K_THREAD_STACK_SIZEOF(mqtt_msg_th_stack),
+                    mqtt_msg_thread,
+                    NULL, NULL, NULL,
+                    6, 0, K_NO_WAIT);
+
+    return broker_resolver_init();
 }
 
 int mqtt_client_setup(struct mqtt_config_settings *config)
@@ -163,14 +286,18 @@ int mqtt_client_setup(struct mqtt_config_settings *config)
     mqtt_client_init(&client);
     LOG_INF("setting up client addr at %s", config->broker_addr);
     struct sockaddr_in *broker = (struct sockaddr_in *)&broker_serv;
-    broker->sin_family = AF_INET;
     LOG_INF("setting up port at %d", config->port);
-    broker->sin_port = htons(config->port);
     //broker->sin_port = htons(1883);
     //char *serv_str = k_malloc(sizeof(char) * config.broker_addr_len);
     //snprintk(serv_str, config.broker_addr_len, "%s", config.broker_addr);
-    zsock_inet_pton(AF_INET, config->broker_addr, &broker->sin_addr);
-    
+    broker_config = config;
+    int ret = broker_resolver_get(config, broker);
+    if (ret != 0)
+    {
+        running = false;
+        return ret;
+    }
+
     LOG_INF("cfg client params");
     client.broker = &broker_serv;
     client.evt_cb = mqtt_evt_handler;
@@ -182,6 +309,16 @@ int mqtt_client_setup(struct mqtt_config_settings *config)
     client.transport.type = MQTT_TRANSPORT_NON_SECURE;
     client.keepalive = MQTT_CLIENT_KEEPALIVE_MS/1000;
 
+    if (config->tls_enabled)
+    {
+        ret = setup_tls(config);
+        if (ret != 0)
+        {
+            running = false;
+            return ret;
+        }
+    }
+
     client.rx_buf = rx_buffer;
     client.tx_buf = tx_buffer;
     client.rx_buf_size = MQTT_BUFFER_SIZE;
@@ -200,12 +337,15 @@ int mqtt_client_start()
     while (retries++ < MQTT_CLIENT_MAX_CONNECT_RETRIES && !connected)
     {
         LOG_INF("trying connect");
+        int64_t connect_start = k_uptime_get();
         ret = mqtt_connect(&client);
         if (ret != 0)
         {
             LOG_ERR("failed to connect, trying again... (%d)", ret);
             continue;
         }
+        // mqtt_connect() blocks through the TCP and TLS handshakes
+        record_connect_time((uint32_t)k_uptime_delta(&connect_start));
         LOG_INF("setting up socket");
         setup_socket_fds();
         LOG_INF("poll socket");
@@ -225,22 +365,22 @@ int mqtt_client_start()
     {
         //k_work_schedule(&mqtt_client_live_work, K_MSEC(MQTT_CLIENT_PING_TIMEOUT));
 
+        stop_client_thread();
         k_thread_create(&mqtt_client_th, mqtt_client_th_stack,
                         K_THREAD_STACK_SIZEOF(mqtt_client_th_stack),
                         mqtt_client_thread,
                         NULL, NULL, NULL,
                         6, 0, K_NO_WAIT);
-        k_thread_create(&mqtt_msg_th, mqtt_msg_th_stack,
-                        K_THREAD_STACK_SIZEOF(mqtt_msg_th_stack),
-                        mqtt_msg_thread,
-                        NULL, NULL, NULL,
-                        6, 0, K_NO_WAIT);
+        client_thread_started = true;
     }
     else 
     {
             LOG_ERR("connect failed, aborting...");
             mqtt_client_teardown();
+            if (broker_config != NULL)
+                broker_resolver_report_failure(broker_config);
             mqtt_state_cb(MQTT_STATE_DISCONNECTED);
+            return -ENOTCONN;
     }
 
     return 0;
@@ -249,16 +389,22 @@ int mqtt_client_start()
 static void mqtt_client_thread()
 {
     LOG_INF("starting mqtt client thread");
-    uint8_t ret = 0;
+    int ret = 0;
 
-    while (connected)
+    while (connected && !atomic_get(&client_stop))
     {
-        zsock_poll(fds, 1, MQTT_CLIENT_CONNECT_TIMEOUT_MS);
-        ret = mqtt_input(&client);
-        if (ret != 0) 
+        // sleep until data arrives or a keepalive ping is due, waking up
+        // now and then to see whether teardown wants the socket back
+        ret = zsock_poll(fds, 1, MIN(mqtt_keepalive_time_left(&client),
+                                        MQTT_CLIENT_STOP_POLL_MS));
+        if (ret > 0)
         {
-            LOG_ERR("mqtt input err: %d", ret);
-            return;
+            ret = mqtt_input(&client);
+            if (ret != 0) 
+            {
+                LOG_ERR("mqtt input err: %d", ret);
+                return;
+            }
         }
 
         ret = mqtt_live(&client);
@@ -279,23 +425,25 @@ static void mqtt_msg_thread()
 
     while (1)
     {
-        ret = k_msgq_get(&pub_msgq, &msg, K_MSEC(100));
+        ret = k_msgq_get(&pub_msgq, &msg, K_FOREVER);
         if (ret == 0)
         {
             process_pub_msg(&msg);
         }
-
-        k_yield();
     }
 }
 
 static void process_pub_msg(struct mqtt_publish_message *msg)
 {
+    // the topic points into the rx buffer and isn't terminated
+    const struct mqtt_utf8 *topic = &msg->topic.topic;
+
     for (uint8_t i = 0; i < num_mqtt_sub_topics; i++)
     {
-        if (strcmp(msg->topic.topic.utf8, sub_topic_handler_list[i].topic) == 0)
+        if (topic->size == strlen(sub_topic_handler_list[i].topic)
+                && memcmp(topic->utf8, sub_topic_handler_list[i].topic, topic->size) == 0)
         {
-            LOG_INF("rx msg for topic: %s", msg->topic.topic.utf8);
+            LOG_DBG("rx msg for topic: %s", sub_topic_handler_list[i].topic);
             sub_topic_handler_list[i].handler(sub_rx_data_buffer, msg->payload.len);
         }
     }
@@ -307,12 +455,34 @@ int mqtt_client_teardown()
     // cancel any work queues
     k_work_cancel_delayable(&mqtt_client_live_work);
     k_work_cancel_delayable(&mqtt_client_input_work);
-    // call mqtt_abort
+    // the client thread uses the socket until it exits, only close it after
+    if (k_current_get() != &mqtt_client_th)
+        stop_client_thread();
     mqtt_abort(&client);
+    // the session is gone, and with it the broker side subscriptions
+    num_mqtt_sub_topics = 0;
 
     return 0;
 }
 
+static void stop_client_thread()
+{
+    if (!client_thread_started)
+        return;
+
+    // it sees the flag within MQTT_CLIENT_STOP_POLL_MS, and aborting it could
+    // leave the socket or MQTT layer locks held
+    atomic_set(&client_stop, 1);
+    k_thread_join(&mqtt_client_th, K_FOREVER);
+    atomic_set(&client_stop, 0);
+    client_thread_started = false;
+}
+
+bool mqtt_client_is_connected()
+{
+    return connected;
+}
+
 static void mqtt_client_live()
 {
     LOG_DBG("mqtt client keepalive refresh");
@@ -374,21 +544,46 @@ void mqtt_client_set_state_cb(void (*cb)(uint8_t mqtt_state))
     mqtt_state_cb = cb;
 }
 
+void mqtt_client_get_connect_stats(struct mqtt_client_connect_stats *stats)
+{
+    *stats = connect_stats;
+}
+
+const char *mqtt_client_get_sub(uint8_t index)
+{
+    if (index >= num_mqtt_sub_topics)
+        return NULL;
+    return sub_topic_handler_list[index].topic;
+}
+
 int mqtt_client_subscribe(const char *topic, void (*handler)(uint8_t *msg, uint8_t msg_len))
 {
+    if (num_mqtt_sub_topics >= MQTT_CLIENT_MAX_SUB_TOPICS)
+        return -ENOMEM;
+    if (strlen(topic) >= MQTT_CLIENT_MAX_TOPIC_LEN)
+        return -ENAMETOOLONG;
+
     if (handler != NULL)
     {
-        sub_topic_handler_list[num_mqtt_sub_topics].topic = k_malloc(sizeof(char) * strlen(topic));
-        strcpy(sub_topic_handler_list[num_mqtt_sub_topics].topic, topic);
-        sub_topic_handler_list[num_mqtt_sub_topics].handler = handler;
-
-        struct mqtt_subscription_list subs;
-        subs.list = k_malloc(sizeof(struct mqtt_topic));
-        subs.list->topic.utf8 = topic;
-        subs.list->topic.size = strlen(topic);
-        subs.list->qos = 0;
-        subs.list_count = 1;
-        subs.message_id = num_mqtt_sub_topics + 1;
+        struct mqtt_sub_topic_handler *sub = &sub_topic_handler_list[num_mqtt_sub_topics];
+
+        strcpy(sub->topic, topic);
+        sub->handler = handler;
+
+        // the request is encoded into the tx buffer before mqtt_subscribe
+        // returns, the list can live on the stack
+        struct mqtt_topic sub_topic = {
+            .topic = {
+                .utf8 = sub->topic,
+                .size = strlen(sub->topic)
+            },
+            .qos = 0
+        };
+        struct mqtt_subscription_list subs = {
+            .list = &sub_topic,
+            .list_count = 1,
+            .message_id = num_mqtt_sub_topics + 1
+        };
 
         mqtt_subscribe(&client, &subs);
         num_mqtt_sub_topics++;
@@ -396,4 +591,28 @@ int mqtt_client_subscribe(const char *topic, void (*handler)(uint8_t *msg, uint8
         return 0;
     }
     return -EINVAL;
-}
\ No newline at end of file
+}
+
+int mqtt_client_unsubscribe_all()
+{
+    for (uint8_t i = 0; i < num_mqtt_sub_topics && connected; i++)
+    {
+        struct mqtt_topic topic = {
+            .topic = {
+                .utf8 = sub_topic_handler_list[i].topic,
+                .size = strlen(sub_topic_handler_list[i].topic)
+            },
+            .qos = 0
+        };
+        struct mqtt_subscription_list subs = {
+            .list = &topic,
+            .list_count = 1,
+            .message_id = i + 1
+        };
+
+        mqtt_unsubscribe(&client, &subs);
+    }
+    num_mqtt_sub_topics = 0;
+
+    return 0;
+}
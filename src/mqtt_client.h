@@ -5,6 +5,18 @@
 #define MQTT_STATE_CONNECTED        1
 #define MQTT_STATE_DISCONNECTED     2
 
+#include <stdbool.h>
+#include "settings_util.h"
+
+// connect timing, TCP connect through CONNACK, split by transport
+struct mqtt_client_connect_stats {
+    uint32_t last_ms;
+    uint32_t plain_count;
+    uint32_t plain_total_ms;
+    uint32_t tls_count;
+    uint32_t tls_total_ms;
+};
+
 int mqtt_client_mod_init();
 int mqtt_client_publish(enum mqtt_qos qos, 
                             uint8_t *topic,
@@ -12,11 +24,16 @@ int mqtt_client_publish(enum mqtt_qos qos,
                             uint8_t *data, 
                             uint32_t data_len);
 int mqtt_client_subscribe(const char *topic, void (*handler)(uint8_t *msg, uint8_t msg_len));
-int mqtt_client_setup();
+int mqtt_client_setup(struct mqtt_config_settings *config);
 int mqtt_client_start();
 
 int mqtt_client_teardown();
+bool mqtt_client_is_connected();
+int mqtt_client_unsubscribe_all();
 
 void mqtt_client_set_state_cb(void (*cb)(uint8_t mqtt_state));
+void mqtt_client_get_connect_stats(struct mqtt_client_connect_stats *stats);
+// subscribed topic at index, NULL past the last one
+const char *mqtt_client_get_sub(uint8_t index);
 
 #endif
\ No newline at end of file
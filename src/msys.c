@@ -1,14 +1,17 @@
 #include <logging/log.h>
 
-LOG_MODULE_REGISTER(sys_mod, LOG_LEVEL_DBG);
+LOG_MODULE_REGISTER(sys_mod, CONFIG_APP_LOG_LEVEL);
 
 #include <zephyr.h>
-#include <zephyr/sys/reboot.h>
 
 
 #include "msys.h"
 #include "io_mgr.h"
 #include "comms_mgr.h"
+#include "pwr_mgr.h"
+#include "energy_acct.h"
+#include "health_mon.h"
+#include "perf_budget.h"
 
 /*
 *       State machine definitions
@@ -104,6 +107,7 @@ static state_trans_matrix_row_t state_trans_matrix[] = {
 };
 
 #define STATE_TRANS_MATRIX_NUM_ROWS 22
+BUILD_ASSERT(ARRAY_SIZE(state_trans_matrix) == STATE_TRANS_MATRIX_NUM_ROWS, "transition rows miscounted");
 
 static state_func_row_t state_func_a[] = {
     {"S_PRE_INIT",      &state_func_pre_init     },
@@ -128,6 +132,25 @@ static state_func_row_t state_func_entry[] = {
     {"S_CONFIG",        &state_func_config_entry      },
     {"S_CONFIG_END",    &state_func_config_end_entry  }
 };
+// both tables are indexed by state_t
+BUILD_ASSERT(ARRAY_SIZE(state_func_a) == S_CONFIG_END + 1, "state_func_a out of step with state_t");
+BUILD_ASSERT(ARRAY_SIZE(state_func_entry) == S_CONFIG_END + 1, "state_func_entry out of step with state_t");
+
+// average draw per state for the battery model, in mA. These are estimates
+// from ESP32 datasheet figures, not measured on the box: the idle states
+// assume modem sleep and the CPU idling between events. Replace them with
+// supply current measurements before trusting the battery hours.
+static const struct energy_acct_state state_energy[] = {
+    {"S_PRE_INIT",      80 },
+    {"S_INIT",          80 },
+    {"S_IDLE_DCONN",    120},
+    {"S_CONNECTING",    130},
+    {"S_IDLE_CONN",     35 },
+    {"S_DECISION_RX",   120},
+    {"S_DECISION_REQ",  40 },
+    {"S_CONFIG",        110},
+    {"S_CONFIG_END",    110}
+};
 
 void state_func_pre_init_entry(event_t evt)
 {
@@ -154,6 +177,7 @@ void state_func_init(event_t evt)
 void state_func_idle_dconn_entry(event_t evt)
 {
     LOG_DBG("Enter idle-dconn state");
+    pwr_mgr_set_link(false);
 }
 
 void state_func_idle_dconn(event_t evt)
@@ -176,6 +200,7 @@ void state_func_connecting(event_t evt)
 void state_func_idle_conn_entry(event_t evt)
 {
     LOG_DBG("Enter idle-conn state");
+    pwr_mgr_set_link(true);
 
     io_mgr_set_leds_disable();
 }
@@ -188,6 +213,7 @@ void state_func_idle_conn(event_t evt)
 void state_func_decision_rx_entry(event_t evt)
 {
     LOG_DBG("Enter decision rx state");
+    pwr_mgr_note_activity();
 
     if (evt == SYS_EVT_INP_BLK_DECISION)
     {
@@ -206,6 +232,7 @@ void state_func_decision_rx(event_t evt)
 
 void state_func_decision_req_entry(event_t evt)
 {
+    pwr_mgr_note_activity();
 
 }
 
@@ -229,8 +256,9 @@ void state_func_config(event_t evt)
 void state_func_config_end_entry(event_t evt)
 {
     LOG_DBG("Enter config end state");
+    // comms_mgr applies the new config live, this state falls straight
+    // through to S_IDLE_DCONN and the normal connect path
     comms_mgr_end_config();
-    sys_reboot(SYS_REBOOT_COLD);
 }
 
 void state_func_config_end(event_t evt)
@@ -238,6 +266,23 @@ void state_func_config_end(event_t evt)
     LOG_DBG("config end evt: %d", evt);
 }
 
+static struct msys_transition history[MSYS_HISTORY_LEN];
+static uint32_t history_count;
+static struct k_spinlock history_lock;
+
+static void record_transition(state_t from, state_t to, event_t evt)
+{
+    k_spinlock_key_t key = k_spin_lock(&history_lock);
+    struct msys_transition *t = &history[history_count % MSYS_HISTORY_LEN];
+
+    t->time_ms = k_uptime_get_32();
+    t->from = from;
+    t->to = to;
+    t->evt = evt;
+    history_count++;
+    k_spin_unlock(&history_lock, key);
+}
+
 void state_machine_iterate(state_machine_t *state_machine, event_t evt)
 {
     uint8_t state_updated = false;
@@ -250,7 +295,9 @@ void state_machine_iterate(state_machine_t *state_machine, event_t evt)
                 if (state_machine->curr_state != state_trans_matrix[i].next_state)
                 {    
                     state_updated = true;
+                    record_transition(state_machine->curr_state, state_trans_matrix[i].next_state, evt);
                     state_machine->curr_state = state_trans_matrix[i].next_state;
+                    energy_acct_set_state(state_machine->curr_state);
                     (state_func_entry[state_machine->curr_state].func)(evt);
                 }    
                 else
@@ -270,17 +317,25 @@ void state_machine_iterate(state_machine_t *state_machine, event_t evt)
 */
 
 #define SIGNAL_EVT_MAX_RETRIES          10
+// E_ANY rows chain through transient states, bounds the steps after one event
+#define MSYS_SETTLE_MAX_STEPS           8
 static struct k_thread msys_th;
 K_THREAD_STACK_DEFINE(msys_thread_stack, 2048);
 
 static struct k_msgq  msys_evt_queue;
 char __aligned(1) evt_msg_buf[10 * sizeof(event_t)];
 
+static state_machine_t msys_state_machine;
+// when the last decision press was signalled, for timing the decision path
+static uint32_t decision_input_cycles;
+static uint32_t evt_overflows;
+
 void msys_thread();
 
 int msys_init()
 {
     k_msgq_init(&msys_evt_queue, evt_msg_buf, sizeof(event_t), 10);   
+    energy_acct_init(state_energy, ARRAY_SIZE(state_energy));
     return 0;
 }
 
@@ -300,12 +355,16 @@ int msys_signal_evt(uint8_t evt)
 {
     event_t e = evt;
     uint8_t count = 0;
+    if (evt == SYS_EVT_INP_RED_DECISION || evt == SYS_EVT_INP_BLK_DECISION)
+        decision_input_cycles = k_cycle_get_32();
     LOG_DBG("msys evt %d", evt);
     while (k_msgq_put(&msys_evt_queue, &e, K_NO_WAIT) != 0)
     {
         if (count >= SIGNAL_EVT_MAX_RETRIES)
         {
             LOG_DBG("Failed to put event on msgq");
+            evt_overflows++;
+            health_mon_notify();
             return -ETIMEDOUT;
         }
         count++;
@@ -313,26 +372,86 @@ int msys_signal_evt(uint8_t evt)
     return 0;
 }
 
+uint32_t msys_decision_input_cycles()
+{
+    return decision_input_cycles;
+}
+
+bool msys_in_idle_conn()
+{
+    return msys_state_machine.curr_state == S_IDLE_CONN;
+}
+
+uint8_t msys_get_state()
+{
+    return msys_state_machine.curr_state;
+}
+
+uint32_t msys_evt_overflows()
+{
+    return evt_overflows;
+}
+
+uint32_t msys_evt_pending()
+{
+    return k_msgq_num_used_get(&msys_evt_queue);
+}
+
+const char *msys_state_name(uint8_t state)
+{
+    if (state >= ARRAY_SIZE(state_func_entry))
+        return "?";
+    return state_func_entry[state].name;
+}
+
+uint8_t msys_get_history(struct msys_transition *out, uint8_t max)
+{
+    k_spinlock_key_t key = k_spin_lock(&history_lock);
+    uint32_t n = MIN(MIN(history_count, MSYS_HISTORY_LEN), max);
+
+    for (uint32_t i = 0; i < n; i++)
+        out[i] = history[(history_count - n + i) % MSYS_HISTORY_LEN];
+    k_spin_unlock(&history_lock, key);
+
+    return n;
+}
+
 void msys_thread()
 {
     LOG_DBG("Sys thread started");
 
     event_t evt = E_ANY;
-    state_machine_t msys_state_machine;
+    state_t prev_state;
 
     msys_state_machine.curr_state = S_PRE_INIT;
     int ret = 0;
+    bool booted = false;
+    uint32_t step_start;
     while (1)
     {
-        ret = k_msgq_get(&msys_evt_queue, &evt, K_NO_WAIT);
+        step_start = k_cycle_get_32();
+        state_machine_iterate(&msys_state_machine, evt);
+
+        // let E_ANY rows run until the state settles, then sleep until
+        // the next event instead of ticking
+        for (uint8_t i = 0; i < MSYS_SETTLE_MAX_STEPS; i++)
+        {
+            prev_state = msys_state_machine.curr_state;
+            state_machine_iterate(&msys_state_machine, E_ANY);
+            if (msys_state_machine.curr_state == prev_state)
+                break;
+        }
+
+        // the boot steps load settings and bring up the radios, only the
+        // event driven steps after that have a budget
+        if (booted)
+            perf_budget_check(PERF_BUDGET_MSYS_STEP, k_cyc_to_us_floor32(k_cycle_get_32() - step_start));
+        booted = true;
+
+        ret = k_msgq_get(&msys_evt_queue, &evt, K_FOREVER);
         if (ret != 0)
             evt = E_ANY;
         else 
             LOG_DBG("msys evt rx %d", evt);
-        state_machine_iterate(&msys_state_machine, evt);
-
-        k_msleep(1);
-        //k_yield();
-        //LOG_DBG("tick");
     }
 }
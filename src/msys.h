@@ -1,6 +1,9 @@
 #ifndef SMSYS_H_
 #define SMSYS_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #define SYS_EVT_CONN_SUCCESS            2
 #define SYS_EVT_CONN_LOST               3
 #define SYS_EVT_INP_RED_DECISION        4
@@ -11,10 +14,30 @@
 #define SYS_EVT_CONFIG                  10
 #define SYS_EVT_CONFIG_END              11
 
+#define MSYS_HISTORY_LEN                16
+
+struct msys_transition {
+    uint32_t time_ms;
+    uint8_t from;
+    uint8_t to;
+    uint8_t evt;
+};
+
 int msys_init();
 int msys_run();
 
 int msys_signal_evt(uint8_t evt);
+// connected with nothing in progress, safe for background work on the link
+bool msys_in_idle_conn();
+// k_cycle_get_32() at the last decision button event
+uint32_t msys_decision_input_cycles();
+uint8_t msys_get_state();
+// events dropped because the queue stayed full
+uint32_t msys_evt_overflows();
+uint32_t msys_evt_pending();
+const char *msys_state_name(uint8_t state);
+// the last transitions, oldest first, returns how many were copied
+uint8_t msys_get_history(struct msys_transition *history, uint8_t max);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,61 @@
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/printk.h>
+#include <stdarg.h>
+
+#include "owlcms_topics.h"
+#include "settings_util.h"
+
+#define DECISION_TOPIC_BASE             "owlcms/decision/"
+#define STARTUP_TOPIC_BASE              "owlcms/led/"
+#define SUMMON_TOPIC_BASE               "owlcms/summon/"
+#define DECISION_REQ_TOPIC_BASE         "owlcms/decisionRequest/"
+#define RELAY_TOPIC_BASE                "owlcms/relay/"
+// echoed straight back, for measuring receive latency from the broker
+#define PING_TOPIC_BASE                 "owlcms/ping/"
+#define PONG_TOPIC_BASE                 "owlcms/pong/"
+// box diagnostics, owlcms/diag/<platform>/<ref>/<kind>
+#define DIAG_TOPIC_BASE                 "owlcms/diag/"
+
+// the longest topics with the longest platform name the settings can hold
+// and a one digit referee number, snprintk would cut them short otherwise
+BUILD_ASSERT(sizeof(DIAG_TOPIC_BASE) + (SETTING_TYPE_STR_MAXLEN - 1) + sizeof("/7/journal/get") - 1
+                <= OWLCMS_TOPIC_MAX_LEN, "diag topics don't fit OWLCMS_TOPIC_MAX_LEN");
+BUILD_ASSERT(sizeof(DECISION_REQ_TOPIC_BASE) + (SETTING_TYPE_STR_MAXLEN - 1) <= OWLCMS_TOPIC_MAX_LEN,
+                "owlcms topics don't fit OWLCMS_TOPIC_MAX_LEN");
+
+static int topic_fmt(char *topic, const char *fmt, ...)
+{
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintk(topic, OWLCMS_TOPIC_MAX_LEN, fmt, args);
+    va_end(args);
+
+    return (len < OWLCMS_TOPIC_MAX_LEN) ? 0 : -ENAMETOOLONG;
+}
+
+int owlcms_topics_build(struct owlcms_topics *t, const char *platform, uint8_t ref)
+{
+    int ret = 0;
+
+    ret |= topic_fmt(t->decision, "%s%s", DECISION_TOPIC_BASE, platform);
+    ret |= topic_fmt(t->relay, "%s%s", RELAY_TOPIC_BASE, platform);
+    ret |= topic_fmt(t->pong, "%s%s/%d", PONG_TOPIC_BASE, platform, ref);
+    ret |= topic_fmt(t->diag_energy, "%s%s/%d/energy", DIAG_TOPIC_BASE, platform, ref);
+    ret |= topic_fmt(t->diag_battery, "%s%s/%d/battery", DIAG_TOPIC_BASE, platform, ref);
+    ret |= topic_fmt(t->diag_log, "%s%s/%d/log", DIAG_TOPIC_BASE, platform, ref);
+    ret |= topic_fmt(t->diag_health, "%s%s/%d/health", DIAG_TOPIC_BASE, platform, ref);
+    ret |= topic_fmt(t->journal, "%s%s/%d/journal", DIAG_TOPIC_BASE, platform, ref);
+    ret |= topic_fmt(t->shell_out, "%s%s/%d/shell/out", DIAG_TOPIC_BASE, platform, ref);
+
+    ret |= topic_fmt(t->startup, "%s%s", STARTUP_TOPIC_BASE, platform);
+    ret |= topic_fmt(t->summon, "%s%s/%d", SUMMON_TOPIC_BASE, platform, ref);
+    ret |= topic_fmt(t->decision_req, "%s%s/%d", DECISION_REQ_TOPIC_BASE, platform, ref);
+    ret |= topic_fmt(t->ping, "%s%s/%d", PING_TOPIC_BASE, platform, ref);
+    ret |= topic_fmt(t->log_level, "%s%s/%d/loglevel", DIAG_TOPIC_BASE, platform, ref);
+    ret |= topic_fmt(t->journal_get, "%s%s/%d/journal/get", DIAG_TOPIC_BASE, platform, ref);
+    ret |= topic_fmt(t->shell, "%s%s/%d/shell", DIAG_TOPIC_BASE, platform, ref);
+
+    return ret;
+}
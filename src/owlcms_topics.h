@@ -0,0 +1,39 @@
+#ifndef OWLCMS_TOPICS_H_
+#define OWLCMS_TOPICS_H_
+
+#include <stdint.h>
+
+/*
+*   The MQTT topics of one referee box, owlcms/<kind>/<platform>[/<ref>] for
+*   the ones OWLCMS uses and owlcms/diag/<platform>/<ref>/<kind> for the box
+*   diagnostics. Built once per platform and referee number change, the
+*   publish paths only read them.
+*/
+
+#define OWLCMS_TOPIC_MAX_LEN            64
+
+struct owlcms_topics {
+    // published
+    char decision[OWLCMS_TOPIC_MAX_LEN];
+    char relay[OWLCMS_TOPIC_MAX_LEN];
+    char pong[OWLCMS_TOPIC_MAX_LEN];
+    char diag_energy[OWLCMS_TOPIC_MAX_LEN];
+    char diag_battery[OWLCMS_TOPIC_MAX_LEN];
+    char diag_log[OWLCMS_TOPIC_MAX_LEN];
+    char diag_health[OWLCMS_TOPIC_MAX_LEN];
+    char journal[OWLCMS_TOPIC_MAX_LEN];
+    char shell_out[OWLCMS_TOPIC_MAX_LEN];
+    // subscribed
+    char startup[OWLCMS_TOPIC_MAX_LEN];
+    char summon[OWLCMS_TOPIC_MAX_LEN];
+    char decision_req[OWLCMS_TOPIC_MAX_LEN];
+    char ping[OWLCMS_TOPIC_MAX_LEN];
+    char log_level[OWLCMS_TOPIC_MAX_LEN];
+    char journal_get[OWLCMS_TOPIC_MAX_LEN];
+    char shell[OWLCMS_TOPIC_MAX_LEN];
+};
+
+// -ENAMETOOLONG if a topic would have been cut short, the rest are still built
+int owlcms_topics_build(struct owlcms_topics *topics, const char *platform, uint8_t ref);
+
+#endif
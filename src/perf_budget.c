@@ -0,0 +1,49 @@
+#include <logging/log.h>
+
+LOG_MODULE_REGISTER(perf_budget, CONFIG_APP_LOG_LEVEL);
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/__assert.h>
+
+#include "perf_budget.h"
+
+// after the first overrun of a budget only every Nth is logged
+#define PERF_BUDGET_LOG_EVERY       16
+
+static const struct {
+    const char *name;
+    uint32_t limit;
+} budgets[] = {
+    [PERF_BUDGET_DECISION]      = {"decision us",       CONFIG_PERF_BUDGET_DECISION_US},
+    [PERF_BUDGET_MSYS_STEP]     = {"msys step us",      CONFIG_PERF_BUDGET_MSYS_STEP_US},
+    [PERF_BUDGET_DECISION_HEAP] = {"decision allocs",   0}
+};
+BUILD_ASSERT(ARRAY_SIZE(budgets) == PERF_BUDGET_COUNT, "a budget is missing its limit");
+
+static atomic_t overruns[PERF_BUDGET_COUNT];
+
+bool perf_budget_check(enum perf_budget_id id, uint32_t value)
+{
+    if (value <= budgets[id].limit)
+        return true;
+
+    atomic_val_t n = atomic_inc(&overruns[id]);
+    if ((n % PERF_BUDGET_LOG_EVERY) == 0)
+        LOG_WRN("%s over budget: %u > %u (%u overruns)", budgets[id].name, value,
+                    budgets[id].limit, (uint32_t)n + 1);
+
+#if defined(CONFIG_PERF_BUDGET_FATAL)
+    __ASSERT(false, "%s over budget: %u > %u", budgets[id].name, value, budgets[id].limit);
+#endif
+    return false;
+}
+
+uint32_t perf_budget_overruns(enum perf_budget_id id)
+{
+    return atomic_get(&overruns[id]);
+}
+
+uint32_t perf_budget_limit(enum perf_budget_id id)
+{
+    return budgets[id].limit;
+}
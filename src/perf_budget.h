@@ -0,0 +1,33 @@
+#ifndef PERF_BUDGET_H_
+#define PERF_BUDGET_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+*   Timing and memory budgets for the paths that matter at a meet, checked
+*   in the firmware on every pass rather than in a separate test build. An
+*   overrun is counted and logged (rate limited), and with
+*   CONFIG_PERF_BUDGET_FATAL it asserts so a bench or native_posix run stops
+*   on the first regression. Budgets come from the "Performance budgets"
+*   Kconfig menu.
+*
+*   DECISION        press signalled to publish handed to the socket, us
+*   MSYS_STEP       one msys event including the E_ANY settle steps, us
+*   DECISION_HEAP   heap allocations by the comms thread during one decision
+*                   publish, count
+*/
+
+enum perf_budget_id {
+    PERF_BUDGET_DECISION,
+    PERF_BUDGET_MSYS_STEP,
+    PERF_BUDGET_DECISION_HEAP,
+    PERF_BUDGET_COUNT
+};
+
+// true when the value is within budget
+bool perf_budget_check(enum perf_budget_id id, uint32_t value);
+uint32_t perf_budget_overruns(enum perf_budget_id id);
+uint32_t perf_budget_limit(enum perf_budget_id id);
+
+#endif
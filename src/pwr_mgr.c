@@ -0,0 +1,112 @@
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(pwr_mgr, CONFIG_APP_LOG_LEVEL);
+
+#include <zephyr/zephyr.h>
+
+#include "pwr_mgr.h"
+#include "wifi_conn.h"
+
+static const char *profile_names[] = {"auto", "competition", "balanced", "standby"};
+
+static const uint8_t profile_ps_levels[] = {
+    [PWR_PROFILE_COMPETITION]   = WIFI_CONN_PS_NONE,
+    [PWR_PROFILE_BALANCED]      = WIFI_CONN_PS_MIN_MODEM,
+    [PWR_PROFILE_STANDBY]       = WIFI_CONN_PS_MAX_MODEM
+};
+
+static uint8_t selected_profile;
+static uint8_t active_profile;
+static bool link_up;
+// uptime of the last activity, or of the link coming up
+static int64_t active_since;
+static int64_t last_activity;
+
+static void evaluate_profile(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(evaluate_work, evaluate_profile);
+
+/*
+*   Everything is decided on the system workqueue so the msys, comms and
+*   MQTT threads only ever poke it; each pass reschedules itself for the
+*   next time auto would step down.
+*/
+static void evaluate_profile(struct k_work *work)
+{
+    int64_t now = k_uptime_get();
+    int64_t next_ms = 0;
+    uint8_t profile = selected_profile;
+
+    if (profile == PWR_PROFILE_AUTO)
+    {
+        int64_t idle_ms = now - MAX(active_since, last_activity);
+
+        if (!link_up)
+            profile = PWR_PROFILE_STANDBY;
+        else if (last_activity != 0 && now - last_activity < PWR_MGR_SESSION_HOLD_MS)
+        {
+            profile = PWR_PROFILE_COMPETITION;
+            next_ms = PWR_MGR_SESSION_HOLD_MS - (now - last_activity);
+        }
+        else if (idle_ms < PWR_MGR_STANDBY_IDLE_MS)
+        {
+            profile = PWR_PROFILE_BALANCED;
+            next_ms = PWR_MGR_STANDBY_IDLE_MS - idle_ms;
+        }
+        else
+            profile = PWR_PROFILE_STANDBY;
+    }
+
+    if (profile != active_profile)
+    {
+        LOG_INF("power profile %s -> %s", profile_names[active_profile], profile_names[profile]);
+        if (wifi_conn_set_power_save(profile_ps_levels[profile]) == 0)
+            active_profile = profile;
+    }
+
+    if (next_ms > 0)
+        k_work_reschedule(&evaluate_work, K_MSEC(next_ms));
+}
+
+int pwr_mgr_init(uint8_t profile)
+{
+    link_up = false;
+    last_activity = 0;
+    active_since = 0;
+    // forces the first pass to set the radio up
+    active_profile = PWR_PROFILE_AUTO;
+    pwr_mgr_set_profile(profile);
+    return 0;
+}
+
+void pwr_mgr_set_profile(uint8_t profile)
+{
+    if (profile > PWR_PROFILE_STANDBY)
+    {
+        LOG_WRN("unknown power profile %d, using auto", profile);
+        profile = PWR_PROFILE_AUTO;
+    }
+    LOG_INF("power profile set to %s", profile_names[profile]);
+    selected_profile = profile;
+    k_work_reschedule(&evaluate_work, K_NO_WAIT);
+}
+
+uint8_t pwr_mgr_get_profile()
+{
+    return active_profile;
+}
+
+void pwr_mgr_set_link(bool connected)
+{
+    if (connected == link_up)
+        return;
+    link_up = connected;
+    active_since = k_uptime_get();
+    k_work_reschedule(&evaluate_work, K_NO_WAIT);
+}
+
+void pwr_mgr_note_activity()
+{
+    last_activity = k_uptime_get();
+    if (active_profile != PWR_PROFILE_COMPETITION)
+        k_work_reschedule(&evaluate_work, K_NO_WAIT);
+}
@@ -0,0 +1,48 @@
+#ifndef PWR_MGR_H_
+#define PWR_MGR_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+*   WiFi power save profiles. Incoming summon and decisionRequest messages
+*   wait for the radio's next wakeup, so each profile trades battery for
+*   receive latency (beacon interval is usually 102.4ms):
+*
+*   competition - no modem sleep, latency is the network's own. With
+*                 bluetooth running the ESP32 coexistence needs modem sleep
+*                 and this falls back to balanced.
+*   balanced    - min modem sleep, wakes every DTIM, adds up to one DTIM
+*                 period (~100ms at DTIM 1, ~300ms at DTIM 3).
+*   standby     - max modem sleep, wakes every WIFI_CONN_LISTEN_INTERVAL
+*                 beacons, adds up to ~1s.
+*
+*   scripts/rx_latency.py measures the round trip against a local broker
+*   through the ping topic, run it once per profile.
+*/
+
+#define PWR_PROFILE_AUTO            0
+#define PWR_PROFILE_COMPETITION     1
+#define PWR_PROFILE_BALANCED        2
+#define PWR_PROFILE_STANDBY         3
+
+// in auto, competition holds this long after the last summon, decision
+// request or decision, then balanced until the standby timeout
+#ifndef PWR_MGR_SESSION_HOLD_MS
+#define PWR_MGR_SESSION_HOLD_MS     (5 * 60 * 1000)
+#endif
+#ifndef PWR_MGR_STANDBY_IDLE_MS
+#define PWR_MGR_STANDBY_IDLE_MS     (20 * 60 * 1000)
+#endif
+
+int pwr_mgr_init(uint8_t profile);
+// a fixed profile, or PWR_PROFILE_AUTO to follow msys
+void pwr_mgr_set_profile(uint8_t profile);
+// the profile in effect, never PWR_PROFILE_AUTO
+uint8_t pwr_mgr_get_profile();
+
+// msys state hooks for auto
+void pwr_mgr_set_link(bool connected);
+void pwr_mgr_note_activity();
+
+#endif
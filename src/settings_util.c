@@ -5,268 +5,528 @@ LOG_MODULE_REGISTER(settings_util, LOG_LEVEL_ERR);
 #include <string.h>
 
 #include <zephyr.h>
-#include <settings/settings.h>
-#include <zephyr/settings/settings.h>
 #include <zephyr/device.h>
-#include <string.h>
 #include <zephyr/drivers/flash.h>
 #include <zephyr/storage/flash_map.h>
 #include <zephyr/fs/nvs.h>
+#include <zephyr/sys/crc.h>
 #include <net/wifi_mgmt.h>
 
 #include "settings_util.h"
 
 
-#define SETTING_TYPE_UINT8              0
-#define SETTING_TYPE_STR                1
-#define SETTING_TYPE_UINT16             2
-
-#define SETTING_TYPE_STR_MAXLEN         32
-
-typedef struct setting_entry {
-    uint8_t id;
-    uint8_t type;
-    char *name;
-    void *data;
-    uint8_t data_len;
-} setting_entry_t;
-
-enum setting_ids {
-    SSID_ID,
-    SSID_LEN_ID,
-    PSK_ID,
-    PSK_LEN_ID,
-    MQTT_SRV_ID,
-    MQTT_SRV_LEN_ID,
-    MQTT_PORT_ID,
-    MQTT_CLIENT_NAME_ID,
-    MQTT_CLIENT_NAME_LEN_ID,
-    OWLCMS_PLATFORM_NAME_ID,
-    OWLCMS_PLATFORM_NAME_LEN_ID,
-    NUM_SETTINGS
-};
-
 
+/*
+*       Config record
+*
+*   All configuration lives in one packed, CRC protected record so boot is
+*   a single nvs_read and a BLE config write is a single nvs_write. New
+*   fields are only ever appended to config_payload; anything that changes
+*   the meaning of an existing field needs a schema version bump and a
+*   case in migrate_record().
+*/
 
-static setting_entry_t settings[] = {
-    {   .id = SSID_ID, 
-        .type = SETTING_TYPE_STR, 
-        .name = "ssid",
-        .data = NULL,
-        .data_len = SETTING_TYPE_STR_MAXLEN * sizeof(uint8_t)
-    },
-    {   .id = SSID_LEN_ID, 
-        .type = SETTING_TYPE_UINT8,
-        .name = "ssid_length", 
-        .data = NULL, 
-        .data_len = sizeof(uint8_t)
-    },
-    {   .id = PSK_ID, 
-        .type = SETTING_TYPE_STR, 
-        .name = "psk",
-        .data = NULL,
-        .data_len = SETTING_TYPE_STR_MAXLEN * sizeof(uint8_t)
-    },
-    {   .id = PSK_LEN_ID, 
-        .type = SETTING_TYPE_UINT8, 
-        .name = "psk_length",
-        .data = NULL,
-        .data_len = sizeof(uint8_t)
-    },
-    {
-        .id = MQTT_SRV_ID,
-        .type = SETTING_TYPE_STR,
-        .name = "mqtt_srv",
-        .data = NULL,
-        .data_len = SETTING_TYPE_STR_MAXLEN * sizeof(uint8_t)
-    },
-    {   .id = MQTT_SRV_LEN_ID, 
-        .type = SETTING_TYPE_UINT8,
-        .name = "mqtt_srv_length", 
-        .data = NULL, 
-        .data_len = sizeof(uint8_t)
-    },
-    {   .id = MQTT_PORT_ID, 
-        .type = SETTING_TYPE_UINT16,
-        .name = "mqtt_port", 
-        .data = NULL, 
-        .data_len = sizeof(uint16_t)
-    },
-    {
-        .id = MQTT_CLIENT_NAME_ID,
-        .type = SETTING_TYPE_STR,
-        .name = "mqtt_client_name",
-        .data = NULL,
-        .data_len = SETTING_TYPE_STR_MAXLEN * sizeof(uint8_t)
-    },
-    {   .id = MQTT_CLIENT_NAME_LEN_ID, 
-        .type = SETTING_TYPE_UINT8,
-        .name = "mqtt_client_name_length", 
-        .data = NULL, 
-        .data_len = sizeof(uint8_t)
-    },
-    {   .id = OWLCMS_PLATFORM_NAME_ID, 
-        .type = SETTING_TYPE_STR, 
-        .name = "platform",
-        .data = NULL,
-        .data_len = SETTING_TYPE_STR_MAXLEN * sizeof(uint8_t)
-    },
-    {   .id = OWLCMS_PLATFORM_NAME_LEN_ID, 
-        .type = SETTING_TYPE_UINT8,
-        .name = "platform", 
-        .data = NULL, 
-        .data_len = sizeof(uint8_t)
-    },
+#define CONFIG_RECORD_ID                32
+#define CONFIG_CANDIDATE_ID             33
+#define CONFIG_TRIAL_ID                 34
+#define CONFIG_RECORD_MAGIC             0x4F57
+#define CONFIG_SCHEMA_VERSION           1
+
+// boots a candidate gets to confirm itself before it's rolled back, covers
+// a candidate that crashes or resets the box before the deadline
+#ifndef SETTINGS_UTIL_MAX_TRIAL_BOOTS
+#define SETTINGS_UTIL_MAX_TRIAL_BOOTS   1
+#endif
+
+// the CA is large and rarely written, so it keeps its own entry and is only
+// read when TLS is actually in use
+#define MQTT_TLS_CA_ID                  13
+
+// what the box learns while running also stays out of the record, a cache
+// update then costs a few bytes of flash instead of a whole record and is
+// only written when the value actually changes
+#define BROKER_CACHE_ID                 40
+#define WIFI_CACHE_ID                   41
+#define PREFERRED_BROKER_ID             42
+
+struct config_payload {
+    char wifi_ssid[SETTING_TYPE_STR_MAXLEN];
+    char wifi_psk[SETTING_TYPE_STR_MAXLEN];
+    char mqtt_srv[SETTING_TYPE_STR_MAXLEN];
+    uint16_t mqtt_port;
+    uint8_t mqtt_tls_enabled;
+    char mqtt_tls_hostname[SETTING_TYPE_STR_MAXLEN];
+    struct mqtt_broker_settings mqtt_backup_brokers[SETTINGS_UTIL_MAX_BROKERS - 1];
+    uint8_t mqtt_failover_threshold;
+    // superseded by PREFERRED_BROKER_ID, only read once when that's missing
+    uint8_t mqtt_preferred_broker;
+    char owlcms_platform[SETTING_TYPE_STR_MAXLEN];
+    // superseded by BROKER_CACHE_ID, only read once when that's missing
+    struct settings_broker_cache mqtt_broker_cache;
+    uint8_t owlcms_ble_gateway;
+    // wifi_ssid/psk above always mirror network 0, for older firmware
+    struct settings_wifi_network wifi_networks[SETTINGS_UTIL_MAX_WIFI_NETWORKS];
+    // unused, joins aren't counted any more
+    uint32_t wifi_join_seq;
+    // superseded by WIFI_CACHE_ID, only read once when that's missing
+    struct settings_wifi_cache wifi_cache;
+    uint8_t owlcms_power_profile;
+    uint8_t owlcms_relay_key[SETTINGS_UTIL_RELAY_KEY_LEN];
+} __packed;
+
+struct config_record {
+    uint16_t magic;
+    uint16_t version;
+    uint16_t payload_len;
+    uint32_t crc;
+    struct config_payload payload;
+} __packed;
+
+// ids used before the packed record, only read once to migrate
+enum legacy_setting_ids {
+    LEGACY_SSID_ID = 0,
+    LEGACY_PSK_ID = 2,
+    LEGACY_MQTT_SRV_ID = 4,
+    LEGACY_MQTT_PORT_ID = 6,
+    LEGACY_MQTT_CLIENT_NAME_ID = 7,
+    LEGACY_OWLCMS_PLATFORM_NAME_ID = 9,
+    LEGACY_MQTT_TLS_ENABLED_ID = 11,
+    LEGACY_MQTT_TLS_HOSTNAME_ID = 12,
+    LEGACY_MQTT_BROKER_CACHE_ID = 14,
+    LEGACY_MQTT_BACKUP_BROKERS_ID = 15,
+    LEGACY_MQTT_FAILOVER_THRESHOLD_ID = 16,
+    LEGACY_MQTT_PREFERRED_BROKER_ID = 17,
+    LEGACY_NUM_SETTINGS
 };
 
-
 static struct nvs_fs fs;
 #define STORAGE_NODE_LABEL  storage
 
 /*
-static struct wifi_config_settings wifi_config = {
-    .ssid_length = 4,
-    .ssid = "abcde",
-    .psk_length = 4,
-    .psk = "abcde"
-};
+*   record is the configuration the box is running on. Provisioning writes
+*   go to candidate instead; once committed the candidate is booted on trial
+*   and only replaces the active record after it reaches the broker.
+*/
+static struct config_record record;
+static struct config_record candidate;
+static bool candidate_staged;
+static bool record_is_trial;
+// where the running record is written back, 0 once it's been superseded
+static uint16_t record_id = CONFIG_RECORD_ID;
+static struct k_mutex record_lock;
+static struct settings_broker_cache broker_cache;
+static struct settings_wifi_cache wifi_cache;
+static const struct settings_wifi_cache no_wifi_cache;
+static uint8_t preferred_broker;
+static const uint8_t primary_broker;
+
+static int load_record();
+static int migrate_record(struct config_record *rec, int read_len);
+static int migrate_legacy_settings();
+static void seed_wifi_networks(struct config_payload *p);
+static void load_caches();
+static int store_cache_entry(uint16_t id, void *cached, const void *value, size_t len);
+
+static uint32_t payload_crc(const struct config_record *rec)
+{
+    return crc32_ieee((const uint8_t *)&rec->payload, rec->payload_len);
+}
 
-int wifi_settings_handle_set(const char *name, size_t len,
-                             settings_read_cb read_cb, 
-                             void *cb_arg);
-int wifi_settings_handle_commit(void);
-int wifi_settings_handle_export(int (*cb)(const char *name, 
-                             const void *value,
-                             size_t val_len));
-
-struct settings_handler wifi_settings_handler = {
-    .name = "wifi_config",
-    .h_get = wifi_settings_handle_set,
-    .h_set = wifi_settings_handle_set
-};
+static void reset_record()
+{
+    memset(&record, 0, sizeof(record));
+    record.magic = CONFIG_RECORD_MAGIC;
+    record.version = CONFIG_SCHEMA_VERSION;
+    record.payload_len = sizeof(record.payload);
+}
 
-SETTINGS_STATIC_HANDLER_DEFINE(wifi_config, "wifi_config", NULL, wifi_settings_handle_set, NULL,NULL);
+// a box with nothing stored, e.g. a fresh native_posix flash file, starts
+// on the Kconfig seed instead of waiting for BLE provisioning
+static void seed_record()
+{
+#if defined(CONFIG_SETTINGS_UTIL_SEED)
+    struct config_payload *p = &record.payload;
+
+    strncpy(p->wifi_ssid, CONFIG_SETTINGS_UTIL_SEED_SSID, SETTING_TYPE_STR_MAXLEN - 1);
+    strncpy(p->wifi_psk, CONFIG_SETTINGS_UTIL_SEED_PSK, SETTING_TYPE_STR_MAXLEN - 1);
+    strncpy(p->wifi_networks[0].ssid, CONFIG_SETTINGS_UTIL_SEED_SSID, SETTING_TYPE_STR_MAXLEN - 1);
+    strncpy(p->wifi_networks[0].psk, CONFIG_SETTINGS_UTIL_SEED_PSK, SETTING_TYPE_STR_MAXLEN - 1);
+    strncpy(p->mqtt_srv, CONFIG_SETTINGS_UTIL_SEED_BROKER, SETTING_TYPE_STR_MAXLEN - 1);
+    p->mqtt_port = CONFIG_SETTINGS_UTIL_SEED_PORT;
+    strncpy(p->owlcms_platform, CONFIG_SETTINGS_UTIL_SEED_PLATFORM, SETTING_TYPE_STR_MAXLEN - 1);
+    LOG_INF("seeded config, broker %s platform %s", p->mqtt_srv, p->owlcms_platform);
+#endif
+}
 
-int wifi_settings_handle_set(const char *name, size_t len,
-                             settings_read_cb read_cb, 
-                             void *cb_arg)
+static int migrate_record(struct config_record *rec, int read_len)
 {
-    const char *next;
-    size_t next_len;
-    int ret;
+    int header_len = offsetof(struct config_record, payload);
 
-    LOG_INF("handle set %s", name);
-    next_len = settings_name_next(name, &next);
-    if (!next)
+    if (rec->magic != CONFIG_RECORD_MAGIC || read_len < header_len
+            || rec->payload_len > read_len - header_len)
     {
-        return -ENOENT;
+        return -EBADMSG;
     }
 
-    if (!strncmp(name, "ssid_length", next_len))
+    // written by newer firmware, we can't check the crc over fields we didn't read
+    if (rec->payload_len > sizeof(rec->payload))
     {
-        if (!next)
-        {
-            ret = read_cb(cb_arg, &wifi_config.ssid_length, sizeof(wifi_config.ssid_length));
-            return 0;
-        }
-        return -ENOENT;
+        LOG_ERR("config record from newer firmware (%d bytes)", rec->payload_len);
+        return -ENOTSUP;
     }
 
-    if (!strncmp(name, "ssid", next_len))
+    if (payload_crc(rec) != rec->crc)
     {
-        if (!next)
-        {
-            wifi_config.ssid = k_malloc(wifi_config.ssid_length * sizeof(char));
-            ret = read_cb(cb_arg, &wifi_config.ssid, wifi_config.ssid_length*sizeof(char));
-        }
+        LOG_ERR("config record crc mismatch");
+        return -EBADMSG;
+    }
+
+    switch (rec->version)
+    {
+    case CONFIG_SCHEMA_VERSION:
+        break;
+    default:
+        LOG_ERR("unknown config schema version %d", rec->version);
+        return -ENOTSUP;
+    }
+
+    // records written by older firmware are shorter, the appended fields
+    // they don't know about come up zeroed
+    if (rec->payload_len < sizeof(rec->payload))
+    {
+        memset((uint8_t *)&rec->payload + rec->payload_len, 0,
+                    sizeof(rec->payload) - rec->payload_len);
+    }
+    seed_wifi_networks(&rec->payload);
+    rec->payload_len = sizeof(rec->payload);
+    return 0;
+}
+
+// records from before the network table only have the one ssid/psk
+static void seed_wifi_networks(struct config_payload *p)
+{
+    if (p->wifi_networks[0].ssid[0] != 0 || p->wifi_ssid[0] == 0)
+        return;
+
+    strcpy(p->wifi_networks[0].ssid, p->wifi_ssid);
+    strcpy(p->wifi_networks[0].psk, p->wifi_psk);
+}
+
+static void read_legacy_setting(uint16_t id, void *data, size_t len)
+{
+    if (nvs_read(&fs, id, data, len) <= 0)
+        memset(data, 0, len);
+}
+
+static int migrate_legacy_settings()
+{
+    struct config_payload *p = &record.payload;
+    uint8_t legacy_probe;
+
+    // the platform name was always written, so it tells us whether this
+    // flash has ever held the old per-entry layout
+    if (nvs_read(&fs, LEGACY_OWLCMS_PLATFORM_NAME_ID, &legacy_probe, sizeof(legacy_probe)) <= 0)
         return -ENOENT;
+
+    LOG_INF("migrating legacy settings entries");
+    read_legacy_setting(LEGACY_SSID_ID, p->wifi_ssid, sizeof(p->wifi_ssid));
+    read_legacy_setting(LEGACY_PSK_ID, p->wifi_psk, sizeof(p->wifi_psk));
+    read_legacy_setting(LEGACY_MQTT_SRV_ID, p->mqtt_srv, sizeof(p->mqtt_srv));
+    read_legacy_setting(LEGACY_MQTT_PORT_ID, &p->mqtt_port, sizeof(p->mqtt_port));
+    read_legacy_setting(LEGACY_MQTT_TLS_ENABLED_ID, &p->mqtt_tls_enabled, sizeof(p->mqtt_tls_enabled));
+    read_legacy_setting(LEGACY_MQTT_TLS_HOSTNAME_ID, p->mqtt_tls_hostname, sizeof(p->mqtt_tls_hostname));
+    read_legacy_setting(LEGACY_MQTT_BACKUP_BROKERS_ID, p->mqtt_backup_brokers, sizeof(p->mqtt_backup_brokers));
+    read_legacy_setting(LEGACY_MQTT_FAILOVER_THRESHOLD_ID, &p->mqtt_failover_threshold, sizeof(p->mqtt_failover_threshold));
+    read_legacy_setting(LEGACY_MQTT_PREFERRED_BROKER_ID, &p->mqtt_preferred_broker, sizeof(p->mqtt_preferred_broker));
+    read_legacy_setting(LEGACY_OWLCMS_PLATFORM_NAME_ID, p->owlcms_platform, sizeof(p->owlcms_platform));
+    read_legacy_setting(LEGACY_MQTT_BROKER_CACHE_ID, &p->mqtt_broker_cache, sizeof(p->mqtt_broker_cache));
+
+    // make sure strings are terminated whatever the old entries held
+    p->wifi_ssid[sizeof(p->wifi_ssid) - 1] = 0;
+    p->wifi_psk[sizeof(p->wifi_psk) - 1] = 0;
+    p->mqtt_srv[sizeof(p->mqtt_srv) - 1] = 0;
+    p->mqtt_tls_hostname[sizeof(p->mqtt_tls_hostname) - 1] = 0;
+    p->owlcms_platform[sizeof(p->owlcms_platform) - 1] = 0;
+    seed_wifi_networks(p);
+
+    return 0;
+}
+
+static void delete_legacy_settings()
+{
+    for (uint16_t id = 0; id < LEGACY_NUM_SETTINGS; id++)
+    {
+        if (id != MQTT_TLS_CA_ID)
+            nvs_delete(&fs, id);
     }
-    return -ENOENT;
 }
 
-int settings_util_init()
+static int write_record_to(uint16_t id, struct config_record *rec)
+{
+    int ret = 0;
+
+    rec->crc = payload_crc(rec);
+    // nvs_write skips the write if the stored record is identical
+    ret = nvs_write(&fs, id, rec, sizeof(*rec));
+    if (ret < 0)
+    {
+        LOG_ERR("failed to write config record %d, %d", id, ret);
+        return ret;
+    }
+    return 0;
+}
+
+static int write_record()
+{
+    if (record_id == 0)
+        return 0;
+
+    return write_record_to(record_id, &record);
+}
+
+static void discard_candidate()
+{
+    nvs_delete(&fs, CONFIG_CANDIDATE_ID);
+    nvs_delete(&fs, CONFIG_TRIAL_ID);
+}
+
+// the cached AP and preferred broker are indexes into the network and broker
+// tables, each goes when the table the box runs on changes. Call with
+// record_lock held.
+static void drop_stale_caches(const struct config_payload *next)
+{
+    const struct config_payload *p = &record.payload;
+
+    if (memcmp(p->wifi_networks, next->wifi_networks, sizeof(p->wifi_networks)) != 0)
+        store_cache_entry(WIFI_CACHE_ID, &wifi_cache, &no_wifi_cache, sizeof(wifi_cache));
+
+    if (strcmp(p->mqtt_srv, next->mqtt_srv) != 0 || p->mqtt_port != next->mqtt_port
+            || memcmp(p->mqtt_backup_brokers, next->mqtt_backup_brokers,
+                        sizeof(p->mqtt_backup_brokers)) != 0)
+    {
+        store_cache_entry(PREFERRED_BROKER_ID, &preferred_broker, &primary_broker,
+                            sizeof(preferred_broker));
+    }
+}
+
+static void load_candidate()
 {
     int ret = 0;
-    ret = settings_subsys_init();
-    //settings_register(&wifi_settings_handler);
-    LOG_INF("settings util init ret %d", ret);
+    uint8_t trial_boots = 0;
+
+    ret = nvs_read(&fs, CONFIG_CANDIDATE_ID, &candidate, sizeof(candidate));
+    if (ret <= 0)
+        return;
+
+    if (migrate_record(&candidate, ret) != 0)
+    {
+        LOG_ERR("discarding unreadable candidate config");
+        discard_candidate();
+        return;
+    }
+
+    if (nvs_read(&fs, CONFIG_TRIAL_ID, &trial_boots, sizeof(trial_boots)) <= 0)
+        trial_boots = 0;
+
+    if (trial_boots >= SETTINGS_UTIL_MAX_TRIAL_BOOTS)
+    {
+        LOG_ERR("candidate config never confirmed, rolling back");
+        discard_candidate();
+        return;
+    }
+
+    trial_boots++;
+    nvs_write(&fs, CONFIG_TRIAL_ID, &trial_boots, sizeof(trial_boots));
+
+    drop_stale_caches(&candidate.payload);
+    memcpy(&record, &candidate, sizeof(record));
+    record_is_trial = true;
+    record_id = CONFIG_CANDIDATE_ID;
+    LOG_INF("running candidate config on trial (boot %d)", trial_boots);
 }
 
-int settings_util_load_wifi_config(struct wifi_connect_req_params *params)
+// provisioning setters edit a copy of the running config
+static struct config_payload *stage_candidate()
+{
+    if (!candidate_staged)
+    {
+        memcpy(&candidate, &record, sizeof(candidate));
+        candidate_staged = true;
+    }
+    return &candidate.payload;
+}
+
+static int load_record()
 {
     int ret = 0;
-    ret = settings_load();
-    LOG_INF("settings load ret %d", ret);
-    params->ssid_length = wifi_config.ssid_length;
-    params->psk_length = wifi_config.psk_length;
-    params->ssid = k_malloc(params->ssid_length*sizeof(uint8_t));
-    params->psk = k_malloc(params->psk_length*sizeof(uint8_t));
+
+    LOG_DBG("load config record");
+    ret = nvs_read(&fs, CONFIG_RECORD_ID, &record, sizeof(record));
+    if (ret > 0 && migrate_record(&record, ret) == 0)
+    {
+        load_caches();
+        load_candidate();
+        return 0;
+    }
+
+    reset_record();
+    if (migrate_legacy_settings() != 0)
+    {
+        LOG_DBG("no stored config, creating empty record");
+        seed_record();
+    }
+
+    ret = write_record();
+    if (ret == 0)
+        delete_legacy_settings();
+
+    load_caches();
+    load_candidate();
+    return ret;
 }
 
-int settings_util_set_wifi_ssid(const char *ssid, uint8_t len)
+// boxes upgraded from firmware that kept the cache in the record start from
+// the record's copy
+static void load_cache_entry(uint16_t id, void *cached, const void *legacy, size_t len)
+{
+    if (nvs_read(&fs, id, cached, len) != len)
+        memcpy(cached, legacy, len);
+}
+
+static void load_caches()
+{
+    load_cache_entry(BROKER_CACHE_ID, &broker_cache, &record.payload.mqtt_broker_cache,
+                        sizeof(broker_cache));
+    load_cache_entry(WIFI_CACHE_ID, &wifi_cache, &record.payload.wifi_cache, sizeof(wifi_cache));
+    load_cache_entry(PREFERRED_BROKER_ID, &preferred_broker, &record.payload.mqtt_preferred_broker,
+                        sizeof(preferred_broker));
+}
+
+// call with record_lock held
+static int store_cache_entry(uint16_t id, void *cached, const void *value, size_t len)
 {
     int ret = 0;
-    ret = settings_save_one("wifi_config/ssid_length", (const void *)&len, sizeof(len));
-    LOG_INF("settings save one ssid len: %d, ret %d", len, ret);
+
+    if (memcmp(cached, value, len) == 0)
+        return 0;
+
+    memcpy(cached, value, len);
+    ret = nvs_write(&fs, id, value, len);
+    if (ret < 0)
+    {
+        LOG_ERR("failed to write cache %d, %d", id, ret);
+        return ret;
+    }
+    return 0;
 }
-*/
 
-void load_or_create_settings();
-void write_empty_setting(setting_entry_t *entry);
-void save_setting(uint8_t setting_id);
+int settings_util_commit_candidate()
+{
+    int ret = 0;
+    uint8_t trial_boots = 0;
+
+    k_mutex_lock(&record_lock, K_FOREVER);
+    if (!candidate_staged)
+    {
+        k_mutex_unlock(&record_lock);
+        return 0;
+    }
+
+    ret = write_record_to(CONFIG_CANDIDATE_ID, &candidate);
+    if (ret == 0)
+    {
+        nvs_write(&fs, CONFIG_TRIAL_ID, &trial_boots, sizeof(trial_boots));
+        candidate_staged = false;
+        // a trial record being replaced mustn't be written over the new candidate
+        if (record_is_trial)
+            record_id = 0;
+    }
+    k_mutex_unlock(&record_lock);
+
+    LOG_INF("candidate config committed (%d)", ret);
+    return ret;
+}
 
-void write_empty_setting(setting_entry_t *entry)
+int settings_util_activate_candidate()
 {
     int ret = 0;
+    uint8_t trial_boots = 1;
 
-    // if (entry->type == SETTING_TYPE_UINT8)
-    // {
-    //     entry->data = (uint8_t)0;
-    // }
-    // else if (entry->type == SETTING_TYPE_STR)
-    // {
-    //     for (uint8_t i = 0; i < entry->data_len; i++)
-    //     {
-    //         memset(entry->data, 0, entry->data_len);
-    //     }
-    // }
-    // else if (entry->type == SETTING_TYPE_UINT16)
-    // {
-    //     entry->data = (uint16_t)0;
-    // }
+    k_mutex_lock(&record_lock, K_FOREVER);
+    ret = nvs_read(&fs, CONFIG_CANDIDATE_ID, &candidate, sizeof(candidate));
+    if (ret <= 0 || migrate_record(&candidate, ret) != 0)
+    {
+        k_mutex_unlock(&record_lock);
+        return -ENOENT;
+    }
 
-    memset(entry->data, 0, entry->data_len);
+    // counts as the trial boot, so a reset before confirmation rolls back
+    nvs_write(&fs, CONFIG_TRIAL_ID, &trial_boots, sizeof(trial_boots));
+    drop_stale_caches(&candidate.payload);
+    memcpy(&record, &candidate, sizeof(record));
+    record_is_trial = true;
+    record_id = CONFIG_CANDIDATE_ID;
+    k_mutex_unlock(&record_lock);
 
-    nvs_write(&fs, entry->id, entry->data, entry->data_len);
+    LOG_INF("running candidate config on trial (live)");
+    return 0;
 }
 
-void save_setting(uint8_t setting_id)
+bool settings_util_config_in_trial()
 {
-    if (setting_id < NUM_SETTINGS)
+    return record_is_trial;
+}
+
+int settings_util_confirm_config()
+{
+    int ret = 0;
+
+    k_mutex_lock(&record_lock, K_FOREVER);
+    if (!record_is_trial || record_id != CONFIG_CANDIDATE_ID)
     {
-        nvs_write(&fs, settings[setting_id].id, settings[setting_id].data,
-                        settings[setting_id].data_len);
+        k_mutex_unlock(&record_lock);
+        return 0;
     }
+
+    ret = write_record_to(CONFIG_RECORD_ID, &record);
+    if (ret == 0)
+    {
+        discard_candidate();
+        record_is_trial = false;
+        record_id = CONFIG_RECORD_ID;
+        LOG_INF("candidate config confirmed");
+    }
+    k_mutex_unlock(&record_lock);
+
+    return ret;
 }
 
-void load_or_create_settings()
+int settings_util_rollback_config()
 {
     int ret = 0;
 
-    LOG_DBG("check for settings");
-    for (uint8_t i = 0; i < NUM_SETTINGS; i++)
+    k_mutex_lock(&record_lock, K_FOREVER);
+    if (!record_is_trial)
     {
-        if (settings[i].data == NULL)
-        {
-            settings[i].data = k_malloc(settings[i].data_len);
-        }
-        ret = nvs_read(&fs, settings[i].id, settings[i].data, settings[i].data_len);
-        if (ret <= 0)
-        {
-            LOG_DBG("creating new setting entry for %s, ret %d", settings[i].name, ret); 
-            write_empty_setting(&settings[i]);
-        }
+        k_mutex_unlock(&record_lock);
+        return 0;
     }
+
+    discard_candidate();
+    record_is_trial = false;
+    record_id = CONFIG_RECORD_ID;
+
+    ret = nvs_read(&fs, CONFIG_RECORD_ID, &record, sizeof(record));
+    if (ret <= 0 || migrate_record(&record, ret) != 0)
+        reset_record();
+    // rollbacks are rare, rather than keep the trial's tables around to
+    // compare just rescan once and start on the primary
+    store_cache_entry(WIFI_CACHE_ID, &wifi_cache, &no_wifi_cache, sizeof(wifi_cache));
+    store_cache_entry(PREFERRED_BROKER_ID, &preferred_broker, &primary_broker, sizeof(preferred_broker));
+    k_mutex_unlock(&record_lock);
+
+    LOG_INF("rolled back to last known good config");
+    return 0;
 }
 
 int settings_util_init()
@@ -275,6 +535,8 @@ int settings_util_init()
     struct flash_pages_info info;
 
     LOG_DBG("init");
+    k_mutex_init(&record_lock);
+
     fs.flash_device = FLASH_AREA_DEVICE(STORAGE_NODE_LABEL);
     if (!device_is_ready(fs.flash_device))
     {
@@ -300,108 +562,254 @@ int settings_util_init()
         LOG_ERR("Flash init failed %d", ret);
         return -EIO;
     }
-    
-    load_or_create_settings();
 
-    return 0;
+    return load_record();
 }
 
 int settings_util_load_wifi_config(struct wifi_config_settings *params)
 {
-    //LOG_DBG("loading wifi params from settings");
-    //memcpy(params->ssid_length, settings[SSID_LEN_ID].data, settings[SSID_LEN_ID].data_len);
-    //LOG_DBG("here");
-    //memcpy(params->psk_length, settings[PSK_LEN_ID].data, settings[PSK_LEN_ID].data_len);
-    if (params->ssid == NULL)
-    {
-        params->ssid = k_malloc(sizeof(uint8_t) * SETTING_TYPE_STR_MAXLEN);
-    }
+    // the caller owns both buffers, SETTING_TYPE_STR_MAXLEN each
+    if (params->ssid == NULL || params->psk == NULL)
+        return -EINVAL;
+
+    k_mutex_lock(&record_lock, K_FOREVER);
+    strcpy(params->ssid, record.payload.wifi_ssid);
+    strcpy(params->psk, record.payload.wifi_psk);
+    k_mutex_unlock(&record_lock);
+
+    params->ssid_length = strlen(params->ssid);
+    params->psk_length = strlen(params->psk);
+    return 0;
+}
+
+int settings_util_set_wifi_ssid(const char *ssid, uint8_t len)
+{
+    if (ssid == NULL)
+        return -EINVAL;
+
+    k_mutex_lock(&record_lock, K_FOREVER);
+    strncpy(stage_candidate()->wifi_ssid, ssid, SETTING_TYPE_STR_MAXLEN - 1);
+    strncpy(stage_candidate()->wifi_networks[0].ssid, ssid, SETTING_TYPE_STR_MAXLEN - 1);
+    k_mutex_unlock(&record_lock);
+
+    return 0;
+}
+
+int settings_util_set_wifi_psk(const char *psk, uint8_t len)
+{
+    if (psk == NULL)
+        return -EINVAL;
+
+    k_mutex_lock(&record_lock, K_FOREVER);
+    strncpy(stage_candidate()->wifi_psk, psk, SETTING_TYPE_STR_MAXLEN - 1);
+    strncpy(stage_candidate()->wifi_networks[0].psk, psk, SETTING_TYPE_STR_MAXLEN - 1);
+    k_mutex_unlock(&record_lock);
+
+    return 0;
+}
+
+int settings_util_load_wifi_networks(struct settings_wifi_network *networks)
+{
+    if (networks == NULL)
+        return -EINVAL;
+
+    k_mutex_lock(&record_lock, K_FOREVER);
+    memcpy(networks, record.payload.wifi_networks, sizeof(record.payload.wifi_networks));
+    k_mutex_unlock(&record_lock);
+    return 0;
+}
+
+int settings_util_set_wifi_networks(const struct settings_wifi_network *networks)
+{
+    struct config_payload *p;
+
+    if (networks == NULL)
+        return -EINVAL;
 
-    if (params->psk == NULL)
+    k_mutex_lock(&record_lock, K_FOREVER);
+    p = stage_candidate();
+    for (int i = 0; i < SETTINGS_UTIL_MAX_WIFI_NETWORKS; i++)
     {
-        params->psk = k_malloc(sizeof(uint8_t) * SETTING_TYPE_STR_MAXLEN);
+        memcpy(&p->wifi_networks[i], &networks[i], sizeof(networks[i]));
+        p->wifi_networks[i].ssid[SETTING_TYPE_STR_MAXLEN - 1] = 0;
+        p->wifi_networks[i].psk[SETTING_TYPE_STR_MAXLEN - 1] = 0;
+        p->wifi_networks[i].last_success = 0;
     }
+    strcpy(p->wifi_ssid, p->wifi_networks[0].ssid);
+    strcpy(p->wifi_psk, p->wifi_networks[0].psk);
+    k_mutex_unlock(&record_lock);
+
+    return 0;
+}
+
+// a rejoin to the same AP writes nothing
+int settings_util_wifi_network_joined(uint8_t index, const uint8_t *bssid, uint8_t channel)
+{
+    struct settings_wifi_cache joined;
+    int ret = 0;
+
+    if (index >= SETTINGS_UTIL_MAX_WIFI_NETWORKS || bssid == NULL)
+        return -EINVAL;
 
-    //memcpy(params->ssid, settings[SSID_ID].data, params->ssid_length);
-    //memcpy(params->psk, settings[PSK_ID].data, params->psk_length);
+    memset(&joined, 0, sizeof(joined));
+    joined.network = index;
+    memcpy(joined.bssid, bssid, sizeof(joined.bssid));
+    joined.channel = channel;
 
-    strcpy(params->ssid, settings[SSID_ID].data);
-    strcpy(params->psk, settings[PSK_ID].data);
+    k_mutex_lock(&record_lock, K_FOREVER);
+    ret = store_cache_entry(WIFI_CACHE_ID, &wifi_cache, &joined, sizeof(wifi_cache));
+    k_mutex_unlock(&record_lock);
+
+    return ret;
 }
 
-int settings_util_set_wifi_ssid(const char *ssid, uint8_t len)
+int settings_util_load_wifi_cache(struct settings_wifi_cache *cache)
 {
-    //LOG_DBG("copy ssid");
-    //memcpy(settings[SSID_ID].data, ssid, len);
-    if (ssid != NULL)
-        strcpy(settings[SSID_ID].data, ssid);
-    //LOG_DBG("copy ssid_len: data: %d, len: %d", len, settings[SSID_LEN_ID].data_len);
-    //*settings[SSID_LEN_ID].data = len;
-    //memcpy(settings[SSID_LEN_ID].data, &len, settings[SSID_LEN_ID].data_len);
-    //printk("%d", (uint8_t *)settings[SSID_LEN_ID].data);
-    //LOG_DBG("save ssid");
-    save_setting(SSID_ID);
-    //LOG_DBG("save ssid_len");
-    save_setting(SSID_LEN_ID);
+    if (cache == NULL)
+        return -EINVAL;
+
+    k_mutex_lock(&record_lock, K_FOREVER);
+    memcpy(cache, &wifi_cache, sizeof(*cache));
+    k_mutex_unlock(&record_lock);
+    return 0;
 }
 
-int settings_util_set_wifi_psk(const char *psk, uint8_t len)
+int settings_util_clear_wifi_cache()
 {
-    //memcpy(settings[PSK_ID].data, psk, len);
-    if (psk != NULL)
-        strcpy(settings[PSK_ID].data, psk);
-    //*settings[PSK_LEN_ID].data = len;
-    //memcpy(settings[PSK_LEN_ID].data, &len, settings[PSK_LEN_ID].data_len);
-    save_setting(PSK_ID);
-    save_setting(PSK_LEN_ID);
+    int ret = 0;
+
+    k_mutex_lock(&record_lock, K_FOREVER);
+    ret = store_cache_entry(WIFI_CACHE_ID, &wifi_cache, &no_wifi_cache, sizeof(wifi_cache));
+    k_mutex_unlock(&record_lock);
+
+    return ret;
 }
 
 int settings_util_load_mqtt_config(struct mqtt_config_settings *params)
 {
-    if (params->broker_addr != NULL)
-        strcpy(params->broker_addr, settings[MQTT_SRV_ID].data);
-    memcpy(&(params->port), settings[MQTT_PORT_ID].data, sizeof(params->port));
-    
+    struct config_payload *p = &record.payload;
+
+    k_mutex_lock(&record_lock, K_FOREVER);
+    strcpy(params->broker_addr, p->mqtt_srv);
+    params->port = p->mqtt_port;
+    params->tls_enabled = p->mqtt_tls_enabled;
+    strcpy(params->tls_hostname, p->mqtt_tls_hostname);
+    memcpy(params->backup_brokers, p->mqtt_backup_brokers, sizeof(params->backup_brokers));
+    params->failover_threshold = p->mqtt_failover_threshold;
+    params->preferred_broker = preferred_broker;
+    k_mutex_unlock(&record_lock);
+
     return 0;
 }
 
 int settings_util_set_mqtt_config(struct mqtt_config_settings *params)
 {
-    /*
-    params->broker_addr = "10.0.0.7";
-    params->broker_addr_len = 8;
-    params->port = 1883;
-    params->client_name = "owlcms_ref_1";
-    params->client_name_len = 12;
-    */
-    strcpy(settings[MQTT_SRV_ID].data, params->broker_addr);
-    //settings[MQTT_PORT_ID].data = (uint16_t)params->port;
-    memcpy(settings[MQTT_PORT_ID].data, &(params->port), settings[MQTT_PORT_ID].data_len);
-
-    save_setting(MQTT_SRV_ID);
-    save_setting(MQTT_PORT_ID);
+    struct config_payload *p;
+
+    k_mutex_lock(&record_lock, K_FOREVER);
+    p = stage_candidate();
+    strncpy(p->mqtt_srv, params->broker_addr, SETTING_TYPE_STR_MAXLEN - 1);
+    p->mqtt_port = params->port;
+    p->mqtt_tls_enabled = params->tls_enabled;
+    strncpy(p->mqtt_tls_hostname, params->tls_hostname, SETTING_TYPE_STR_MAXLEN - 1);
+    memcpy(p->mqtt_backup_brokers, params->backup_brokers, sizeof(p->mqtt_backup_brokers));
+    p->mqtt_failover_threshold = params->failover_threshold;
+    k_mutex_unlock(&record_lock);
+
     return 0;
 }
 
+int settings_util_set_mqtt_preferred_broker(uint8_t index)
+{
+    int ret = 0;
+
+    if (index >= SETTINGS_UTIL_MAX_BROKERS)
+        return -EINVAL;
+
+    k_mutex_lock(&record_lock, K_FOREVER);
+    ret = store_cache_entry(PREFERRED_BROKER_ID, &preferred_broker, &index, sizeof(preferred_broker));
+    k_mutex_unlock(&record_lock);
+
+    return ret;
+}
+
+// the CA isn't part of the A/B records, it's written straight away
+int settings_util_set_mqtt_tls_ca(const uint8_t *ca, uint16_t len)
+{
+    int ret = 0;
+
+    if (ca == NULL || len > SETTINGS_UTIL_TLS_CA_MAXLEN)
+        return -EINVAL;
+
+    if (len == 0)
+        return nvs_delete(&fs, MQTT_TLS_CA_ID);
+
+    ret = nvs_write(&fs, MQTT_TLS_CA_ID, ca, len);
+    return (ret < 0) ? ret : 0;
+}
+
+int settings_util_load_mqtt_tls_ca(uint8_t *buf, uint16_t max_len)
+{
+    int ret = 0;
+
+    if (buf == NULL)
+        return -EINVAL;
+
+    ret = nvs_read(&fs, MQTT_TLS_CA_ID, buf, max_len);
+    if (ret == -ENOENT)
+        return 0;
+    if (ret > max_len)
+        return -EINVAL;
+
+    return ret;
+}
+
 int settings_util_load_owlcms_config(struct owlcms_config_settings *params)
 {
-    if (params->platform != NULL)
-        strcpy(params->platform, settings[OWLCMS_PLATFORM_NAME_ID].data);
-    
+    k_mutex_lock(&record_lock, K_FOREVER);
+    strcpy(params->platform, record.payload.owlcms_platform);
+    params->ble_gateway = record.payload.owlcms_ble_gateway;
+    params->power_profile = record.payload.owlcms_power_profile;
+    memcpy(params->relay_key, record.payload.owlcms_relay_key, SETTINGS_UTIL_RELAY_KEY_LEN);
+    k_mutex_unlock(&record_lock);
+
+    params->platform_len = strlen(params->platform);
     return 0;
 }
 
 int settings_util_set_owlcms_config(struct owlcms_config_settings *params)
 {
-    /*
-    if (params->platform == NULL)
-        params->platform = k_malloc(sizeof(uint8_t));
-    strcpy(params->platform, "A");
-    params->platform_len = 1;
-    */
-   strcpy(settings[OWLCMS_PLATFORM_NAME_ID].data, params->platform);
+    k_mutex_lock(&record_lock, K_FOREVER);
+    strncpy(stage_candidate()->owlcms_platform, params->platform, SETTING_TYPE_STR_MAXLEN - 1);
+    stage_candidate()->owlcms_ble_gateway = params->ble_gateway;
+    stage_candidate()->owlcms_power_profile = params->power_profile;
+    memcpy(stage_candidate()->owlcms_relay_key, params->relay_key, SETTINGS_UTIL_RELAY_KEY_LEN);
+    k_mutex_unlock(&record_lock);
 
-   save_setting(OWLCMS_PLATFORM_NAME_ID);
+    return 0;
+}
+
+int settings_util_set_broker_cache(const struct settings_broker_cache *cache)
+{
+    int ret = 0;
+
+    if (cache == NULL)
+        return -EINVAL;
+
+    k_mutex_lock(&record_lock, K_FOREVER);
+    ret = store_cache_entry(BROKER_CACHE_ID, &broker_cache, cache, sizeof(broker_cache));
+    k_mutex_unlock(&record_lock);
 
-   return 0;
-}
\ No newline at end of file
+    return ret;
+}
+
+int settings_util_load_broker_cache(struct settings_broker_cache *cache)
+{
+    if (cache == NULL)
+        return -EINVAL;
+
+    k_mutex_lock(&record_lock, K_FOREVER);
+    memcpy(cache, &broker_cache, sizeof(*cache));
+    k_mutex_unlock(&record_lock);
+    return 0;
+}
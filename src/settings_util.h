@@ -1,6 +1,7 @@
 #ifndef SETTINGS_UTIL_H_
 #define SETTINGS_UTIL_H_
 
+#include <stdbool.h>
 #include <net/wifi_mgmt.h>
 
 
@@ -11,27 +12,100 @@ struct wifi_config_settings {
     uint8_t psk_length;
 };
 
+#define SETTING_TYPE_STR_MAXLEN         32
+#define SETTINGS_UTIL_TLS_CA_MAXLEN     1024
+
+// primary broker plus this many backups, tried in order
+#define SETTINGS_UTIL_MAX_BROKERS       3
+
+struct mqtt_broker_settings {
+    char addr[32];
+    uint16_t port;
+};
+
 struct mqtt_config_settings {
     char broker_addr[32];
     uint8_t broker_addr_len;
     uint16_t port;
     char client_name[32];
     uint8_t client_name_len;
+    uint8_t tls_enabled;
+    char tls_hostname[32];
+    struct mqtt_broker_settings backup_brokers[SETTINGS_UTIL_MAX_BROKERS - 1];
+    uint8_t failover_threshold;
+    uint8_t preferred_broker;
 };
 
+// last resolved address for a broker hostname/discovery name, kept in NVS so
+// the next boot can connect without waiting on DNS or mDNS
+struct settings_broker_cache {
+    char name[32];
+    uint8_t addr[4];
+    uint16_t port;
+};
+
+#define SETTINGS_UTIL_MAX_WIFI_NETWORKS     4
+
+// an empty ssid is an unused slot
+struct settings_wifi_network {
+    char ssid[32];
+    char psk[32];
+    // higher wins, RSSI breaks ties
+    uint8_t priority;
+    // unused, kept so the config record layout doesn't change
+    uint32_t last_success;
+} __packed;
+
+// where the last good join was so a rejoin can skip the scan, channel 0
+// means nothing cached
+struct settings_wifi_cache {
+    uint8_t network;
+    uint8_t bssid[6];
+    uint8_t channel;
+} __packed;
+
+// shared by every box on a platform, authenticates relayed decisions
+#define SETTINGS_UTIL_RELAY_KEY_LEN     16
+
 struct owlcms_config_settings {
     char platform[32];
     uint8_t platform_len;
+    // relay decisions from boxes that lost wifi, over BLE
+    uint8_t ble_gateway;
+    // PWR_PROFILE_*, 0 follows msys
+    uint8_t power_profile;
+    // all zero until provisioned, the relay stays off without it
+    uint8_t relay_key[SETTINGS_UTIL_RELAY_KEY_LEN];
 };
 
 int settings_util_init();
 
+// the wifi/mqtt/owlcms setters stage a candidate config, committing it makes
+// the next boot run it on trial until it's confirmed or rolled back
+int settings_util_commit_candidate();
+// switch the running config over to a committed candidate without a reboot
+int settings_util_activate_candidate();
+bool settings_util_config_in_trial();
+int settings_util_confirm_config();
+int settings_util_rollback_config();
+
 int settings_util_load_wifi_config(struct wifi_config_settings *params);
 int settings_util_set_wifi_ssid(const char *ssid, uint8_t len);
 int settings_util_set_wifi_psk(const char *psk, uint8_t len);
+// the ssid/psk calls above are network 0 of this table
+int settings_util_load_wifi_networks(struct settings_wifi_network *networks);
+int settings_util_set_wifi_networks(const struct settings_wifi_network *networks);
+int settings_util_wifi_network_joined(uint8_t index, const uint8_t *bssid, uint8_t channel);
+int settings_util_load_wifi_cache(struct settings_wifi_cache *cache);
+int settings_util_clear_wifi_cache();
 
 int settings_util_set_mqtt_config(struct mqtt_config_settings *params);
 int settings_util_load_mqtt_config(struct mqtt_config_settings *params);
+int settings_util_set_mqtt_preferred_broker(uint8_t index);
+int settings_util_set_mqtt_tls_ca(const uint8_t *ca, uint16_t len);
+int settings_util_load_mqtt_tls_ca(uint8_t *buf, uint16_t max_len);
+int settings_util_set_broker_cache(const struct settings_broker_cache *cache);
+int settings_util_load_broker_cache(struct settings_broker_cache *cache);
 int settings_util_set_owlcms_config(struct owlcms_config_settings *params);
 int settings_util_load_owlcms_config(struct owlcms_config_settings *params);
 
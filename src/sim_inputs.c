@@ -0,0 +1,130 @@
+#include <zephyr/kernel.h>
+#include <zephyr/init.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/gpio/gpio_emul.h>
+#include <zephyr/drivers/adc.h>
+#include <zephyr/drivers/adc/adc_emul.h>
+#include <zephyr/shell/shell.h>
+#include <zephyr/logging/log.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cmdline.h"
+#include "soc.h"
+
+LOG_MODULE_REGISTER(sim_inputs, CONFIG_APP_LOG_LEVEL);
+
+/*
+ *   Host side stand-ins for the hardware inputs on native_posix. The DIP
+ *   switch and battery voltage come from the command line, the buttons are
+ *   pressed through the "sim" shell command so the io.c interrupt and
+ *   debounce path runs the same as on the board.
+ */
+
+#define SIM_BAT_DEFAULT_MV          3900
+
+static const struct gpio_dt_spec sim_btns[] = { GPIO_DT_SPEC_GET(DT_ALIAS(btn_usr), gpios),
+                                                GPIO_DT_SPEC_GET(DT_ALIAS(btn_red), gpios),
+                                                GPIO_DT_SPEC_GET(DT_ALIAS(btn_blk), gpios)};
+static const char *sim_btn_names[] = {"usr", "red", "blk"};
+
+static const struct gpio_dt_spec sim_id[] = {   GPIO_DT_SPEC_GET(DT_ALIAS(sw_id_0), gpios),
+                                                GPIO_DT_SPEC_GET(DT_ALIAS(sw_id_1), gpios),
+                                                GPIO_DT_SPEC_GET(DT_ALIAS(sw_id_2), gpios)};
+
+static const struct adc_dt_spec sim_bat = ADC_DT_SPEC_GET(DT_PATH(zephyr_user));
+
+static uint32_t sim_ref = 1;
+static uint32_t sim_bat_mv = SIM_BAT_DEFAULT_MV;
+
+static void add_sim_opts(void)
+{
+    static struct args_struct_t sim_opts[] = {
+        { .option = "ref", .name = "number", .type = 'u', .dest = &sim_ref,
+          .descript = "referee number as set on the DIP switch (0-7), default 1" },
+        { .option = "bat-mv", .name = "mv", .type = 'u', .dest = &sim_bat_mv,
+          .descript = "battery voltage in mV, default 3900" },
+        ARG_TABLE_ENDMARKER
+    };
+
+    native_add_command_line_opts(sim_opts);
+}
+NATIVE_TASK(add_sim_opts, PRE_BOOT_1, 10);
+
+static int sim_set_bat(uint32_t mv)
+{
+    // the ADC sees the battery through the 2:1 divider
+    return adc_emul_const_value_set(sim_bat.dev, sim_bat.channel_id, mv / 2);
+}
+
+// runs before main so io_get_dev_id() and the first battery sample see the values
+static int sim_inputs_init(const struct device *dev)
+{
+    ARG_UNUSED(dev);
+    int ret;
+
+    for (uint8_t i = 0; i < ARRAY_SIZE(sim_id); i++)
+    {
+        // gpio_emul only drives pins configured as inputs, io.c does the
+        // same again later
+        ret = gpio_pin_configure_dt(&sim_id[i], GPIO_INPUT);
+        if (ret == 0)
+            ret = gpio_emul_input_set(sim_id[i].port, sim_id[i].pin, (sim_ref >> i) & 1);
+        if (ret != 0)
+        {
+            LOG_ERR("Failed to set DIP switch pin %u, ret: %d", i, ret);
+            return ret;
+        }
+    }
+
+    ret = sim_set_bat(sim_bat_mv);
+    if (ret != 0)
+        LOG_ERR("Failed to set battery voltage, ret: %d", ret);
+
+    return ret;
+}
+SYS_INIT(sim_inputs_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+
+/*
+ *   Shell
+ */
+
+static int cmd_sim_btn(const struct shell *sh, size_t argc, char **argv)
+{
+    int level;
+
+    if (strcmp(argv[2], "press") == 0)
+        level = 1;
+    else if (strcmp(argv[2], "release") == 0)
+        level = 0;
+    else
+    {
+        shell_error(sh, "expected press or release");
+        return -EINVAL;
+    }
+
+    for (uint8_t i = 0; i < ARRAY_SIZE(sim_btns); i++)
+    {
+        if (strcmp(argv[1], sim_btn_names[i]) == 0)
+            return gpio_emul_input_set(sim_btns[i].port, sim_btns[i].pin, level);
+    }
+
+    shell_error(sh, "unknown button %s, expected usr, red or blk", argv[1]);
+    return -EINVAL;
+}
+
+static int cmd_sim_bat(const struct shell *sh, size_t argc, char **argv)
+{
+    int ret = sim_set_bat(strtoul(argv[1], NULL, 10));
+    if (ret != 0)
+        shell_error(sh, "failed to set battery voltage: %d", ret);
+    return ret;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sim_cmds,
+    SHELL_CMD_ARG(btn, NULL, "drive a button pin: btn <usr|red|blk> <press|release>", cmd_sim_btn, 3, 0),
+    SHELL_CMD_ARG(bat, NULL, "set the battery voltage: bat <mV>", cmd_sim_bat, 2, 0),
+    SHELL_SUBCMD_SET_END
+);
+SHELL_CMD_REGISTER(sim, &sim_cmds, "native_posix input simulation", NULL);
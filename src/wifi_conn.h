@@ -5,15 +5,51 @@
 #define WIFI_CONN_STATE_UP          1
 #define WIFI_CONN_STATE_DOWN        2
 
+#define WIFI_CONN_PS_NONE           0
+// wake for every DTIM beacon
+#define WIFI_CONN_PS_MIN_MODEM      1
+// wake every WIFI_CONN_LISTEN_INTERVAL beacons
+#define WIFI_CONN_PS_MAX_MODEM      2
+
 #include "settings_util.h"
 
+// best known network from one scan, and the AP to join it on
+struct wifi_conn_selection {
+    uint8_t network;
+    uint8_t bssid[6];
+    uint8_t channel;
+    int8_t rssi;
+};
+
+struct wifi_conn_roam_stats {
+    uint32_t scans;
+    uint32_t roams;
+    uint32_t failed;
+    int8_t last_rssi_before;
+    int8_t last_rssi_after;
+};
+
 int wifi_conn_init();
 
 void wifi_conn_connect();
 void wifi_conn_disconnect();
 void wifi_conn_reset();
 void wifi_conn_setup(struct wifi_config_settings *params);
+// pin the join to one AP, skips the connect time scan
+void wifi_conn_setup_ap(struct wifi_config_settings *params, const uint8_t *bssid, uint8_t channel);
+int wifi_conn_select_network(const struct settings_wifi_network *networks, uint8_t count,
+                                struct wifi_conn_selection *selection);
+int wifi_conn_get_ap(uint8_t *bssid, uint8_t *channel);
+int wifi_conn_set_power_save(uint8_t level);
+// RSSI of the associated AP in dBm, -ENOTCONN when not associated
+int wifi_conn_get_rssi(int8_t *rssi);
 
 void wifi_conn_set_net_state_cb(void (*cb)(uint8_t wifi_state, uint8_t net_state));
+// allowed_cb gates every roam scan, cb reports where a roam ended up (a
+// failed roam is also reported to net_state_cb as a drop)
+void wifi_conn_set_roam_cb(bool (*allowed_cb)(),
+                            void (*cb)(bool success, const uint8_t *bssid, uint8_t channel));
+void wifi_conn_get_roam_stats(struct wifi_conn_roam_stats *stats);
+int wifi_conn_get_signal(int8_t *rssi, uint8_t *channel);
 
 #endif
\ No newline at end of file
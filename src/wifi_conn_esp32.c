@@ -0,0 +1,631 @@
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(wifi_mod, CONFIG_APP_LOG_LEVEL);
+
+#include <zephyr/zephyr.h>
+#include <zephyr/sys/math_extras.h>
+
+#include <net/net_if.h>
+#include <net/net_core.h>
+#include <net/net_context.h>
+#include <net/wifi_mgmt.h>
+#include <net/net_mgmt.h>
+#include <net/ethernet_mgmt.h>
+#include <net/wifi.h>
+#include <net/net_event.h>
+
+#include <esp_wifi.h>
+#include <esp_event.h>
+#include <esp_timer.h>
+
+#include "wifi_conn.h"
+#include "settings_util.h"
+#include "energy_acct.h"
+
+#define IF_MGMT_EVENTS (NET_EVENT_IF_UP                    | \
+                        NET_EVENT_IF_DOWN)
+
+#define ETH_MGMT_EVENTS (NET_EVENT_ETHERNET_CARRIER_ON      | \
+                         NET_EVENT_ETHERNET_CARRIER_OFF)
+
+#define IP_MGMT_EVENTS (NET_EVENT_IPV4_DHCP_BOUND)
+
+// a hall can show a lot of APs, only this many strongest are considered
+#ifndef WIFI_CONN_MAX_SCAN_RESULTS
+#define WIFI_CONN_MAX_SCAN_RESULTS  16
+#endif
+
+// roaming, RSSI is sampled while associated and below the threshold a scan
+// for the same ssid looks for an AP at least the margin stronger
+#ifndef WIFI_CONN_ROAM_SAMPLE_MS
+#define WIFI_CONN_ROAM_SAMPLE_MS        10000
+#endif
+#ifndef WIFI_CONN_ROAM_RSSI_THRESHOLD
+#define WIFI_CONN_ROAM_RSSI_THRESHOLD   -70
+#endif
+#ifndef WIFI_CONN_ROAM_RSSI_MARGIN
+#define WIFI_CONN_ROAM_RSSI_MARGIN      8
+#endif
+// a failed scan or roam backs off this long before the next try
+#ifndef WIFI_CONN_ROAM_HOLDOFF_MS
+#define WIFI_CONN_ROAM_HOLDOFF_MS       60000
+#endif
+#ifndef WIFI_CONN_ROAM_TIMEOUT_MS
+#define WIFI_CONN_ROAM_TIMEOUT_MS       5000
+#endif
+// beacons between wakeups in max modem sleep, only read at association
+#ifndef WIFI_CONN_LISTEN_INTERVAL
+#define WIFI_CONN_LISTEN_INTERVAL       10
+#endif
+// per channel dwell, the station is back on its own channel between
+// channels so traffic isn't held off for a whole sweep
+#ifndef WIFI_CONN_ROAM_SCAN_DWELL_MS
+#define WIFI_CONN_ROAM_SCAN_DWELL_MS    60
+#endif
+// one channel scan that hasn't reported done by now is abandoned
+#ifndef WIFI_CONN_ROAM_SCAN_TIMEOUT_MS
+#define WIFI_CONN_ROAM_SCAN_TIMEOUT_MS  1000
+#endif
+// bit n for channel n, the venue's AP channels; the current channel and the
+// ones the network was seen on at join are always scanned as well
+#ifndef WIFI_CONN_ROAM_CHANNELS
+#define WIFI_CONN_ROAM_CHANNELS         (BIT(1) | BIT(6) | BIT(11))
+#endif
+#define WIFI_CONN_MAX_CHANNEL           14
+
+#define ROAM_THREAD_STACK_SIZE          2048
+#define ROAM_THREAD_PRIORITY            10
+
+static struct net_mgmt_event_callback if_mgmt_cb;
+static struct net_mgmt_event_callback eth_mgmt_cb;
+static struct net_mgmt_event_callback ip_mgmt_cb;
+static struct net_if *net_iface;
+
+static bool wifi_connected;
+static bool net_connected;
+
+static void net_mgmt_event_handler(struct net_mgmt_event_callback *cb,
+                                    uint32_t mgmt_event,
+                                    struct net_if *iface);
+static void handle_wifi_connect();
+static void handle_wifi_disconnect();
+static void handle_net_available();
+static void finish_roam(bool success);
+void wifi_conn_set_net_state_cb(void (*cb)(uint8_t wifi_state, uint8_t net_state));
+
+static void (*net_state_cb)(uint8_t wifi_state, uint8_t net_state);
+static bool (*roam_allowed_cb)();
+static void (*roam_cb)(bool success, const uint8_t *bssid, uint8_t channel);
+
+static wifi_ap_record_t scan_results[WIFI_CONN_MAX_SCAN_RESULTS];
+
+static bool roaming;
+static int8_t roam_rssi_before;
+static struct wifi_conn_roam_stats roam_stats;
+
+// a roam scan walks its channels one at a time, each started without
+// blocking and picked up again from the SCAN_DONE event
+static bool roam_scanning;
+static uint16_t roam_scan_pending;
+static uint16_t roam_seen_channels;
+static wifi_ap_record_t roam_current;
+static wifi_ap_record_t roam_target;
+static bool roam_target_found;
+
+// scans and the roam itself stay off the system workqueue
+static struct k_work_q roam_work_q;
+K_THREAD_STACK_DEFINE(roam_work_q_stack, ROAM_THREAD_STACK_SIZE);
+
+static void roam_sample(struct k_work *work);
+static void roam_timeout(struct k_work *work);
+static void roam_scan_done(struct k_work *work);
+static void roam_scan_timeout(struct k_work *work);
+static void roam_scan_next();
+static void roam_scan_finish();
+static void roam_scan_abort();
+static void scan_done_handler(void *arg, esp_event_base_t base, int32_t id, void *data);
+static K_WORK_DELAYABLE_DEFINE(roam_sample_work, roam_sample);
+static K_WORK_DELAYABLE_DEFINE(roam_timeout_work, roam_timeout);
+static K_WORK_DELAYABLE_DEFINE(roam_scan_timeout_work, roam_scan_timeout);
+static K_WORK_DEFINE(roam_scan_done_work, roam_scan_done);
+
+static void net_mgmt_event_handler(struct net_mgmt_event_callback *cb,
+                                    uint32_t mgmt_event,
+                                    struct net_if *iface)
+{
+    LOG_INF("net mgmt handler, evt:%d %d", mgmt_event, NET_EVENT_ETHERNET_CARRIER_ON);
+    switch (mgmt_event)
+    {
+    case NET_EVENT_IF_UP:
+        LOG_INF("if up evt");
+        handle_wifi_connect();
+        break;
+    case NET_EVENT_IF_DOWN:
+        LOG_INF("if dn evt");
+        handle_wifi_disconnect();
+        break;
+    case NET_EVENT_ETHERNET_CARRIER_ON:
+        handle_wifi_connect();
+        break;
+    case NET_EVENT_ETHERNET_CARRIER_OFF:
+        handle_wifi_disconnect();
+        break;
+    case NET_EVENT_IPV4_DHCP_BOUND:
+        handle_net_available();
+    default:
+        break;
+    }
+}
+
+static void handle_wifi_connect()
+{
+    LOG_INF("wifi connect evt");
+    k_work_reschedule_for_queue(&roam_work_q, &roam_sample_work, K_MSEC(WIFI_CONN_ROAM_SAMPLE_MS));
+    if (roaming)
+    {
+        finish_roam(true);
+        return;
+    }
+    net_state_cb(WIFI_CONN_STATE_UP, WIFI_CONN_STATE_NO_CHANGE);
+}
+
+static void handle_wifi_disconnect()
+{
+    LOG_INF("wifi disconnect evt");
+    // the drop from the old AP while roaming isn't a lost connection
+    if (roaming)
+        return;
+    k_work_cancel_delayable(&roam_sample_work);
+    k_work_cancel_delayable(&roam_scan_timeout_work);
+    if (roam_scanning)
+    {
+        roam_scanning = false;
+        esp_wifi_scan_stop();
+    }
+    net_state_cb(WIFI_CONN_STATE_DOWN, WIFI_CONN_STATE_DOWN);
+}
+
+static void handle_net_available()
+{
+    LOG_INF("wifi net ip bound evt");
+    net_connected = true;
+    while (net_if_ipv4_get_global_addr(net_iface,NET_ADDR_ANY_STATE) == NULL)
+    {
+        printk("dont have ip,waiting\n");
+        k_sleep(K_MSEC(1000));
+    }
+    net_state_cb(WIFI_CONN_STATE_NO_CHANGE, WIFI_CONN_STATE_UP);
+}
+
+int wifi_conn_init()
+{
+    wifi_connected = false;
+    net_connected = false;
+
+    // before the net mgmt callbacks, a connect event schedules roam sampling
+    k_work_queue_start(&roam_work_q, roam_work_q_stack,
+                        K_THREAD_STACK_SIZEOF(roam_work_q_stack),
+                        ROAM_THREAD_PRIORITY, NULL);
+    esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_SCAN_DONE, scan_done_handler, NULL);
+
+    net_mgmt_init_event_callback(&if_mgmt_cb, net_mgmt_event_handler,
+                                IF_MGMT_EVENTS);
+    net_mgmt_init_event_callback(&eth_mgmt_cb, net_mgmt_event_handler,
+                                ETH_MGMT_EVENTS);
+    net_mgmt_init_event_callback(&ip_mgmt_cb, net_mgmt_event_handler,
+                                IP_MGMT_EVENTS);
+    net_mgmt_add_event_callback(&if_mgmt_cb);
+    net_mgmt_add_event_callback(&eth_mgmt_cb);
+    net_mgmt_add_event_callback(&ip_mgmt_cb);
+
+    net_iface = net_if_get_default();
+    if (!net_iface) {
+        LOG_ERR("counld not get netif");
+        return -1;
+    }
+
+    net_dhcpv4_start(net_iface);
+
+    return 0;
+}
+
+void wifi_conn_disconnect(struct k_work *work)
+{
+    int ret = 0;
+    k_work_cancel_delayable(&roam_sample_work);
+    k_work_cancel_delayable(&roam_timeout_work);
+    k_work_cancel_delayable(&roam_scan_timeout_work);
+    if (roam_scanning)
+    {
+        roam_scanning = false;
+        esp_wifi_scan_stop();
+    }
+    roaming = false;
+    ret = esp_wifi_disconnect();
+
+}
+
+void wifi_conn_connect(struct k_work *work)
+{
+    esp_err_t ret;
+
+    ret = esp_wifi_connect();
+    if (ret != 0)
+    {
+        LOG_ERR("Failed to connect");
+    }
+}
+
+void wifi_conn_reset(struct k_work *work)
+{
+    esp_err_t ret;
+    ret = esp_wifi_set_mode(WIFI_MODE_STA);
+    if (ret != 0)
+    {
+        LOG_ERR("Failed to set wifi mode");
+    }
+
+}
+
+void wifi_conn_setup(struct wifi_config_settings *params)
+{
+    wifi_conn_setup_ap(params, NULL, 0);
+}
+
+void wifi_conn_setup_ap(struct wifi_config_settings *params, const uint8_t *bssid, uint8_t channel)
+{
+    esp_err_t ret;
+    wifi_config_t cfg = {
+        .sta = {
+            .ssid = " ",
+            .password = " "
+        }
+    };
+    strcpy(cfg.sta.ssid, params->ssid);
+    strcpy(cfg.sta.password, params->psk);
+    cfg.sta.listen_interval = WIFI_CONN_LISTEN_INTERVAL;
+    if (bssid != NULL)
+    {
+        cfg.sta.bssid_set = true;
+        memcpy(cfg.sta.bssid, bssid, sizeof(cfg.sta.bssid));
+        cfg.sta.channel = channel;
+    }
+    ret = esp_wifi_set_config(ESP_IF_WIFI_STA, &cfg);
+    if (ret != 0)
+    {
+        LOG_ERR("Failed to configure wifi");
+    }
+
+}
+
+/*
+*   One blocking scan of all channels, then the known network with the
+*   highest priority that's in range, RSSI breaking ties (and picking the AP
+*   when a network has several).
+*/
+int wifi_conn_select_network(const struct settings_wifi_network *networks, uint8_t count,
+                                struct wifi_conn_selection *selection)
+{
+    uint16_t num_results = ARRAY_SIZE(scan_results);
+    bool found = false;
+    esp_err_t ret;
+
+    ret = esp_wifi_scan_start(NULL, true);
+    if (ret != ESP_OK)
+    {
+        LOG_ERR("wifi scan failed: %d", ret);
+        return -EIO;
+    }
+    esp_wifi_scan_get_ap_records(&num_results, scan_results);
+
+    for (uint16_t i = 0; i < num_results; i++)
+    {
+        for (uint8_t n = 0; n < count; n++)
+        {
+            if (networks[n].ssid[0] == 0 || strcmp(networks[n].ssid, (const char *)scan_results[i].ssid) != 0)
+                continue;
+
+            if (found && (networks[n].priority < networks[selection->network].priority
+                    || (networks[n].priority == networks[selection->network].priority
+                        && scan_results[i].rssi <= selection->rssi)))
+                continue;
+
+            found = true;
+            selection->network = n;
+            memcpy(selection->bssid, scan_results[i].bssid, sizeof(selection->bssid));
+            selection->channel = scan_results[i].primary;
+            selection->rssi = scan_results[i].rssi;
+        }
+    }
+
+    if (!found)
+    {
+        LOG_WRN("no known network in range (%d APs seen)", num_results);
+        return -ENOENT;
+    }
+
+    // where else this network has APs, the channels a roam scan covers
+    roam_seen_channels = 0;
+    for (uint16_t i = 0; i < num_results; i++)
+    {
+        if (scan_results[i].primary <= WIFI_CONN_MAX_CHANNEL
+                && strcmp(networks[selection->network].ssid, (const char *)scan_results[i].ssid) == 0)
+            roam_seen_channels |= BIT(scan_results[i].primary);
+    }
+
+    LOG_INF("selected %s, channel %d rssi %d", networks[selection->network].ssid,
+                selection->channel, selection->rssi);
+    return 0;
+}
+
+int wifi_conn_get_ap(uint8_t *bssid, uint8_t *channel)
+{
+    wifi_ap_record_t ap_info;
+
+    if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK)
+        return -ENOTCONN;
+
+    memcpy(bssid, ap_info.bssid, sizeof(ap_info.bssid));
+    *channel = ap_info.primary;
+    return 0;
+}
+
+int wifi_conn_get_signal(int8_t *rssi, uint8_t *channel)
+{
+    wifi_ap_record_t ap_info;
+
+    if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK)
+        return -ENOTCONN;
+
+    *rssi = ap_info.rssi;
+    *channel = ap_info.primary;
+    return 0;
+}
+
+int wifi_conn_set_power_save(uint8_t level)
+{
+    wifi_ps_type_t ps = WIFI_PS_NONE;
+    uint8_t applied = level;
+    esp_err_t ret;
+
+    if (level == WIFI_CONN_PS_MIN_MODEM)
+        ps = WIFI_PS_MIN_MODEM;
+    else if (level == WIFI_CONN_PS_MAX_MODEM)
+        ps = WIFI_PS_MAX_MODEM;
+
+    ret = esp_wifi_set_ps(ps);
+    if (ret != ESP_OK && ps == WIFI_PS_NONE)
+    {
+        // coexistence with bluetooth won't run without modem sleep
+        LOG_WRN("no power save refused (%d), using min modem", ret);
+        ret = esp_wifi_set_ps(WIFI_PS_MIN_MODEM);
+        applied = WIFI_CONN_PS_MIN_MODEM;
+    }
+    if (ret != ESP_OK)
+    {
+        LOG_ERR("Failed to set power save %d: %d", level, ret);
+        return -EIO;
+    }
+    energy_acct_set_radio_mode(applied);
+    return 0;
+}
+
+int wifi_conn_get_rssi(int8_t *rssi)
+{
+    wifi_ap_record_t ap_info;
+
+    if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK)
+        return -ENOTCONN;
+
+    *rssi = ap_info.rssi;
+    return 0;
+}
+
+/*
+*   Roaming. The sample work runs while associated; once RSSI is under the
+*   threshold (and the owner says the box is idle) a scan for the same ssid
+*   looks for a stronger AP and the station is moved to it pinned by bssid.
+*   The scan covers the current channel, WIFI_CONN_ROAM_CHANNELS and the
+*   channels the network was seen on at join, one channel per non-blocking
+*   scan. The disconnect/connect in between is kept from net_state_cb, so
+*   MQTT stays up as long as DHCP hands back the same address.
+*/
+static void roam_sample(struct k_work *work)
+{
+    if (roam_scanning || esp_wifi_sta_get_ap_info(&roam_current) != ESP_OK)
+        return;
+
+    k_work_reschedule_for_queue(&roam_work_q, &roam_sample_work, K_MSEC(WIFI_CONN_ROAM_SAMPLE_MS));
+    if (roam_current.rssi >= WIFI_CONN_ROAM_RSSI_THRESHOLD)
+        return;
+    if (roam_allowed_cb == NULL || !roam_allowed_cb())
+        return;
+
+    roam_stats.scans++;
+    roam_scanning = true;
+    roam_target_found = false;
+    roam_scan_pending = (WIFI_CONN_ROAM_CHANNELS | roam_seen_channels | BIT(roam_current.primary))
+                            & BIT_MASK(WIFI_CONN_MAX_CHANNEL + 1) & ~BIT(0);
+    // sampling resumes once the scan is over
+    k_work_cancel_delayable(&roam_sample_work);
+    roam_scan_next();
+}
+
+static void roam_scan_abort()
+{
+    roam_scanning = false;
+    k_work_reschedule_for_queue(&roam_work_q, &roam_sample_work, K_MSEC(WIFI_CONN_ROAM_HOLDOFF_MS));
+}
+
+static void roam_scan_next()
+{
+    uint8_t channel;
+
+    if (roam_scan_pending == 0)
+    {
+        roam_scan_finish();
+        return;
+    }
+    // a press between channels wins, the rest of the sweep waits for the next sample
+    if (!roam_allowed_cb())
+    {
+        roam_scanning = false;
+        k_work_reschedule_for_queue(&roam_work_q, &roam_sample_work,
+                                    K_MSEC(WIFI_CONN_ROAM_SAMPLE_MS));
+        return;
+    }
+
+    channel = u32_count_trailing_zeros(roam_scan_pending);
+    roam_scan_pending &= ~BIT(channel);
+
+    wifi_scan_config_t scan_cfg = {
+        .ssid = roam_current.ssid,
+        .channel = channel,
+        .scan_type = WIFI_SCAN_TYPE_ACTIVE,
+        .scan_time.active.min = WIFI_CONN_ROAM_SCAN_DWELL_MS,
+        .scan_time.active.max = WIFI_CONN_ROAM_SCAN_DWELL_MS
+    };
+
+    if (esp_wifi_scan_start(&scan_cfg, false) != ESP_OK)
+    {
+        LOG_WRN("roam scan on channel %d failed to start", channel);
+        roam_scan_abort();
+        return;
+    }
+    k_work_reschedule_for_queue(&roam_work_q, &roam_scan_timeout_work,
+                                K_MSEC(WIFI_CONN_ROAM_SCAN_TIMEOUT_MS));
+}
+
+// from the wifi driver's event task, the results are read on the roam queue
+static void scan_done_handler(void *arg, esp_event_base_t base, int32_t id, void *data)
+{
+    if (roam_scanning)
+        k_work_submit_to_queue(&roam_work_q, &roam_scan_done_work);
+}
+
+static void roam_scan_done(struct k_work *work)
+{
+    uint16_t num_results = ARRAY_SIZE(scan_results);
+
+    if (!roam_scanning)
+        return;
+    k_work_cancel_delayable(&roam_scan_timeout_work);
+
+    esp_wifi_scan_get_ap_records(&num_results, scan_results);
+    for (uint16_t i = 0; i < num_results; i++)
+    {
+        if (memcmp(scan_results[i].bssid, roam_current.bssid, sizeof(roam_current.bssid)) == 0)
+            continue;
+        if (scan_results[i].rssi < roam_current.rssi + WIFI_CONN_ROAM_RSSI_MARGIN)
+            continue;
+        if (!roam_target_found || scan_results[i].rssi > roam_target.rssi)
+        {
+            roam_target = scan_results[i];
+            roam_target_found = true;
+        }
+    }
+
+    roam_scan_next();
+}
+
+static void roam_scan_timeout(struct k_work *work)
+{
+    if (!roam_scanning)
+        return;
+
+    LOG_WRN("roam scan timed out");
+    esp_wifi_scan_stop();
+    roam_scan_abort();
+}
+
+static void roam_scan_finish()
+{
+    wifi_config_t cfg;
+
+    roam_scanning = false;
+    if (!roam_target_found)
+    {
+        LOG_DBG("no stronger AP than %d dBm", roam_current.rssi);
+        k_work_reschedule_for_queue(&roam_work_q, &roam_sample_work,
+                                    K_MSEC(WIFI_CONN_ROAM_HOLDOFF_MS));
+        return;
+    }
+
+    // the scan took a while, the box may have got busy meanwhile
+    if (!roam_allowed_cb())
+    {
+        k_work_reschedule_for_queue(&roam_work_q, &roam_sample_work,
+                                    K_MSEC(WIFI_CONN_ROAM_SAMPLE_MS));
+        return;
+    }
+
+    LOG_INF("roaming from %d dBm to %02x:%02x:%02x:%02x:%02x:%02x at %d dBm", roam_current.rssi,
+                roam_target.bssid[0], roam_target.bssid[1], roam_target.bssid[2],
+                roam_target.bssid[3], roam_target.bssid[4], roam_target.bssid[5],
+                roam_target.rssi);
+
+    esp_wifi_get_config(ESP_IF_WIFI_STA, &cfg);
+    cfg.sta.bssid_set = true;
+    memcpy(cfg.sta.bssid, roam_target.bssid, sizeof(cfg.sta.bssid));
+    cfg.sta.channel = roam_target.primary;
+
+    roaming = true;
+    roam_rssi_before = roam_current.rssi;
+    k_work_reschedule_for_queue(&roam_work_q, &roam_timeout_work, K_MSEC(WIFI_CONN_ROAM_TIMEOUT_MS));
+
+    esp_wifi_disconnect();
+    esp_wifi_set_config(ESP_IF_WIFI_STA, &cfg);
+    esp_wifi_connect();
+}
+
+static void roam_timeout(struct k_work *work)
+{
+    if (roaming)
+        finish_roam(false);
+}
+
+static void finish_roam(bool success)
+{
+    wifi_ap_record_t ap_info;
+
+    roaming = false;
+    k_work_cancel_delayable(&roam_timeout_work);
+
+    if (success && esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK)
+    {
+        roam_stats.roams++;
+        roam_stats.last_rssi_before = roam_rssi_before;
+        roam_stats.last_rssi_after = ap_info.rssi;
+        LOG_INF("roamed, rssi %d -> %d dBm (%u roams)", roam_rssi_before, ap_info.rssi,
+                    roam_stats.roams);
+        if (roam_cb != NULL)
+            roam_cb(true, ap_info.bssid, ap_info.primary);
+        return;
+    }
+
+    // the new AP never came up, treat it as a normal drop and let the
+    // owner rejoin from scratch
+    roam_stats.failed++;
+    LOG_WRN("roam failed (%u failures)", roam_stats.failed);
+    if (roam_cb != NULL)
+        roam_cb(false, NULL, 0);
+    k_work_cancel_delayable(&roam_sample_work);
+    net_state_cb(WIFI_CONN_STATE_DOWN, WIFI_CONN_STATE_DOWN);
+}
+
+void wifi_conn_get_roam_stats(struct wifi_conn_roam_stats *stats)
+{
+    *stats = roam_stats;
+}
+
+void wifi_conn_set_roam_cb(bool (*allowed_cb)(),
+                            void (*cb)(bool success, const uint8_t *bssid, uint8_t channel))
+{
+    roam_allowed_cb = allowed_cb;
+    roam_cb = cb;
+}
+
+void wifi_conn_set_net_state_cb(void (*cb)(uint8_t wifi_state, uint8_t net_state))
+{
+    net_state_cb = cb;
+}
\ No newline at end of file
@@ -0,0 +1,179 @@
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(wifi_mod, CONFIG_APP_LOG_LEVEL);
+
+#include <zephyr/zephyr.h>
+
+#include <net/net_if.h>
+#include <net/net_mgmt.h>
+#include <net/net_event.h>
+
+#include "wifi_conn.h"
+#include "settings_util.h"
+#include "energy_acct.h"
+
+/*
+*   wifi_conn on native_posix. The "network" is the host TAP interface
+*   (zeth) with a static address from NET_CONFIG, so joining is waiting for
+*   the interface to come up. Every configured network is reported in range
+*   at a fixed signal and roaming never triggers.
+*/
+
+#define WIFI_CONN_NATIVE_RSSI       -50
+#define WIFI_CONN_NATIVE_CHANNEL    1
+#define WIFI_CONN_NATIVE_UP_POLL_MS 100
+
+static struct net_if *net_iface;
+static bool joining;
+static bool wifi_connected;
+static struct wifi_conn_roam_stats roam_stats;
+
+static void (*net_state_cb)(uint8_t wifi_state, uint8_t net_state);
+static bool (*roam_allowed_cb)();
+static void (*roam_cb)(bool success, const uint8_t *bssid, uint8_t channel);
+
+static void join_poll(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(join_work, join_poll);
+static void report_down(struct k_work *work);
+static K_WORK_DEFINE(down_work, report_down);
+
+static void join_poll(struct k_work *work)
+{
+    if (!joining)
+        return;
+
+    if (!net_if_is_up(net_iface)
+        || net_if_ipv4_get_global_addr(net_iface, NET_ADDR_PREFERRED) == NULL)
+    {
+        k_work_reschedule(&join_work, K_MSEC(WIFI_CONN_NATIVE_UP_POLL_MS));
+        return;
+    }
+
+    joining = false;
+    wifi_connected = true;
+    LOG_INF("host interface up");
+    net_state_cb(WIFI_CONN_STATE_UP, WIFI_CONN_STATE_NO_CHANGE);
+    net_state_cb(WIFI_CONN_STATE_NO_CHANGE, WIFI_CONN_STATE_UP);
+}
+
+static void report_down(struct k_work *work)
+{
+    net_state_cb(WIFI_CONN_STATE_DOWN, WIFI_CONN_STATE_DOWN);
+}
+
+int wifi_conn_init()
+{
+    wifi_connected = false;
+
+    net_iface = net_if_get_default();
+    if (!net_iface) {
+        LOG_ERR("could not get netif");
+        return -1;
+    }
+    return 0;
+}
+
+void wifi_conn_connect()
+{
+    joining = true;
+    k_work_reschedule(&join_work, K_NO_WAIT);
+}
+
+void wifi_conn_disconnect()
+{
+    bool was_up = wifi_connected || joining;
+
+    joining = false;
+    wifi_connected = false;
+    k_work_cancel_delayable(&join_work);
+    // the ESP driver reports the drop from its event handler, not from
+    // inside this call, so report it from the system workqueue
+    if (was_up)
+        k_work_submit(&down_work);
+}
+
+void wifi_conn_reset()
+{
+}
+
+void wifi_conn_setup(struct wifi_config_settings *params)
+{
+    wifi_conn_setup_ap(params, NULL, 0);
+}
+
+void wifi_conn_setup_ap(struct wifi_config_settings *params, const uint8_t *bssid, uint8_t channel)
+{
+    LOG_INF("joining %s on the host interface", params->ssid);
+}
+
+int wifi_conn_select_network(const struct settings_wifi_network *networks, uint8_t count,
+                                struct wifi_conn_selection *selection)
+{
+    bool found = false;
+
+    // all in range at the same signal, priority alone decides
+    for (uint8_t i = 0; i < count; i++)
+    {
+        if (networks[i].ssid[0] == 0
+            || (found && networks[i].priority <= networks[selection->network].priority))
+            continue;
+
+        found = true;
+        memset(selection, 0, sizeof(*selection));
+        selection->network = i;
+        selection->channel = WIFI_CONN_NATIVE_CHANNEL;
+        selection->rssi = WIFI_CONN_NATIVE_RSSI;
+    }
+    return found ? 0 : -ENOENT;
+}
+
+int wifi_conn_get_ap(uint8_t *bssid, uint8_t *channel)
+{
+    if (!wifi_connected)
+        return -ENOTCONN;
+
+    memset(bssid, 0, 6);
+    *channel = WIFI_CONN_NATIVE_CHANNEL;
+    return 0;
+}
+
+int wifi_conn_get_signal(int8_t *rssi, uint8_t *channel)
+{
+    if (!wifi_connected)
+        return -ENOTCONN;
+
+    *rssi = WIFI_CONN_NATIVE_RSSI;
+    *channel = WIFI_CONN_NATIVE_CHANNEL;
+    return 0;
+}
+
+int wifi_conn_get_rssi(int8_t *rssi)
+{
+    uint8_t channel;
+
+    return wifi_conn_get_signal(rssi, &channel);
+}
+
+// nothing to switch, still accounted so the energy model sees the profile
+int wifi_conn_set_power_save(uint8_t level)
+{
+    energy_acct_set_radio_mode(level);
+    return 0;
+}
+
+void wifi_conn_set_net_state_cb(void (*cb)(uint8_t wifi_state, uint8_t net_state))
+{
+    net_state_cb = cb;
+}
+
+void wifi_conn_set_roam_cb(bool (*allowed_cb)(),
+                            void (*cb)(bool success, const uint8_t *bssid, uint8_t channel))
+{
+    roam_allowed_cb = allowed_cb;
+    roam_cb = cb;
+}
+
+void wifi_conn_get_roam_stats(struct wifi_conn_roam_stats *stats)
+{
+    *stats = roam_stats;
+}
@@ -0,0 +1,38 @@
+#!/usr/bin/env bash
+# Builds the test for nrf52_bsim and runs a gateway and a client on one
+# simulated PHY. The client finds the gateway from its status advertisement,
+# reads the relay nonce and sends tagged decisions; the gateway checks the
+# relay latency budget and that a record with a bad tag is refused.
+#
+#   BSIM_OUT_PATH and BSIM_COMPONENTS_PATH as set up for BabbleSim
+#   tests/bsim/ble_relay/run.sh
+
+set -u
+: "${BSIM_OUT_PATH:?BSIM_OUT_PATH must be defined}"
+: "${ZEPHYR_BASE:?ZEPHYR_BASE must be defined}"
+
+simulation_id="ble_relay"
+verbosity_level=2
+test_dir=$(cd "$(dirname "$0")" && pwd)
+build_dir=${test_dir}/build
+exe=${BSIM_OUT_PATH}/bin/bs_nrf52_bsim_owlcms_ble_relay
+
+west build -b nrf52_bsim -d "${build_dir}" "${test_dir}" || exit 1
+cp "${build_dir}/zephyr/zephyr.exe" "${exe}"
+
+process_ids=""
+exit_code=0
+
+cd "${BSIM_OUT_PATH}/bin"
+
+timeout 60 "${exe}" -v=${verbosity_level} -s=${simulation_id} -d=0 -testid=gateway &
+process_ids="$process_ids $!"
+timeout 60 "${exe}" -v=${verbosity_level} -s=${simulation_id} -d=1 -testid=client -rs=23 &
+process_ids="$process_ids $!"
+timeout 60 ./bs_2G4_phy_v1 -v=${verbosity_level} -s=${simulation_id} -D=2 -sim_length=20e6 &
+process_ids="$process_ids $!"
+
+for process_id in $process_ids; do
+    wait $process_id || exit_code=$?
+done
+exit $exit_code
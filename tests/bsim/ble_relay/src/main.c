@@ -0,0 +1,238 @@
+#include <zephyr/zephyr.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+
+#include "bs_types.h"
+#include "bs_tracing.h"
+#include "time_machine.h"
+#include "bstests.h"
+
+#include "ble_relay.h"
+#include "ble_status_adv.h"
+
+/*
+*   One gateway and one client on the same platform. The client relays a
+*   decision, then switches to the wrong key and relays another, which the
+*   gateway has to refuse.
+*/
+
+#define TEST_PLATFORM           "A"
+#define TEST_CLIENT_REF         2
+#define TEST_DECISION           1
+#define TEST_TIMEOUT_US         (15 * 1000 * 1000)
+
+#define FAIL(...) \
+    do { \
+        bst_result = Failed; \
+        bs_trace_error_time_line(__VA_ARGS__); \
+    } while (0)
+
+#define PASS(...) \
+    do { \
+        bst_result = Passed; \
+        bs_trace_info_time(1, __VA_ARGS__); \
+    } while (0)
+
+extern enum bst_result_t bst_result;
+
+static const uint8_t platform_key[BLE_RELAY_KEY_LEN] = {
+    0x4f, 0x57, 0x4c, 0x20, 0x72, 0x65, 0x6c, 0x61,
+    0x79, 0x20, 0x74, 0x65, 0x73, 0x74, 0x00, 0x01};
+static const uint8_t wrong_key[BLE_RELAY_KEY_LEN] = {
+    0x4f, 0x57, 0x4c, 0x20, 0x72, 0x65, 0x6c, 0x61,
+    0x79, 0x20, 0x74, 0x65, 0x73, 0x74, 0x00, 0x02};
+
+static K_SEM_DEFINE(rx_sem, 0, 2);
+static K_SEM_DEFINE(ready_sem, 0, 1);
+static K_SEM_DEFINE(sent_sem, 0, 1);
+static K_SEM_DEFINE(disconnected_sem, 0, 1);
+static struct ble_relay_decision last_rx;
+static int last_sent_err;
+
+// bsim has no wifi, the status advertisement reports the rssi as unknown
+int wifi_conn_get_rssi(int8_t *rssi)
+{
+    return -ENOTSUP;
+}
+
+static void test_disconnected(struct bt_conn *conn, uint8_t reason)
+{
+    k_sem_give(&disconnected_sem);
+}
+
+BT_CONN_CB_DEFINE(test_conn_callbacks) = {
+    .disconnected = test_disconnected,
+};
+
+static void relay_rx(const struct ble_relay_decision *decision)
+{
+    last_rx = *decision;
+    ble_relay_record_latency(decision);
+    k_sem_give(&rx_sem);
+}
+
+static void relay_ready(bool ready)
+{
+    if (ready)
+        k_sem_give(&ready_sem);
+}
+
+static void relay_sent(int err)
+{
+    last_sent_err = err;
+    k_sem_give(&sent_sem);
+}
+
+static void test_gateway_main()
+{
+    struct ble_relay_stats stats;
+    int ret;
+
+    ret = bt_enable(NULL);
+    if (ret != 0)
+    {
+        FAIL("bt_enable failed: %d\n", ret);
+        return;
+    }
+
+    ble_relay_init(relay_rx, relay_ready, relay_sent);
+    ble_relay_set_key(platform_key);
+    ble_status_adv_init(1);
+    ble_status_adv_set_platform(TEST_PLATFORM);
+    ble_status_adv_set_flags(BLE_STATUS_FLAG_WIFI | BLE_STATUS_FLAG_MQTT);
+    ble_relay_set_gateway_online(true);
+    ret = ble_relay_set_gateway(true);
+    if (ret != 0)
+    {
+        FAIL("gateway advertising failed: %d\n", ret);
+        return;
+    }
+
+    if (k_sem_take(&rx_sem, K_SECONDS(10)) != 0)
+    {
+        FAIL("no relayed decision\n");
+        return;
+    }
+    if (last_rx.ref_id != TEST_CLIENT_REF || last_rx.decision != TEST_DECISION)
+    {
+        FAIL("relayed ref %d decision %d\n", last_rx.ref_id, last_rx.decision);
+        return;
+    }
+
+    // the client drops the link once its badly tagged write is refused
+    if (k_sem_take(&disconnected_sem, K_SECONDS(5)) != 0)
+    {
+        FAIL("client never gave up on the bad record\n");
+        return;
+    }
+    if (k_sem_count_get(&rx_sem) != 0)
+    {
+        FAIL("gateway took a record with a bad tag\n");
+        return;
+    }
+
+    ble_relay_get_stats(&stats);
+    if (stats.relayed != 1 || stats.over_budget != 0)
+    {
+        FAIL("relayed %u, over budget %u, last %u ms\n", stats.relayed, stats.over_budget,
+                    stats.last_latency_ms);
+        return;
+    }
+
+    PASS("gateway relayed in %u ms\n", stats.last_latency_ms);
+}
+
+static void test_client_main()
+{
+    int ret;
+
+    ret = bt_enable(NULL);
+    if (ret != 0)
+    {
+        FAIL("bt_enable failed: %d\n", ret);
+        return;
+    }
+
+    ble_relay_init(relay_rx, relay_ready, relay_sent);
+    ble_relay_set_key(platform_key);
+    ret = ble_relay_client_start(TEST_PLATFORM);
+    if (ret != 0)
+    {
+        FAIL("client start failed: %d\n", ret);
+        return;
+    }
+
+    if (k_sem_take(&ready_sem, K_SECONDS(10)) != 0)
+    {
+        FAIL("no gateway link\n");
+        return;
+    }
+
+    ret = ble_relay_send_decision(TEST_CLIENT_REF, TEST_DECISION, k_cycle_get_32());
+    if (ret != 0 || k_sem_take(&sent_sem, K_SECONDS(2)) != 0 || last_sent_err != 0)
+    {
+        FAIL("relay write failed: %d/%d\n", ret, last_sent_err);
+        return;
+    }
+
+    // a box from another platform, or someone guessing
+    ble_relay_set_key(wrong_key);
+    ret = ble_relay_send_decision(TEST_CLIENT_REF, TEST_DECISION, k_cycle_get_32());
+    if (ret != 0 || k_sem_take(&sent_sem, K_SECONDS(2)) != 0)
+    {
+        FAIL("second relay write failed to send: %d\n", ret);
+        return;
+    }
+    if (last_sent_err == 0)
+    {
+        FAIL("gateway accepted a record with a bad tag\n");
+        return;
+    }
+
+    PASS("client relayed, bad tag refused\n");
+}
+
+static void test_init()
+{
+    bst_ticker_set_next_tick_absolute(TEST_TIMEOUT_US);
+    bst_result = In_progress;
+}
+
+static void test_tick(bs_time_t HW_device_time)
+{
+    if (bst_result != Passed)
+        FAIL("test timed out\n");
+}
+
+static const struct bst_test_instance test_def[] = {
+    {
+        .test_id = "gateway",
+        .test_descr = "relay gateway, checks the latency budget and tag",
+        .test_post_init_f = test_init,
+        .test_tick_f = test_tick,
+        .test_main_f = test_gateway_main
+    },
+    {
+        .test_id = "client",
+        .test_descr = "relay client, one good and one badly tagged decision",
+        .test_post_init_f = test_init,
+        .test_tick_f = test_tick,
+        .test_main_f = test_client_main
+    },
+    BSTEST_END_MARKER
+};
+
+struct bst_test_list *test_ble_relay_install(struct bst_test_list *tests)
+{
+    return bst_add_tests(tests, test_def);
+}
+
+bst_test_install_t test_installers[] = {
+    test_ble_relay_install,
+    NULL
+};
+
+void main(void)
+{
+    bst_main();
+}